@@ -18,7 +18,10 @@
 #ifndef _XCP_NG_VDI_STREAM_H_
 #define _XCP_NG_VDI_STREAM_H_
 
+#include <stdbool.h>
+#include <stdint.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 
 // =============================================================================
 
@@ -28,9 +31,100 @@ extern "C" {
 
 typedef struct XcpVdiStream XcpVdiStream;
 
+// Returned by the read functions in non-blocking mode if the next chunk is not ready.
+#define XCP_VDI_STREAM_WOULD_BLOCK (-2)
+
+// Engine used to read the image data, see xcp_vdi_stream_set_io_engine.
+typedef enum {
+  XCP_VDI_STREAM_IO_ENGINE_PREAD,   // Blocking reads, one at a time (default).
+  XCP_VDI_STREAM_IO_ENGINE_IO_URING // Reads of a chunk are queued and run concurrently.
+} XcpVdiStreamIoEngine;
+
+// Compression of the data clusters of the generated image, see xcp_vdi_stream_set_compression.
+typedef enum {
+  XCP_VDI_STREAM_COMPRESSION_NONE,    // Data clusters are copied (default).
+  XCP_VDI_STREAM_COMPRESSION_DEFLATE, // Supported by all the QCOW2 readers.
+  XCP_VDI_STREAM_COMPRESSION_ZSTD     // QCOW2 v3 only (compression type field), if built with zstd.
+} XcpVdiStreamCompression;
+
+#define XCP_VDI_STREAM_IO_FIXED_FILES (1 << 0)   // Register the image descriptors in the engine.
+#define XCP_VDI_STREAM_IO_FIXED_BUFFERS (1 << 1) // Register the chunk buffers in the engine.
+
+// Size of a stream output, see xcp_vdi_stream_get_size.
+typedef struct {
+  uint64_t size;         // Total byte count of the stream.
+  uint64_t metadataSize; // Headers and tables.
+  uint64_t dataSize;     // Data of the images.
+  uint64_t zeroSize;     // Virtual bytes described as zeros, they are not written in the stream.
+} XcpVdiStreamSize;
+
+// Counters of the metadata cache of a stream, see xcp_vdi_stream_get_cache_stats.
+typedef struct {
+  uint64_t hits;
+  uint64_t misses;
+  uint64_t evictions;
+  size_t memoryUsage; // Current size of the cached tables in bytes.
+} XcpVdiStreamCacheStats;
+
 XcpVdiStream *xcp_vdi_stream_new ();
 void xcp_vdi_stream_destroy (XcpVdiStream *stream);
 
+// Read the images with O_DIRECT: the page cache is not polluted by an export.
+// Not used if the file system does not support it. Must be called before xcp_vdi_stream_open.
+int xcp_vdi_stream_set_direct_io (XcpVdiStream *stream, bool enable);
+
+// Directory of the allocation indexes of the parent images (NULL to disable them). An index is built
+// at the first export of a parent, then the L2 tables of this parent are not read while it is unchanged.
+// Must be called before xcp_vdi_stream_open.
+int xcp_vdi_stream_set_index_dir (XcpVdiStream *stream, const char *dir);
+
+// Memory budget of the metadata tables read from the images (0 for a default size).
+// One cache is shared by all the images of the chain. The map of the chain runs built before the first read
+// has the same budget: the runs past it are looked up in the tables at each read instead of being stored.
+// Must be called before xcp_vdi_stream_open.
+int xcp_vdi_stream_set_cache_size (XcpVdiStream *stream, size_t memoryLimit);
+
+// Load the metadata tables of all the images in the cache at the stream opening (up to the cache size):
+// the tables are read in the physical order with large concurrent reads instead of one read per miss.
+// Must be called before xcp_vdi_stream_open.
+int xcp_vdi_stream_set_metadata_preload (XcpVdiStream *stream, bool enable);
+
+// Share the parent images with the other streams of the process which enable it: the common ancestors
+// of their chains (e.g. a template of cloned VDIs) are opened once and their metadata tables are read once.
+// These streams use one metadata cache, its size is the largest cache size of the streams.
+// Must be called before xcp_vdi_stream_open.
+int xcp_vdi_stream_set_image_sharing (XcpVdiStream *stream, bool enable);
+
+// Incremental export using a persistent dirty bitmap of the image (NULL for a full export): only the
+// clusters marked dirty in the bitmap are written, the other ones are unallocated. The generated image
+// must be used on top of the previous export, so a base cannot be given.
+// Must be called before xcp_vdi_stream_open.
+int xcp_vdi_stream_set_dirty_bitmap (XcpVdiStream *stream, const char *name);
+
+// Read the allocated clusters when the layout is computed: the ones which contain only zeros are written
+// as zero clusters without data. The export is smaller but the image data are read twice.
+// Ignored for QCOW2 v2 images (no zero clusters). Must be called before xcp_vdi_stream_open.
+int xcp_vdi_stream_set_zero_detection (XcpVdiStream *stream, bool enable);
+
+// Write the data clusters as compressed clusters, packed one after the other. The clusters which compress
+// poorly are stored uncompressed. The clusters are compressed by a pool of workers (0 for one per CPU):
+// a first time when the layout is computed (the compressed sizes give the offsets in the generated image),
+// then when they are streamed, ahead of the writes. The compressed clusters of the chain are also decompressed
+// by these workers, even without compression (XCP_VDI_STREAM_COMPRESSION_NONE only gives their count).
+// Must be called before xcp_vdi_stream_open.
+int xcp_vdi_stream_set_compression (XcpVdiStream *stream, XcpVdiStreamCompression compression, unsigned workerCount);
+
+// Write extended L2 entries: the clusters are divided in 32 subclusters and only the allocated subclusters
+// of the chain are written. The clusters which use different subclusters share one host cluster, so the
+// delta of an image with large clusters is not made of whole clusters. Requires a QCOW2 v3 image with
+// clusters of at least 16KiB, cannot be used with compression. Must be called before xcp_vdi_stream_open.
+int xcp_vdi_stream_set_extended_l2 (XcpVdiStream *stream, bool enable);
+
+// Cluster size of the generated image, a power of two between 512B and 2MiB (0 to use the cluster size
+// of the top image). The clusters of the chain are split or merged: small clusters reduce the size of
+// a sparse delta, large clusters reduce the metadata of a big disk. Must be called before xcp_vdi_stream_open.
+int xcp_vdi_stream_set_cluster_size (XcpVdiStream *stream, uint32_t clusterSize);
+
 int xcp_vdi_stream_open (XcpVdiStream *stream, const char *format, const char *filename, const char *base);
 int xcp_vdi_stream_close (XcpVdiStream *stream);
 
@@ -40,8 +134,79 @@ const char *xcp_vdi_stream_get_format (const XcpVdiStream *stream);
 
 void xcp_vdi_stream_dump_info (const XcpVdiStream *stream, int fd);
 
+// Compute the exact size of the stream output using only the metadata of the images.
+int xcp_vdi_stream_get_size (XcpVdiStream *stream, XcpVdiStreamSize *size);
+
+// Counters of the metadata cache since its creation, valid between xcp_vdi_stream_open and
+// xcp_vdi_stream_close (zeros if the format has no cache). With image sharing, these are the counters
+// of the cache shared by all the sharing streams of the process, not only the ones of this stream.
+int xcp_vdi_stream_get_cache_stats (XcpVdiStream *stream, XcpVdiStreamCacheStats *stats);
+
+// Produce chunks in a dedicated thread, ahead of xcp_vdi_stream_read calls.
+// The memory limit is the maximum size of the ring of chunk buffers (at least 2 chunks are used).
+// A zero limit disables the read-ahead. Must be called before the first read.
+int xcp_vdi_stream_set_read_ahead (XcpVdiStream *stream, size_t memoryLimit);
+
+// Give the next image reads to the kernel (WILLNEED) and drop the streamed image data of the page cache
+// (DONTNEED). The prefetch window follows the consumer rate. Not used with direct I/O.
+// Must be called before the first read.
+int xcp_vdi_stream_set_prefetch (XcpVdiStream *stream, bool enable);
+
+// In non-blocking mode, the chunks are produced by a pool of workers shared by all streams
+// and xcp_vdi_stream_read returns XCP_VDI_STREAM_WOULD_BLOCK until the next chunk is ready.
+// The event fd becomes readable when a chunk is done: it can be polled by an event loop.
+// The read-ahead size is used as memory limit of the chunks in progress. Must be called before the first read.
+int xcp_vdi_stream_set_non_blocking (XcpVdiStream *stream, bool enable);
+int xcp_vdi_stream_get_event_fd (XcpVdiStream *stream);
+
+// Select the engine used to read the image data of xcp_vdi_stream_read.
+// The queue depth is the max number of reads in flight (0 for a default depth), flags are
+// XCP_VDI_STREAM_IO_* values. If the engine is not available, blocking reads are used.
+// Must be called before the first read.
+int xcp_vdi_stream_set_io_engine (
+  XcpVdiStream *stream, XcpVdiStreamIoEngine engine, unsigned queueDepth, unsigned flags
+);
+
 ssize_t xcp_vdi_stream_read (XcpVdiStream *stream, const void **buf);
 
+// Like xcp_vdi_stream_read but the chunk is described by an iovec array without copy:
+// parts point to generated metadata, to a shared zero area or to read-only mappings of the images.
+// The array and its data are valid until the next call. Cannot be mixed with xcp_vdi_stream_read.
+ssize_t xcp_vdi_stream_readv (XcpVdiStream *stream, const struct iovec **iov, int *iovcnt);
+
+// Write the whole stream in a file descriptor, from its current position.
+// Image data are cloned (FICLONERANGE) or copied in the kernel (copy_file_range) when possible,
+// with a fallback to read/write. Cannot be used once the stream is started.
+int xcp_vdi_stream_write_to_fd (XcpVdiStream *stream, int fd);
+
+// Produce N bytes of the stream output at the given offset, without changing the stream state.
+// Returns the number of bytes read (lower than count at the end of the stream).
+// Can be called concurrently from several threads, also during a sequential read: the error string
+// of the stream is not changed, the error is copied in the given buffer (can be NULL) on failure.
+ssize_t xcp_vdi_stream_pread (
+  XcpVdiStream *stream, void *buf, size_t count, uint64_t offset, char *error, size_t errorSize
+);
+
+// Receive a part of the stream output located at the given offset.
+typedef int (*XcpVdiStreamShardCb)(const void *buf, size_t count, uint64_t offset, void *userData);
+
+// Produce the stream output (from the start offset, see xcp_vdi_stream_seek) with several threads.
+// The output is split in shards of shardSize bytes (0 for a default size), each one is produced
+// by a worker with xcp_vdi_stream_pread. The shards are given to the callback in the output order
+// if ordered is true, otherwise as soon as they are ready. The callback calls are serialized.
+int xcp_vdi_stream_export_shards (
+  XcpVdiStream *stream,
+  unsigned workerCount,
+  size_t shardSize,
+  bool ordered,
+  XcpVdiStreamShardCb cb,
+  void *userData
+);
+
+// Restart the stream at an output offset: the next read returns the bytes from this position.
+// Useful to resume an interrupted export, the previous bytes are not regenerated.
+int xcp_vdi_stream_seek (XcpVdiStream *stream, uint64_t offset);
+
 #ifdef __cplusplus
 }
 #endif // ifdef __cplusplus
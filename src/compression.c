@@ -0,0 +1,438 @@
+/*
+ * xcp-ng-vdi-stream
+ * Copyright (C) 2019  Vates SAS - ronan.abhamon@vates.fr
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#ifdef HAVE_ZSTD
+  #include <zstd.h>
+  #include <zstd_errors.h>
+#endif // ifdef HAVE_ZSTD
+
+#include <xcp-ng/generic/math.h>
+
+#include "compression.h"
+#include "error.h"
+#include "global.h"
+
+// =============================================================================
+
+// Window of the raw deflate streams: 4KiB like qemu, the readers use the same size.
+#define DEFLATE_WINDOW_BITS (-12)
+
+struct Compressor {
+  XcpVdiStreamCompression type;
+  union {
+    z_stream deflate;
+    #ifdef HAVE_ZSTD
+      ZSTD_CCtx *zstd;
+    #endif // ifdef HAVE_ZSTD
+  };
+};
+
+// -----------------------------------------------------------------------------
+
+bool compression_is_supported (XcpVdiStreamCompression type) {
+  switch (type) {
+    case XCP_VDI_STREAM_COMPRESSION_NONE:
+    case XCP_VDI_STREAM_COMPRESSION_DEFLATE:
+      return true;
+    case XCP_VDI_STREAM_COMPRESSION_ZSTD:
+      #ifdef HAVE_ZSTD
+        return true;
+      #else
+        return false;
+      #endif // ifdef HAVE_ZSTD
+  }
+  return false;
+}
+
+Compressor *compressor_create (XcpVdiStreamCompression type, char **error) {
+  if (type == XCP_VDI_STREAM_COMPRESSION_NONE || !compression_is_supported(type)) {
+    set_error(error, "Unsupported compression %d", (int)type);
+    return NULL;
+  }
+
+  Compressor *compressor = calloc(1, sizeof *compressor);
+  if (!compressor) {
+    set_error(error, "Failed to alloc compressor");
+    return NULL;
+  }
+  compressor->type = type;
+
+  #ifdef HAVE_ZSTD
+    if (type == XCP_VDI_STREAM_COMPRESSION_ZSTD) {
+      if (!(compressor->zstd = ZSTD_createCCtx())) {
+        set_error(error, "Failed to create zstd context");
+        free(compressor);
+        return NULL;
+      }
+      return compressor;
+    }
+  #endif // ifdef HAVE_ZSTD
+
+  if (deflateInit2(
+    &compressor->deflate, Z_DEFAULT_COMPRESSION, Z_DEFLATED, DEFLATE_WINDOW_BITS, 9, Z_DEFAULT_STRATEGY
+  ) != Z_OK) {
+    set_error(error, "Failed to init deflate stream");
+    free(compressor);
+    return NULL;
+  }
+  return compressor;
+}
+
+void compressor_destroy (Compressor *compressor) {
+  if (!compressor)
+    return;
+
+  #ifdef HAVE_ZSTD
+    if (compressor->type == XCP_VDI_STREAM_COMPRESSION_ZSTD)
+      ZSTD_freeCCtx(compressor->zstd);
+    else
+  #endif // ifdef HAVE_ZSTD
+      deflateEnd(&compressor->deflate);
+
+  free(compressor);
+}
+
+// -----------------------------------------------------------------------------
+
+static ssize_t compress_deflate (
+  Compressor *compressor, const void *src, size_t srcSize, void *dst, size_t maxSize, char **error
+) {
+  z_stream *stream = &compressor->deflate;
+  if (deflateReset(stream) != Z_OK) {
+    set_error(error, "Failed to reset deflate stream");
+    return -1;
+  }
+
+  stream->next_in = (Bytef *)src;
+  stream->avail_in = (uInt)srcSize;
+  stream->next_out = dst;
+  stream->avail_out = (uInt)maxSize;
+
+  const int ret = deflate(stream, Z_FINISH);
+  if (ret == Z_STREAM_END)
+    return (ssize_t)(maxSize - stream->avail_out);
+  if (ret == Z_OK || ret == Z_BUF_ERROR)
+    return 0; // Not enough space.
+
+  set_error(error, "Failed to deflate cluster (%d)", ret);
+  return -1;
+}
+
+#ifdef HAVE_ZSTD
+  static ssize_t compress_zstd (
+    Compressor *compressor, const void *src, size_t srcSize, void *dst, size_t maxSize, char **error
+  ) {
+    const size_t ret = ZSTD_compressCCtx(compressor->zstd, dst, maxSize, src, srcSize, ZSTD_CLEVEL_DEFAULT);
+    if (!ZSTD_isError(ret))
+      return (ssize_t)ret;
+    if (ZSTD_getErrorCode(ret) == ZSTD_error_dstSize_tooSmall)
+      return 0;
+
+    set_error(error, "Failed to compress cluster with zstd (%s)", ZSTD_getErrorName(ret));
+    return -1;
+  }
+#endif // ifdef HAVE_ZSTD
+
+ssize_t compressor_compress (
+  Compressor *compressor, const void *src, size_t srcSize, void *dst, size_t maxSize, char **error
+) {
+  #ifdef HAVE_ZSTD
+    if (compressor->type == XCP_VDI_STREAM_COMPRESSION_ZSTD)
+      return compress_zstd(compressor, src, srcSize, dst, maxSize, error);
+  #endif // ifdef HAVE_ZSTD
+
+  return compress_deflate(compressor, src, srcSize, dst, maxSize, error);
+}
+
+// -----------------------------------------------------------------------------
+
+static int decompress_deflate (const void *src, size_t srcSize, void *dst, size_t dstSize, char **error) {
+  z_stream stream = {
+    .next_in = (Bytef *)src,
+    .avail_in = (uInt)srcSize,
+    .next_out = dst,
+    .avail_out = (uInt)dstSize
+  };
+  if (inflateInit2(&stream, DEFLATE_WINDOW_BITS) != Z_OK) {
+    set_error(error, "Failed to init inflate stream");
+    return -1;
+  }
+
+  // The compressed data can be followed by garbage: the end of the last sector is not used.
+  const int ret = inflate(&stream, Z_FINISH);
+  inflateEnd(&stream);
+  if (stream.avail_out || (ret != Z_STREAM_END && ret != Z_OK && ret != Z_BUF_ERROR)) {
+    set_error(error, "Failed to inflate cluster (%d)", ret);
+    return -1;
+  }
+  return 0;
+}
+
+#ifdef HAVE_ZSTD
+  static int decompress_zstd (const void *src, size_t srcSize, void *dst, size_t dstSize, char **error) {
+    ZSTD_DCtx *context = ZSTD_createDCtx();
+    if (!context) {
+      set_error(error, "Failed to create zstd context");
+      return -1;
+    }
+
+    // Stream API: the frame is read until its end, the bytes after it are ignored.
+    ZSTD_inBuffer input = { .src = src, .size = srcSize, .pos = 0 };
+    ZSTD_outBuffer output = { .dst = dst, .size = dstSize, .pos = 0 };
+    size_t ret;
+    do {
+      ret = ZSTD_decompressStream(context, &output, &input);
+    } while (!ZSTD_isError(ret) && ret && output.pos < output.size && input.pos < input.size);
+    ZSTD_freeDCtx(context);
+
+    if (ZSTD_isError(ret)) {
+      set_error(error, "Failed to decompress cluster with zstd (%s)", ZSTD_getErrorName(ret));
+      return -1;
+    }
+    if (output.pos != output.size) {
+      set_error(error, "Truncated zstd cluster (%zu/%zu bytes)", output.pos, output.size);
+      return -1;
+    }
+    return 0;
+  }
+#endif // ifdef HAVE_ZSTD
+
+int decompress_cluster (
+  XcpVdiStreamCompression type, const void *src, size_t srcSize, void *dst, size_t dstSize, char **error
+) {
+  switch (type) {
+    case XCP_VDI_STREAM_COMPRESSION_DEFLATE:
+      return decompress_deflate(src, srcSize, dst, dstSize, error);
+    case XCP_VDI_STREAM_COMPRESSION_ZSTD:
+      #ifdef HAVE_ZSTD
+        return decompress_zstd(src, srcSize, dst, dstSize, error);
+      #else
+        set_error(error, "Unable to decompress zstd cluster: built without zstd");
+        return -1;
+      #endif // ifdef HAVE_ZSTD
+    case XCP_VDI_STREAM_COMPRESSION_NONE:
+      break;
+  }
+
+  set_error(error, "Unsupported compression %d", (int)type);
+  return -1;
+}
+
+// =============================================================================
+
+typedef struct {
+  CompressionPool *pool;
+  pthread_t thread;
+
+  Compressor *compressor; // NULL if the clusters are only read.
+  unsigned char *input;   // Data of the cluster, aligned for O_DIRECT.
+  unsigned char *scratch; // Output of the jobs without buffer.
+} CompressionWorker;
+
+struct CompressionPool {
+  pthread_mutex_t mutex;
+  pthread_cond_t queueCond; // Signaled when a job is queued or when the pool is stopped.
+  pthread_cond_t doneCond;  // Signaled when a job is done.
+  TAILQ_HEAD(, CompressionJob) queue;
+  bool stop;
+
+  size_t clusterSize;
+  size_t maxCompressedSize;
+  CompressionReadCb cb;
+  void *userData;
+
+  CompressionWorker *workers;
+  unsigned workerCount; // Started workers.
+};
+
+static void *compression_pool_worker (void *userData) {
+  CompressionWorker *worker = userData;
+  CompressionPool *pool = worker->pool;
+
+  pthread_mutex_lock(&pool->mutex);
+  for (;;) {
+    CompressionJob *job;
+    while (!(job = TAILQ_FIRST(&pool->queue)) && !pool->stop)
+      pthread_cond_wait(&pool->queueCond, &pool->mutex);
+    if (!job)
+      break;
+
+    TAILQ_REMOVE(&pool->queue, job, entry);
+    job->state = CompressionJobRunning;
+    pthread_mutex_unlock(&pool->mutex);
+
+    char *error = NULL;
+    ssize_t size = -1;
+    if (!worker->compressor) {
+      if ((*pool->cb)(job->cluster, job->output, pool->userData, &error) == 0)
+        size = (ssize_t)pool->clusterSize;
+    } else if ((*pool->cb)(job->cluster, worker->input, pool->userData, &error) == 0)
+      size = compressor_compress(
+        worker->compressor, worker->input, pool->clusterSize, job->output ? job->output : worker->scratch,
+        pool->maxCompressedSize, &error
+      );
+
+    pthread_mutex_lock(&pool->mutex);
+    job->size = size > 0 ? (size_t)size : 0;
+    job->error = size < 0 ? error : NULL;
+    if (size >= 0)
+      free(error);
+    job->state = CompressionJobDone;
+    pthread_cond_broadcast(&pool->doneCond);
+  }
+  pthread_mutex_unlock(&pool->mutex);
+
+  return NULL;
+}
+
+static void compression_worker_uninit (CompressionWorker *worker) {
+  compressor_destroy(worker->compressor);
+  free(worker->input);
+  free(worker->scratch);
+}
+
+CompressionPool *compression_pool_create (
+  XcpVdiStreamCompression type,
+  unsigned workerCount,
+  size_t clusterSize,
+  size_t maxCompressedSize,
+  CompressionReadCb cb,
+  void *userData,
+  char **error
+) {
+  if (!workerCount) {
+    const long cpuCount = sysconf(_SC_NPROCESSORS_ONLN);
+    workerCount = cpuCount > 0 ? (unsigned)XCP_MIN(cpuCount, (long)COMPRESSION_POOL_MAX_WORKERS) : 1;
+  }
+  workerCount = XCP_MIN(workerCount, COMPRESSION_POOL_MAX_WORKERS);
+
+  CompressionPool *pool = calloc(1, sizeof *pool);
+  if (!pool || !(pool->workers = calloc(workerCount, sizeof *pool->workers))) {
+    set_error(error, "Failed to alloc compression pool (%s)", strerror(errno));
+    free(pool);
+    return NULL;
+  }
+
+  pthread_mutex_init(&pool->mutex, NULL);
+  pthread_cond_init(&pool->queueCond, NULL);
+  pthread_cond_init(&pool->doneCond, NULL);
+  TAILQ_INIT(&pool->queue);
+  pool->clusterSize = clusterSize;
+  pool->maxCompressedSize = maxCompressedSize;
+  pool->cb = cb;
+  pool->userData = userData;
+
+  for (; pool->workerCount < workerCount; ++pool->workerCount) {
+    CompressionWorker *worker = &pool->workers[pool->workerCount];
+    worker->pool = pool;
+    if (type != XCP_VDI_STREAM_COMPRESSION_NONE && (
+      !(worker->compressor = compressor_create(type, error)) ||
+      !(worker->input = aligned_block_alloc(clusterSize)) ||
+      !(worker->scratch = malloc(maxCompressedSize))
+    )) {
+      if (worker->compressor)
+        set_error(error, "Failed to alloc compression buffers (%s)", strerror(errno));
+      compression_worker_uninit(worker);
+      break;
+    }
+
+    const int ret = pthread_create(&worker->thread, NULL, compression_pool_worker, worker);
+    if (ret) {
+      set_error(error, "Failed to create compression worker (%s)", strerror(ret));
+      compression_worker_uninit(worker);
+      break;
+    }
+  }
+
+  if (pool->workerCount < workerCount) {
+    compression_pool_destroy(pool);
+    return NULL;
+  }
+
+  return pool;
+}
+
+void compression_pool_destroy (CompressionPool *pool) {
+  if (!pool)
+    return;
+
+  // The jobs must be done or canceled by their owners before this call.
+  pthread_mutex_lock(&pool->mutex);
+  pool->stop = true;
+  pthread_cond_broadcast(&pool->queueCond);
+  pthread_mutex_unlock(&pool->mutex);
+
+  for (unsigned i = 0; i < pool->workerCount; ++i) {
+    pthread_join(pool->workers[i].thread, NULL);
+    compression_worker_uninit(&pool->workers[i]);
+  }
+  free(pool->workers);
+
+  pthread_cond_destroy(&pool->doneCond);
+  pthread_cond_destroy(&pool->queueCond);
+  pthread_mutex_destroy(&pool->mutex);
+  free(pool);
+}
+
+unsigned compression_pool_get_worker_count (const CompressionPool *pool) {
+  return pool->workerCount;
+}
+
+void compression_pool_submit (CompressionPool *pool, CompressionJob *job) {
+  pthread_mutex_lock(&pool->mutex);
+  job->state = CompressionJobQueued;
+  TAILQ_INSERT_TAIL(&pool->queue, job, entry);
+  pthread_cond_signal(&pool->queueCond);
+  pthread_mutex_unlock(&pool->mutex);
+}
+
+int compression_pool_wait (CompressionPool *pool, CompressionJob *job, char **error) {
+  pthread_mutex_lock(&pool->mutex);
+  while (job->state != CompressionJobDone)
+    pthread_cond_wait(&pool->doneCond, &pool->mutex);
+  job->state = CompressionJobIdle;
+  pthread_mutex_unlock(&pool->mutex);
+
+  if (!job->error)
+    return 0;
+
+  set_error(error, "%s", job->error);
+  free(job->error);
+  job->error = NULL;
+  return -1;
+}
+
+void compression_pool_cancel (CompressionPool *pool, CompressionJob *job) {
+  pthread_mutex_lock(&pool->mutex);
+  if (job->state == CompressionJobQueued)
+    TAILQ_REMOVE(&pool->queue, job, entry);
+  else
+    while (job->state == CompressionJobRunning)
+      pthread_cond_wait(&pool->doneCond, &pool->mutex);
+  job->state = CompressionJobIdle;
+  pthread_mutex_unlock(&pool->mutex);
+
+  free(job->error);
+  job->error = NULL;
+}
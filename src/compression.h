@@ -0,0 +1,106 @@
+/*
+ * xcp-ng-vdi-stream
+ * Copyright (C) 2019  Vates SAS - ronan.abhamon@vates.fr
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef _XCP_NG_VDI_STREAM_COMPRESSION_H_
+#define _XCP_NG_VDI_STREAM_COMPRESSION_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/queue.h>
+#include <sys/types.h>
+
+#include "xcp-ng/vdi-stream.h"
+
+// =============================================================================
+// Compression of QCOW2 clusters: raw deflate with a 4KiB window (like qemu) or one zstd frame.
+// =============================================================================
+
+typedef struct Compressor Compressor;
+
+// Returns false if the library is built without this compression.
+bool compression_is_supported (XcpVdiStreamCompression type);
+
+Compressor *compressor_create (XcpVdiStreamCompression type, char **error);
+void compressor_destroy (Compressor *compressor);
+
+// Compress N bytes. Returns the compressed size, 0 if it is greater than maxSize or -1 on error.
+// The output only depends on the input: a buffer compressed twice gives the same bytes.
+ssize_t compressor_compress (
+  Compressor *compressor, const void *src, size_t srcSize, void *dst, size_t maxSize, char **error
+);
+
+// Decompress a cluster of dstSize bytes. The bytes which follow the compressed data in src are ignored.
+int decompress_cluster (
+  XcpVdiStreamCompression type, const void *src, size_t srcSize, void *dst, size_t dstSize, char **error
+);
+
+// =============================================================================
+// Pool of workers which compress clusters. Each worker reads the data of a cluster with the callback
+// of the pool, then compresses it with its own compressor.
+// Without compression, the workers only read the clusters: the reads of compressed clusters
+// of the chain are decompressed in parallel.
+// =============================================================================
+
+// Max number of workers of a pool.
+#define COMPRESSION_POOL_MAX_WORKERS 64u
+
+typedef int (*CompressionReadCb)(uint64_t cluster, void *buf, void *userData, char **error);
+
+typedef struct CompressionJob {
+  TAILQ_ENTRY(CompressionJob) entry; // In the pool queue.
+
+  uint64_t cluster;
+  unsigned char *output; // Compressed data (or read data without compression). If NULL, only the size is computed.
+  size_t size;           // Compressed size, 0 if the cluster does not fit in maxCompressedSize.
+  char *error;
+
+  enum {
+    CompressionJobIdle,
+    CompressionJobQueued,
+    CompressionJobRunning,
+    CompressionJobDone
+  } state;
+} CompressionJob;
+
+typedef struct CompressionPool CompressionPool;
+
+// Create workerCount workers, 0 for one per CPU. The clusters are compressed only if their size is lower
+// or equal to maxCompressedSize.
+CompressionPool *compression_pool_create (
+  XcpVdiStreamCompression type,
+  unsigned workerCount,
+  size_t clusterSize,
+  size_t maxCompressedSize,
+  CompressionReadCb cb,
+  void *userData,
+  char **error
+);
+void compression_pool_destroy (CompressionPool *pool);
+
+unsigned compression_pool_get_worker_count (const CompressionPool *pool);
+
+// The job must be idle. Its output buffer must contain maxCompressedSize bytes
+// (clusterSize bytes aligned for O_DIRECT without compression).
+void compression_pool_submit (CompressionPool *pool, CompressionJob *job);
+
+// Wait for a submitted job. The job is idle after the call.
+int compression_pool_wait (CompressionPool *pool, CompressionJob *job, char **error);
+
+// Remove a queued job or wait for the end of a running one. The job is idle after the call.
+void compression_pool_cancel (CompressionPool *pool, CompressionJob *job);
+
+#endif // ifndef _XCP_NG_VDI_STREAM_COMPRESSION_H_
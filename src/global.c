@@ -17,6 +17,7 @@
 
 #include <errno.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 
 #include <xcp-ng/generic/math.h>
@@ -37,3 +38,29 @@ void *aligned_block_alloc (size_t size) {
   }
   return ptr;
 }
+
+XcpError direct_safe_pread (int fd, void *buf, size_t count, off_t offset) {
+  const XcpError ret = xcp_fd_pread(fd, buf, count, offset);
+  if (ret != XCP_ERR_ERRNO || errno != EINVAL)
+    return ret;
+
+  // EINVAL: Unaligned request on a O_DIRECT descriptor (e.g. header or sub-sector backing filename).
+  const size_t delta = (size_t)offset & (DIRECT_IO_ALIGNMENT - 1);
+  const size_t size = (delta + count + DIRECT_IO_ALIGNMENT - 1) & ~(size_t)(DIRECT_IO_ALIGNMENT - 1);
+  char *bounce = aligned_block_alloc(size);
+  if (!bounce)
+    return XCP_ERR_ERRNO;
+
+  XcpError bounceRet = xcp_fd_pread(fd, bounce, size, offset - (off_t)delta);
+  if (bounceRet != XCP_ERR_ERRNO) {
+    // The end of file can be reached before the end of the aligned range.
+    bounceRet = (size_t)bounceRet > delta ? (ssize_t)XCP_MIN((size_t)bounceRet - delta, count) : 0;
+    memcpy(buf, bounce + delta, (size_t)bounceRet);
+  }
+
+  const int error = errno;
+  free(bounce);
+  errno = error;
+
+  return bounceRet;
+}
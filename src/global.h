@@ -21,6 +21,7 @@
 #include <limits.h>
 #include <stdint.h>
 
+#include <xcp-ng/generic/io.h>
 #include <xcp-ng/generic/math.h>
 
 // =============================================================================
@@ -35,6 +36,13 @@
 
 #define SIZE_TO_SECTOR_COUNT(SIZE) SECTOR_ROUND_UP(SIZE) >> N_BITS_PER_SECTOR
 
+// Alignment of buffers, offsets and sizes supported by O_DIRECT on all block devices.
+#define DIRECT_IO_ALIGNMENT 4096u
+
 void *aligned_block_alloc (size_t size);
 
+// Same as xcp_fd_pread but it also supports unaligned requests on O_DIRECT descriptors:
+// the aligned range which contains the request is read in a bounce buffer.
+XcpError direct_safe_pread (int fd, void *buf, size_t count, off_t offset);
+
 #endif // ifndef _XCP_NG_VDI_STREAM_GLOBAL_H_
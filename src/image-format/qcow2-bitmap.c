@@ -0,0 +1,374 @@
+/*
+ * xcp-ng-vdi-stream
+ * Copyright (C) 2019  Vates SAS - ronan.abhamon@vates.fr
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <xcp-ng/generic/endian.h>
+
+#include "error.h"
+#include "global.h"
+#include "image-format/qcow2-bitmap.h"
+
+// =============================================================================
+
+typedef struct {
+  uint32_t nbBitmaps;          //  0-3: Number of bitmaps in the directory.
+  uint32_t reserved;           //  4-7: Must be zero.
+  uint64_t directorySize;      //  8-15: Size of the bitmap directory in bytes.
+  uint64_t directoryOffset;    // 16-23: Offset of the bitmap directory in the image.
+} XCP_PACKED QCow2BitmapsExtension;
+
+// Followed by the extra data and the name, the entry is padded to a multiple of 8 bytes.
+typedef struct {
+  uint64_t tableOffset;        //  0-7: Offset of the bitmap table.
+  uint32_t tableSize;          //  8-11: Number of entries in the bitmap table.
+  uint32_t flags;              // 12-15: See QCOW2_BITMAP_FLAG_*.
+  uint8_t type;                // 16: See QCOW2_BITMAP_TYPE_*.
+  uint8_t granularityBits;     // 17: A bit covers 1 << granularityBits bytes.
+  uint16_t nameSize;           // 18-19: Name size, without null terminator.
+  uint32_t extraDataSize;      // 20-23: Size of the extra data.
+} XCP_PACKED QCow2BitmapDirectoryEntry;
+
+static inline uint64_t round_up_8 (uint64_t value) {
+  return (value + 7) & ~7ULL;
+}
+
+// -----------------------------------------------------------------------------
+
+// Read `count` bytes at `offset`, a short read is an error.
+static int read_exact (const QCow2Image *image, void *buf, size_t count, uint64_t offset, const char *what, char **error) {
+  const XcpError ret = direct_safe_pread(image->fd, buf, count, (off_t)offset);
+  if (ret == XCP_ERR_ERRNO) {
+    set_error(error, "Failed to read %s at offset %#" PRIx64 " in %s (%s)", what, offset, image->filename, strerror(errno));
+    return -1;
+  }
+  if ((size_t)ret != count) {
+    set_error(error, "Truncated %s at offset %#" PRIx64 " in %s", what, offset, image->filename);
+    return -1;
+  }
+  return 0;
+}
+
+// Find the bitmaps extension after the header. The extensions are stored in the first cluster.
+static int find_bitmaps_extension (const QCow2Image *image, QCow2BitmapsExtension *extension, char **error) {
+  const uint32_t clusterSize = image->clusterSize;
+  char *cluster = aligned_block_alloc(clusterSize);
+  if (!cluster) {
+    set_error(error, "Unable to allocate header cluster (%s)", strerror(errno));
+    return -1;
+  }
+
+  int ret = -1;
+  if (read_exact(image, cluster, clusterSize, 0, "header cluster", error) < 0)
+    goto end;
+
+  for (uint64_t offset = image->header.headerLength; offset + sizeof(QCow2Extension) <= clusterSize; ) {
+    QCow2Extension ext;
+    memcpy(&ext, cluster + offset, sizeof ext);
+    const uint32_t type = xcp_from_be_u32(ext.type);
+    const uint32_t len = xcp_from_be_u32(ext.len);
+    if (type == QCOW2_EXTENSION_TYPE_END)
+      break;
+
+    offset += sizeof ext;
+    if (offset + len > clusterSize) {
+      set_error(error, "Invalid header extension %#" PRIx32 " in %s", type, image->filename);
+      goto end;
+    }
+
+    if (type == QCOW2_EXTENSION_TYPE_BITMAPS) {
+      if (len < sizeof *extension) {
+        set_error(error, "Bitmaps extension is too short in %s", image->filename);
+        goto end;
+      }
+
+      memcpy(extension, cluster + offset, sizeof *extension);
+      extension->nbBitmaps = xcp_from_be_u32(extension->nbBitmaps);
+      extension->reserved = xcp_from_be_u32(extension->reserved);
+      extension->directorySize = xcp_from_be_u64(extension->directorySize);
+      extension->directoryOffset = xcp_from_be_u64(extension->directoryOffset);
+      ret = 0;
+      goto end;
+    }
+
+    offset += round_up_8(len);
+  }
+
+  set_error(error, "No bitmaps in %s", image->filename);
+
+end:
+  free(cluster);
+  return ret;
+}
+
+// Copy in `entry` the directory entry of the bitmap `name`.
+static int search_directory (
+  const QCow2Image *image,
+  const char *directory,
+  size_t directorySize,
+  uint32_t nbBitmaps,
+  const char *name,
+  QCow2BitmapDirectoryEntry *entry,
+  char **error
+) {
+  const size_t nameSize = strlen(name);
+  uint64_t offset = 0;
+  for (uint32_t i = 0; i < nbBitmaps; ++i) {
+    if (offset + sizeof *entry > directorySize) {
+      set_error(error, "Invalid bitmap directory in %s", image->filename);
+      return -1;
+    }
+
+    memcpy(entry, directory + offset, sizeof *entry);
+    entry->tableOffset = xcp_from_be_u64(entry->tableOffset);
+    entry->tableSize = xcp_from_be_u32(entry->tableSize);
+    entry->flags = xcp_from_be_u32(entry->flags);
+    entry->nameSize = xcp_from_be_u16(entry->nameSize);
+    entry->extraDataSize = xcp_from_be_u32(entry->extraDataSize);
+
+    const uint64_t nameOffset = offset + sizeof *entry + entry->extraDataSize;
+    if (nameOffset + entry->nameSize > directorySize) {
+      set_error(error, "Invalid bitmap directory in %s", image->filename);
+      return -1;
+    }
+
+    if (entry->nameSize == nameSize && !memcmp(directory + nameOffset, name, nameSize))
+      return 0;
+
+    offset = round_up_8(nameOffset + entry->nameSize);
+  }
+
+  set_error(error, "Unable to find bitmap `%s` in %s", name, image->filename);
+  return -1;
+}
+
+static int find_bitmap (
+  const QCow2Image *image,
+  const QCow2BitmapsExtension *extension,
+  const char *name,
+  QCow2BitmapDirectoryEntry *entry,
+  char **error
+) {
+  if (extension->directorySize > QCOW2_BITMAP_MAX_DIRECTORY_SIZE) {
+    set_error(error, "Bitmap directory is so big in %s", image->filename);
+    return -1;
+  }
+
+  const size_t directorySize = (size_t)extension->directorySize;
+  char *directory = aligned_block_alloc(directorySize);
+  if (!directory) {
+    set_error(error, "Unable to allocate bitmap directory (%s)", strerror(errno));
+    return -1;
+  }
+
+  const int ret = read_exact(image, directory, directorySize, extension->directoryOffset, "bitmap directory", error) < 0
+    ? -1
+    : search_directory(image, directory, directorySize, extension->nbBitmaps, name, entry, error);
+  free(directory);
+  return ret;
+}
+
+static int check_bitmap (const QCow2Image *image, const QCow2BitmapDirectoryEntry *entry, const char *name, char **error) {
+  if (entry->flags & QCOW2_BITMAP_FLAG_IN_USE) {
+    set_error(error, "Bitmap `%s` of %s is in use (not saved cleanly)", name, image->filename);
+    return -1;
+  }
+
+  if (entry->flags & ~(QCOW2_BITMAP_FLAG_IN_USE | QCOW2_BITMAP_FLAG_AUTO)) {
+    set_error(error, "Unsupported flags %#" PRIx32 " of bitmap `%s`", entry->flags, name);
+    return -1;
+  }
+
+  if (entry->type != QCOW2_BITMAP_TYPE_DIRTY_TRACKING) {
+    set_error(error, "Bitmap `%s` is not a dirty tracking bitmap", name);
+    return -1;
+  }
+
+  // Unknown extra data: the bitmap must not be used.
+  if (entry->extraDataSize) {
+    set_error(error, "Unsupported extra data of bitmap `%s`", name);
+    return -1;
+  }
+
+  if (
+    entry->granularityBits < QCOW2_BITMAP_MIN_GRANULARITY_BITS ||
+    entry->granularityBits > QCOW2_BITMAP_MAX_GRANULARITY_BITS
+  ) {
+    set_error(error, "Invalid granularity bits '%" PRIu8 "' of bitmap `%s`", entry->granularityBits, name);
+    return -1;
+  }
+
+  if (qcow2_image_offset_to_cluster_padding(image, entry->tableOffset)) {
+    set_error(error, "Unaligned table of bitmap `%s`: %#" PRIx64, name, entry->tableOffset);
+    return -1;
+  }
+
+  return 0;
+}
+
+// Load the data clusters of the bitmap table.
+static int load_bits (
+  QCow2DirtyBitmap *bitmap, const QCow2Image *image, const QCow2BitmapDirectoryEntry *entry, const char *name, char **error
+) {
+  const uint32_t clusterSize = image->clusterSize;
+  const size_t bitsSize = (size_t)((bitmap->granuleCount + 7) >> 3);
+  const uint64_t tableSize = (bitsSize + clusterSize - 1) >> image->header.clusterBits;
+  if (entry->tableSize < tableSize) {
+    set_error(error, "Table of bitmap `%s` is too small", name);
+    return -1;
+  }
+
+  uint64_t *table = aligned_block_alloc(SECTOR_ROUND_UP(tableSize * sizeof *table));
+  if (!table) {
+    set_error(error, "Unable to allocate table of bitmap `%s` (%s)", name, strerror(errno));
+    return -1;
+  }
+
+  int ret = -1;
+  if (read_exact(image, table, tableSize * sizeof *table, entry->tableOffset, "bitmap table", error) < 0)
+    goto end;
+
+  for (uint64_t i = 0; i < tableSize; ++i) {
+    const uint64_t tableEntry = xcp_from_be_u64(table[i]);
+    const uint64_t offset = tableEntry & QCOW2_BITMAP_TABLE_ENTRY_OFFSET_MASK;
+    uint8_t *bits = bitmap->bits + (i << image->header.clusterBits);
+    const size_t size = XCP_MIN(clusterSize, bitsSize - (size_t)(i << image->header.clusterBits));
+
+    if (!offset)
+      memset(bits, (tableEntry & QCOW2_BITMAP_TABLE_ENTRY_FLAG_ALL_ONES) ? 0xFF : 0, size);
+    else if (qcow2_image_offset_to_cluster_padding(image, offset)) {
+      set_error(error, "Unaligned data cluster of bitmap `%s`: %#" PRIx64, name, offset);
+      goto end;
+    } else if (read_exact(image, bits, size, offset, "bitmap data", error) < 0)
+      goto end;
+  }
+  ret = 0;
+
+end:
+  free(table);
+  return ret;
+}
+
+// -----------------------------------------------------------------------------
+
+int qcow2_dirty_bitmap_load (QCow2DirtyBitmap *bitmap, const QCow2Image *image, const char *name, char **error) {
+  *bitmap = (QCow2DirtyBitmap){ 0 };
+
+  if (image->header.version != 3) {
+    set_error(error, "Bitmaps are only supported by QCOW2 v3 images");
+    return -1;
+  }
+
+  QCow2BitmapsExtension extension;
+  if (find_bitmaps_extension(image, &extension, error) < 0)
+    return -1;
+
+  // The image was modified by a program which does not update the bitmaps.
+  if (!(image->header.autoclearFeatures & QCOW2_AUTOCLEAR_FEATURE_BITMAPS)) {
+    set_error(error, "Bitmaps of %s are inconsistent with the image data", image->filename);
+    return -1;
+  }
+
+  QCow2BitmapDirectoryEntry entry;
+  if (find_bitmap(image, &extension, name, &entry, error) < 0 || check_bitmap(image, &entry, name, error) < 0)
+    return -1;
+
+  bitmap->granularityBits = entry.granularityBits;
+  bitmap->granuleCount = (image->header.size + (1ULL << entry.granularityBits) - 1) >> entry.granularityBits;
+
+  // Rounded up to 8 bytes: qcow2_dirty_bitmap_find_dirty reads whole words.
+  if (!(bitmap->bits = aligned_block_alloc((size_t)round_up_8((bitmap->granuleCount + 7) >> 3)))) {
+    set_error(error, "Unable to allocate bitmap `%s` (%s)", name, strerror(errno));
+    return -1;
+  }
+
+  if (load_bits(bitmap, image, &entry, name, error) < 0) {
+    qcow2_dirty_bitmap_destroy(bitmap);
+    return -1;
+  }
+
+  return 0;
+}
+
+void qcow2_dirty_bitmap_destroy (QCow2DirtyBitmap *bitmap) {
+  free(bitmap->bits);
+  *bitmap = (QCow2DirtyBitmap){ 0 };
+}
+
+// -----------------------------------------------------------------------------
+
+static inline bool is_dirty_granule (const QCow2DirtyBitmap *bitmap, uint64_t granule) {
+  return (bitmap->bits[granule >> 3] >> (granule & 7)) & 1;
+}
+
+uint64_t qcow2_dirty_bitmap_find_dirty (const QCow2DirtyBitmap *bitmap, uint64_t vaddr) {
+  const uint32_t granularityBits = bitmap->granularityBits;
+  const uint64_t granuleCount = bitmap->granuleCount;
+  uint64_t granule = vaddr >> granularityBits;
+
+  // 1. Bits of the first byte.
+  for (; granule < granuleCount && (granule & 7); ++granule)
+    if (is_dirty_granule(bitmap, granule))
+      goto found;
+
+  // 2. Skip the clean words. The backup of a mostly unchanged disk is mainly spent here.
+  for (; granule + 64 <= granuleCount; granule += 64) {
+    uint64_t word;
+    memcpy(&word, bitmap->bits + (granule >> 3), sizeof word);
+    if (word)
+      break;
+  }
+
+  // 3. Dirty word or last bits.
+  for (; granule < granuleCount; ++granule)
+    if (is_dirty_granule(bitmap, granule))
+      goto found;
+
+  return UINT64_MAX;
+
+found:
+  return XCP_MAX(vaddr, granule << granularityBits);
+}
+
+uint64_t qcow2_dirty_bitmap_find_clean (const QCow2DirtyBitmap *bitmap, uint64_t vaddr) {
+  const uint32_t granularityBits = bitmap->granularityBits;
+  const uint64_t granuleCount = bitmap->granuleCount;
+  uint64_t granule = vaddr >> granularityBits;
+
+  // 1. Bits of the first byte.
+  for (; granule < granuleCount && (granule & 7); ++granule)
+    if (!is_dirty_granule(bitmap, granule))
+      goto found;
+
+  // 2. Skip the dirty words.
+  for (; granule + 64 <= granuleCount; granule += 64) {
+    uint64_t word;
+    memcpy(&word, bitmap->bits + (granule >> 3), sizeof word);
+    if (word != UINT64_MAX)
+      break;
+  }
+
+  // 3. Clean word or last bits.
+  for (; granule < granuleCount && is_dirty_granule(bitmap, granule); ++granule);
+
+found:
+  return XCP_MAX(vaddr, granule << granularityBits);
+}
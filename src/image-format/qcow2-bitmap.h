@@ -0,0 +1,72 @@
+/*
+ * xcp-ng-vdi-stream
+ * Copyright (C) 2019  Vates SAS - ronan.abhamon@vates.fr
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef _XCP_NG_VDI_STREAM_QCOW2_BITMAP_H_
+#define _XCP_NG_VDI_STREAM_QCOW2_BITMAP_H_
+
+#include <stdint.h>
+
+#include "image-format/qcow2.h"
+
+// =============================================================================
+// Persistent dirty bitmaps stored in the bitmaps header extension of a QCOW2 v3 image.
+// See the "Bitmaps extension" section of the spec file.
+// =============================================================================
+
+#define QCOW2_EXTENSION_TYPE_END 0
+#define QCOW2_EXTENSION_TYPE_BITMAPS 0x23852875
+
+// The bitmaps of the extension are consistent with the image data only if this bit is set.
+#define QCOW2_AUTOCLEAR_FEATURE_BITMAPS (1ULL << 0)
+
+#define QCOW2_BITMAP_FLAG_IN_USE (1u << 0)
+#define QCOW2_BITMAP_FLAG_AUTO (1u << 1)
+
+#define QCOW2_BITMAP_TYPE_DIRTY_TRACKING 1
+
+#define QCOW2_BITMAP_MIN_GRANULARITY_BITS 9
+#define QCOW2_BITMAP_MAX_GRANULARITY_BITS 31
+
+// Same limit as qemu.
+#define QCOW2_BITMAP_MAX_DIRECTORY_SIZE (64u << 20)
+
+// Bits 9-55 of the offset of a bitmap data cluster. If it is 0, bit 0 gives the value of all the bits of the cluster.
+#define QCOW2_BITMAP_TABLE_ENTRY_OFFSET_MASK 0x00FFFFFFFFFFFE00ULL
+#define QCOW2_BITMAP_TABLE_ENTRY_FLAG_ALL_ONES (1ULL << 0)
+
+// -----------------------------------------------------------------------------
+
+typedef struct {
+  uint8_t *bits; // One bit per granule, least significant bit first.
+  uint64_t granuleCount;
+  uint32_t granularityBits; // A granule covers 1 << granularityBits bytes.
+} QCow2DirtyBitmap;
+
+// Load the bitmap `name` of an image. It is an error if the bitmap does not exist,
+// if it was not saved cleanly (in use flag) or if it is not a dirty tracking bitmap.
+int qcow2_dirty_bitmap_load (QCow2DirtyBitmap *bitmap, const QCow2Image *image, const char *name, char **error);
+void qcow2_dirty_bitmap_destroy (QCow2DirtyBitmap *bitmap);
+
+// Give the first address >= vaddr of a dirty granule (vaddr itself if its granule is dirty),
+// or UINT64_MAX if there is no dirty granule after vaddr.
+uint64_t qcow2_dirty_bitmap_find_dirty (const QCow2DirtyBitmap *bitmap, uint64_t vaddr);
+
+// Give the first address >= vaddr of a clean granule (vaddr itself if its granule is clean).
+// The addresses after the end of the bitmap are clean.
+uint64_t qcow2_dirty_bitmap_find_clean (const QCow2DirtyBitmap *bitmap, uint64_t vaddr);
+
+#endif // ifndef _XCP_NG_VDI_STREAM_QCOW2_BITMAP_H_
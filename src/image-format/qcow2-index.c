@@ -0,0 +1,398 @@
+/*
+ * xcp-ng-vdi-stream
+ * Copyright (C) 2019  Vates SAS - ronan.abhamon@vates.fr
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <xcp-ng/generic/file.h>
+#include <xcp-ng/generic/io.h>
+
+#include "error.h"
+#include "global.h"
+#include "image-format/qcow2-index.h"
+
+// =============================================================================
+
+// "XVSIDX01": the file is written in the host byte order, an index of another host is rebuilt.
+#define QCOW2_INDEX_MAGIC 0x3130584449535658ULL
+
+#define QCOW2_INDEX_TYPE_MASK 0xFULL
+
+// Max bytes requested to the L2 tables at once during a build.
+#define QCOW2_INDEX_MAX_REQUEST_SIZE (1ULL << 30)
+
+typedef struct {
+  uint64_t magic;
+
+  // Key of the image: the index is rebuilt if one of these fields is changed.
+  uint64_t device;
+  uint64_t inode;
+  uint64_t size;
+  int64_t mtimeSec;
+  int64_t mtimeNsec;
+  uint64_t headerChecksum;
+
+  uint64_t clusterCount;
+  uint64_t runCount;
+} QCow2IndexHeader;
+
+// -----------------------------------------------------------------------------
+
+// FNV-1a.
+static uint64_t checksum_update (uint64_t hash, const void *buf, size_t count) {
+  const unsigned char *data = buf;
+  for (size_t i = 0; i < count; ++i) {
+    hash ^= data[i];
+    hash *= 0x100000001B3ULL;
+  }
+  return hash;
+}
+
+static int qcow2_index_init_header (const QCow2Image *image, QCow2IndexHeader *header) {
+  struct stat st;
+  if (fstat(image->fd, &st) < 0 || qcow2_image_load_l1_table(image, NULL) < 0)
+    return -1;
+
+  memset(header, 0, sizeof *header);
+  header->magic = QCOW2_INDEX_MAGIC;
+  header->device = (uint64_t)st.st_dev;
+  header->inode = (uint64_t)st.st_ino;
+  header->size = (uint64_t)st.st_size;
+  header->mtimeSec = (int64_t)st.st_mtim.tv_sec;
+  header->mtimeNsec = (int64_t)st.st_mtim.tv_nsec;
+
+  // The L1 table is small: it is added to detect a change with a preserved mtime.
+  uint64_t hash = checksum_update(0xCBF29CE484222325ULL, &image->header, sizeof image->header);
+  if (image->l1Table)
+    hash = checksum_update(hash, image->l1Table, image->header.l1Size * sizeof *image->l1Table);
+  header->headerChecksum = hash;
+
+  header->clusterCount = qcow2_image_cluster_count_from_size(image, image->header.size);
+  return 0;
+}
+
+static inline bool qcow2_index_header_is_valid (
+  const QCow2IndexHeader *header, const QCow2IndexHeader *expected, size_t fileSize
+) {
+  return
+    header->magic == expected->magic &&
+    header->device == expected->device &&
+    header->inode == expected->inode &&
+    header->size == expected->size &&
+    header->mtimeSec == expected->mtimeSec &&
+    header->mtimeNsec == expected->mtimeNsec &&
+    header->headerChecksum == expected->headerChecksum &&
+    header->clusterCount == expected->clusterCount &&
+    header->runCount <= (fileSize - sizeof *header) / sizeof(QCow2IndexRun) &&
+    fileSize == sizeof *header + header->runCount * sizeof(QCow2IndexRun);
+}
+
+static bool qcow2_index_runs_are_valid (const QCow2IndexRun *runs, uint64_t runCount, uint64_t clusterCount) {
+  if (!runCount)
+    return !clusterCount;
+  if (runs[0].cluster)
+    return false;
+
+  for (uint64_t i = 0; i < runCount; ++i) {
+    const uint64_t end = i + 1 < runCount ? runs[i + 1].cluster : clusterCount;
+    if (runs[i].cluster >= end)
+      return false;
+
+    const uint32_t typeMask = (uint32_t)(runs[i].entry & QCOW2_INDEX_TYPE_MASK);
+    if ((typeMask & ClusterTypeCompressed) || !(typeMask & (ClusterTypeAllocated | ClusterTypeUnallocated)))
+      return false;
+  }
+  return true;
+}
+
+// -----------------------------------------------------------------------------
+
+static QCow2Index *qcow2_index_create (
+  void *mapping, size_t mappingSize, const QCow2IndexRun *runs, uint64_t runCount, uint64_t clusterCount
+) {
+  QCow2Index *index = malloc(sizeof *index);
+  if (index) {
+    index->mapping = mapping;
+    index->mappingSize = mappingSize;
+    index->runs = runs;
+    index->runCount = runCount;
+    index->clusterCount = clusterCount;
+  }
+  return index;
+}
+
+static QCow2Index *qcow2_index_map_file (int dirFd, const char *name, const QCow2IndexHeader *expected) {
+  const int fd = openat(dirFd, name, O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    return NULL;
+
+  struct stat st;
+  void *mapping = MAP_FAILED;
+  if (fstat(fd, &st) == 0 && (size_t)st.st_size >= sizeof(QCow2IndexHeader))
+    mapping = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  xcp_fd_close(fd);
+  if (mapping == MAP_FAILED)
+    return NULL;
+
+  const size_t mappingSize = (size_t)st.st_size;
+  const QCow2IndexHeader *header = mapping;
+  const QCow2IndexRun *runs = (const QCow2IndexRun *)(header + 1);
+
+  QCow2Index *index = NULL;
+  if (
+    qcow2_index_header_is_valid(header, expected, mappingSize) &&
+    qcow2_index_runs_are_valid(runs, header->runCount, header->clusterCount)
+  )
+    index = qcow2_index_create(mapping, mappingSize, runs, header->runCount, header->clusterCount);
+
+  if (!index)
+    munmap(mapping, mappingSize);
+  return index;
+}
+
+// -----------------------------------------------------------------------------
+
+typedef struct {
+  QCow2IndexRun *runs;
+  uint64_t count;
+  uint64_t capacity;
+} QCow2IndexBuilder;
+
+static int qcow2_index_builder_push (
+  QCow2IndexBuilder *builder, uint32_t clusterBits, uint64_t cluster, uint64_t clustersOffset, uint32_t typeMask
+) {
+  // 1. Merge with the previous run: same rules as the contiguous clusters of a L2 table.
+  if (builder->count) {
+    const QCow2IndexRun *last = &builder->runs[builder->count - 1];
+    if (
+      (last->entry & QCOW2_INDEX_TYPE_MASK) == typeMask && (
+        !(typeMask & ClusterTypeAllocated) ||
+        (last->entry & ~QCOW2_INDEX_TYPE_MASK) + ((cluster - last->cluster) << clusterBits) == clustersOffset
+      )
+    )
+      return 0;
+  }
+
+  // 2. Otherwise add a new run.
+  if (builder->count == builder->capacity) {
+    const uint64_t capacity = builder->capacity ? builder->capacity << 1 : 64;
+    QCow2IndexRun *runs = realloc(builder->runs, (size_t)capacity * sizeof *runs);
+    if (!runs)
+      return -1;
+    builder->runs = runs;
+    builder->capacity = capacity;
+  }
+  builder->runs[builder->count++] = (QCow2IndexRun){ .cluster = cluster, .entry = clustersOffset | typeMask };
+
+  return 0;
+}
+
+// Read all the L2 tables of an image to build its runs.
+static int qcow2_index_build_runs (const QCow2Image *image, uint64_t clusterCount, QCow2IndexBuilder *builder) {
+  const uint32_t clusterBits = image->header.clusterBits;
+
+  for (uint64_t cluster = 0; cluster < clusterCount; ) {
+    const uint64_t nBytes = XCP_MIN((clusterCount - cluster) << clusterBits, QCOW2_INDEX_MAX_REQUEST_SIZE);
+
+    char *error = NULL;
+    size_t nAvailableBytes;
+    uint32_t typeMask;
+    const uint64_t clustersOffset = qcow2_image_find_clusters_offset(
+      image, cluster << clusterBits, (size_t)nBytes, &nAvailableBytes, &typeMask, &error
+    );
+    if (clustersOffset == (uint64_t)-1) {
+      debug_log("Unable to index `%s`: %s.", image->filename, error);
+      free(error);
+      return -1;
+    }
+
+    // The descriptors of the compressed clusters cannot be stored in the runs: the L2 tables are used.
+    if (typeMask & ClusterTypeCompressed) {
+      debug_log("Unable to index `%s`: compressed clusters are not indexed.", image->filename);
+      return -1;
+    }
+
+    if (qcow2_index_builder_push(builder, clusterBits, cluster, clustersOffset, typeMask) < 0)
+      return -1;
+    cluster += nAvailableBytes >> clusterBits;
+  }
+
+  return 0;
+}
+
+static QCow2Index *qcow2_index_build (const QCow2Image *image, uint64_t clusterCount) {
+  QCow2IndexBuilder builder = { .runs = NULL, .count = 0, .capacity = 0 };
+
+  QCow2Index *index = NULL;
+  if (qcow2_index_build_runs(image, clusterCount, &builder) == 0)
+    index = qcow2_index_create(NULL, 0, builder.runs, builder.count, clusterCount);
+
+  if (!index)
+    free(builder.runs);
+  return index;
+}
+
+// Number of names tried to create a temporary index file.
+#define QCOW2_INDEX_TMP_NAME_TRIES 16
+
+// Create a temporary file which is not used by another stream of this process or of another one.
+static int qcow2_index_create_tmp_file (int dirFd, const char *name, char *tmpName, size_t tmpNameSize) {
+  static uint64_t tmpFileCount;
+
+  for (int i = 0; i < QCOW2_INDEX_TMP_NAME_TRIES; ++i) {
+    const uint64_t id = __atomic_fetch_add(&tmpFileCount, 1, __ATOMIC_RELAXED);
+    snprintf(tmpName, tmpNameSize, "%s.%ld.%" PRIu64 ".tmp", name, (long)getpid(), id);
+
+    const int fd = openat(dirFd, tmpName, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+    if (fd >= 0 || errno != EEXIST)
+      return fd;
+  }
+  return -1;
+}
+
+// Write the index in a temporary file renamed at the end: a reader never sees a partial index.
+// The file is synced before the rename, so after a crash the index is either complete or missing.
+static void qcow2_index_save (int dirFd, const char *name, const QCow2IndexHeader *header, const QCow2Index *index) {
+  char tmpName[128];
+  const int fd = qcow2_index_create_tmp_file(dirFd, name, tmpName, sizeof tmpName);
+  if (fd < 0) {
+    debug_log("Unable to create temporary index file of `%s` (%s).", name, strerror(errno));
+    return;
+  }
+
+  QCow2IndexHeader fileHeader = *header;
+  fileHeader.runCount = index->runCount;
+
+  const size_t runsSize = (size_t)index->runCount * sizeof *index->runs;
+  const bool success =
+    xcp_fd_write(fd, &fileHeader, sizeof fileHeader) == (XcpError)sizeof fileHeader &&
+    xcp_fd_write(fd, index->runs, runsSize) == (XcpError)runsSize &&
+    fsync(fd) == 0;
+  xcp_fd_close(fd);
+
+  if (!success || renameat(dirFd, tmpName, dirFd, name) < 0) {
+    debug_log("Unable to write index file `%s` (%s).", name, strerror(errno));
+    unlinkat(dirFd, tmpName, 0);
+    return;
+  }
+
+  // The rename is durable once the directory is synced.
+  fsync(dirFd);
+}
+
+static void qcow2_image_load_index (QCow2Image *image, int dirFd) {
+  // The runs are made of whole clusters: the subclusters are not indexed.
+  if (image->extendedL2) {
+    debug_log("Unable to index `%s`: extended L2 entries are not indexed.", image->filename);
+    return;
+  }
+
+  QCow2IndexHeader header;
+  if (qcow2_index_init_header(image, &header) < 0)
+    return;
+
+  char name[64];
+  snprintf(name, sizeof name, "%016" PRIx64 "-%016" PRIx64 ".qcow2-index", header.device, header.inode);
+
+  QCow2Index *index = qcow2_index_map_file(dirFd, name, &header);
+  if (index)
+    debug_log("Loaded index of `%s`: %" PRIu64 " runs.", image->filename, index->runCount);
+  else if ((index = qcow2_index_build(image, header.clusterCount))) {
+    debug_log("Built index of `%s`: %" PRIu64 " runs.", image->filename, index->runCount);
+    qcow2_index_save(dirFd, name, &header, index);
+  } else
+    return;
+
+  // A shared image can be indexed by another chain at the same time, the first index is kept.
+  QCow2Index *expected = NULL;
+  if (!__atomic_compare_exchange_n(&image->index, &expected, index, false, __ATOMIC_RELEASE, __ATOMIC_ACQUIRE))
+    qcow2_index_destroy(index);
+}
+
+// =============================================================================
+
+int qcow2_chain_load_indexes (QCow2Chain *chain, const char *dir, char **error) {
+  const int dirFd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (dirFd < 0) {
+    set_error(error, "Unable to open index dir `%s` (%s)", dir, strerror(errno));
+    return -1;
+  }
+
+  // The parents are snapshots: they are not modified during their life.
+  // The base and its parents are rarely used, they are not indexed.
+  for (QCow2Image *image = chain->image.parent; image && image != chain->base; image = image->parent)
+    if (!qcow2_image_get_index(image))
+      qcow2_image_load_index(image, dirFd);
+
+  xcp_fd_close(dirFd);
+  return 0;
+}
+
+void qcow2_index_destroy (QCow2Index *index) {
+  if (index->mapping)
+    munmap(index->mapping, index->mappingSize);
+  else
+    free((QCow2IndexRun *)index->runs);
+  free(index);
+}
+
+uint64_t qcow2_index_find_clusters_offset (
+  const QCow2Index *index, const QCow2Image *image, uint64_t vaddr, size_t nBytes, size_t *nAvailableBytes,
+  uint32_t *typeMask
+) {
+  const uint32_t clusterBits = image->header.clusterBits;
+  const uint64_t cluster = vaddr >> clusterBits;
+
+  // Like the L2 tables: no cluster is allocated after the virtual size.
+  if (cluster >= index->clusterCount) {
+    *nAvailableBytes = nBytes;
+    *typeMask = ClusterTypeUnallocated;
+    return 0;
+  }
+
+  // 1. Find the run of the cluster.
+  size_t low = 0;
+  size_t high = (size_t)index->runCount;
+  while (high - low > 1) {
+    const size_t mid = low + (high - low) / 2;
+    if (index->runs[mid].cluster <= cluster)
+      low = mid;
+    else
+      high = mid;
+  }
+
+  const QCow2IndexRun *run = &index->runs[low];
+  const uint64_t endCluster = low + 1 < index->runCount ? run[1].cluster : index->clusterCount;
+
+  // 2. Compute available bytes at this vaddr.
+  const uint32_t clusterPadding = qcow2_image_offset_to_cluster_padding(image, vaddr);
+  const uint64_t availableBytes = XCP_MIN((endCluster - cluster) << clusterBits, (uint64_t)nBytes + clusterPadding);
+  *nAvailableBytes = (size_t)availableBytes - clusterPadding;
+
+  *typeMask = (uint32_t)(run->entry & QCOW2_INDEX_TYPE_MASK);
+  if (!(*typeMask & ClusterTypeAllocated))
+    return 0;
+  return (run->entry & ~QCOW2_INDEX_TYPE_MASK) + ((cluster - run->cluster) << clusterBits);
+}
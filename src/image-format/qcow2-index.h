@@ -0,0 +1,61 @@
+/*
+ * xcp-ng-vdi-stream
+ * Copyright (C) 2019  Vates SAS - ronan.abhamon@vates.fr
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef _XCP_NG_VDI_STREAM_QCOW2_INDEX_H_
+#define _XCP_NG_VDI_STREAM_QCOW2_INDEX_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "image-format/qcow2.h"
+
+// =============================================================================
+// Allocation index of an image stored in a sidecar file: the L2 tables of an unchanged
+// image are never read again, the cluster lookups use a run-length map of the L2 entries.
+// =============================================================================
+
+// Run of clusters of the same type (and contiguous host offsets if allocated).
+typedef struct {
+  uint64_t cluster; // First virtual cluster, the run ends at the first cluster of the next one.
+  uint64_t entry;   // Host offset of the first cluster | type mask.
+} QCow2IndexRun;
+
+struct QCow2Index {
+  void *mapping; // Mapping of the sidecar file, NULL if the runs were built in memory.
+  size_t mappingSize;
+
+  const QCow2IndexRun *runs;
+  uint64_t runCount;
+  uint64_t clusterCount; // Virtual clusters of the image.
+};
+
+// -----------------------------------------------------------------------------
+
+// Attach an index to the parents of chain->image. Indexes are loaded from `dir` if they are
+// still valid (same inode, size, mtime and header checksum), otherwise they are rebuilt and saved.
+// A missing index is not an error: the L2 tables are used. Returns -1 if the dir cannot be opened.
+int qcow2_chain_load_indexes (QCow2Chain *chain, const char *dir, char **error);
+
+void qcow2_index_destroy (QCow2Index *index);
+
+// Same as qcow2_image_find_clusters_offset using the index of the image.
+uint64_t qcow2_index_find_clusters_offset (
+  const QCow2Index *index, const QCow2Image *image, uint64_t vaddr, size_t nBytes, size_t *nAvailableBytes,
+  uint32_t *typeMask
+);
+
+#endif // ifndef _XCP_NG_VDI_STREAM_QCOW2_INDEX_H_
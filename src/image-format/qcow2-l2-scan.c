@@ -0,0 +1,154 @@
+/*
+ * xcp-ng-vdi-stream
+ * Copyright (C) 2019  Vates SAS - ronan.abhamon@vates.fr
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <xcp-ng/generic/endian.h>
+
+#include "image-format/qcow2-l2-scan.h"
+#include "simd.h"
+
+#if defined(__x86_64__) && defined(__GNUC__)
+  #define QCOW2_L2_SCAN_X86 1
+  #include <immintrin.h>
+#endif
+
+// =============================================================================
+
+static uint32_t count_sequence_scalar (
+  const uint64_t *entries, uint32_t count, uint64_t mask, uint64_t value, uint64_t step
+) {
+  uint32_t i;
+  for (i = 0; i < count; ++i) {
+    if ((xcp_from_be_u64(entries[i]) & mask) != value)
+      break;
+    value += step;
+  }
+  return i;
+}
+
+static void from_be_scalar (uint64_t *values, size_t count) {
+  for (size_t i = 0; i < count; ++i)
+    xcp_from_be_u64_p(&values[i]);
+}
+
+// -----------------------------------------------------------------------------
+
+#ifdef QCOW2_L2_SCAN_X86
+
+__attribute__((target("avx2"))) static inline __m256i bswap64_avx2 (__m256i v) {
+  const __m256i shuffle = _mm256_setr_epi8(
+    7, 6, 5, 4, 3, 2, 1, 0, 15, 14, 13, 12, 11, 10, 9, 8,
+    7, 6, 5, 4, 3, 2, 1, 0, 15, 14, 13, 12, 11, 10, 9, 8
+  );
+  return _mm256_shuffle_epi8(v, shuffle);
+}
+
+__attribute__((target("avx2"))) static uint32_t count_sequence_avx2 (
+  const uint64_t *entries, uint32_t count, uint64_t mask, uint64_t value, uint64_t step
+) {
+  const __m256i vmask = _mm256_set1_epi64x((long long)mask);
+  const __m256i vstep = _mm256_set1_epi64x((long long)(step << 2));
+  __m256i expected = _mm256_setr_epi64x(
+    (long long)value, (long long)(value + step), (long long)(value + 2 * step), (long long)(value + 3 * step)
+  );
+
+  uint32_t i = 0;
+  for (; i + 4 <= count; i += 4) {
+    const __m256i v = _mm256_and_si256(bswap64_avx2(_mm256_loadu_si256((const __m256i *)(entries + i))), vmask);
+    const unsigned equal = (unsigned)_mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpeq_epi64(v, expected)));
+    if (equal != 0xF)
+      return i + (uint32_t)__builtin_ctz(~equal);
+    expected = _mm256_add_epi64(expected, vstep);
+  }
+
+  return i + count_sequence_scalar(entries + i, count - i, mask, value + i * step, step);
+}
+
+__attribute__((target("avx2"))) static void from_be_avx2 (uint64_t *values, size_t count) {
+  size_t i = 0;
+  for (; i + 4 <= count; i += 4) {
+    __m256i *p = (__m256i *)(values + i);
+    _mm256_storeu_si256(p, bswap64_avx2(_mm256_loadu_si256(p)));
+  }
+  from_be_scalar(values + i, count - i);
+}
+
+// -----------------------------------------------------------------------------
+
+__attribute__((target("sse4.1"))) static inline __m128i bswap64_sse4 (__m128i v) {
+  const __m128i shuffle = _mm_setr_epi8(7, 6, 5, 4, 3, 2, 1, 0, 15, 14, 13, 12, 11, 10, 9, 8);
+  return _mm_shuffle_epi8(v, shuffle);
+}
+
+__attribute__((target("sse4.1"))) static uint32_t count_sequence_sse4 (
+  const uint64_t *entries, uint32_t count, uint64_t mask, uint64_t value, uint64_t step
+) {
+  const __m128i vmask = _mm_set1_epi64x((long long)mask);
+  const __m128i vstep = _mm_set1_epi64x((long long)(step << 1));
+  __m128i expected = _mm_set_epi64x((long long)(value + step), (long long)value);
+
+  uint32_t i = 0;
+  for (; i + 2 <= count; i += 2) {
+    const __m128i v = _mm_and_si128(bswap64_sse4(_mm_loadu_si128((const __m128i *)(entries + i))), vmask);
+    const unsigned equal = (unsigned)_mm_movemask_pd(_mm_castsi128_pd(_mm_cmpeq_epi64(v, expected)));
+    if (equal != 0x3)
+      return i + (uint32_t)__builtin_ctz(~equal);
+    expected = _mm_add_epi64(expected, vstep);
+  }
+
+  return i + count_sequence_scalar(entries + i, count - i, mask, value + i * step, step);
+}
+
+__attribute__((target("sse4.1"))) static void from_be_sse4 (uint64_t *values, size_t count) {
+  size_t i = 0;
+  for (; i + 2 <= count; i += 2) {
+    __m128i *p = (__m128i *)(values + i);
+    _mm_storeu_si128(p, bswap64_sse4(_mm_loadu_si128(p)));
+  }
+  from_be_scalar(values + i, count - i);
+}
+
+#endif // ifdef QCOW2_L2_SCAN_X86
+
+// =============================================================================
+
+static uint32_t (*CountSequence)(const uint64_t *, uint32_t, uint64_t, uint64_t, uint64_t) = count_sequence_scalar;
+static void (*FromBe)(uint64_t *, size_t) = from_be_scalar;
+
+#ifdef QCOW2_L2_SCAN_X86
+  // A kernel can be forced with QCOW2_L2_SCAN_KERNEL_ENV to test all of them. If it is not supported
+  // by the CPU, the next best one is used.
+  static void __attribute__((constructor)) qcow2_l2_scan_select_kernels () {
+    const SimdLevel level = simd_get_level(QCOW2_L2_SCAN_KERNEL_ENV);
+    if (level >= SimdLevelAvx2) {
+      CountSequence = count_sequence_avx2;
+      FromBe = from_be_avx2;
+    } else if (level >= SimdLevelSse41) {
+      CountSequence = count_sequence_sse4;
+      FromBe = from_be_sse4;
+    }
+  }
+#endif // ifdef QCOW2_L2_SCAN_X86
+
+uint32_t qcow2_l2_scan_count_sequence (
+  const uint64_t *entries, uint32_t count, uint64_t mask, uint64_t value, uint64_t step
+) {
+  return (*CountSequence)(entries, count, mask, value, step);
+}
+
+void qcow2_l2_scan_from_be (uint64_t *values, size_t count) {
+  (*FromBe)(values, count);
+}
@@ -0,0 +1,41 @@
+/*
+ * xcp-ng-vdi-stream
+ * Copyright (C) 2019  Vates SAS - ronan.abhamon@vates.fr
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef _XCP_NG_VDI_STREAM_QCOW2_L2_SCAN_H_
+#define _XCP_NG_VDI_STREAM_QCOW2_L2_SCAN_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+// =============================================================================
+// Scan of big endian table entries. On x86-64, AVX2 or SSE4.1 kernels are selected at runtime,
+// they give the same results as the scalar implementation.
+// =============================================================================
+
+// Environment variable to force a kernel: scalar, sse4.1 or avx2 (default, the best supported one).
+#define QCOW2_L2_SCAN_KERNEL_ENV "XCP_VDI_STREAM_L2_SCAN_KERNEL"
+
+// Count the first entries whose masked value (in host order) is value, value + step, value + 2 * step...
+// A zero step counts the entries equal to value.
+uint32_t qcow2_l2_scan_count_sequence (
+  const uint64_t *entries, uint32_t count, uint64_t mask, uint64_t value, uint64_t step
+);
+
+// Convert big endian values in place.
+void qcow2_l2_scan_from_be (uint64_t *values, size_t count);
+
+#endif // ifndef _XCP_NG_VDI_STREAM_QCOW2_L2_SCAN_H_
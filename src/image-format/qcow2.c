@@ -15,112 +15,262 @@
  * along with this program.  If not, see <https://www.gnu.org/licenses/>.
  */
 
+#define _GNU_SOURCE
 #include <assert.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <inttypes.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
 
 #include <xcp-ng/generic/endian.h>
 #include <xcp-ng/generic/file.h>
 #include <xcp-ng/generic/io.h>
 #include <xcp-ng/generic/path.h>
 
+#include "compression.h"
 #include "error.h"
 #include "global.h"
 #include "image-format/qcow2.h"
+#include "image-format/qcow2-index.h"
+#include "image-format/qcow2-l2-scan.h"
+#include "io-engine.h"
 
 // =============================================================================
 
-#define QCOW2_L2_CACHE_SIZE 2097152 // 2MiB (Minimum size must be equal to QCOW2_MAX_CLUSTER_BITS = 21).
+// Initial number of slots, the table grows to keep a load factor lower than 1/2.
+#define QCOW2_L2_CACHE_MIN_CAPACITY 64
 
-static int qcow2_l2_cache_init (QCow2Image *image, char **error) {
-  // Some static checks to ensure a valid comportment.
-  static_assert(QCOW2_L2_CACHE_SIZE >= (1 << QCOW2_MAX_CLUSTER_BITS), "");
-  static_assert(QCOW2_MIN_CLUSTER_BITS == 9, "");
-  static_assert(QCOW2_MAX_CLUSTER_BITS == 21, "");
-
-  static const uint32_t bitToPrimeNumber[] = {
-    4099, 2053, 1031, 521, 257, 131, 67, 37, 17, 11, 5, 3, 1
-  };
-
-  QCow2L2Cache *cache = &image->l2Cache;
-  cache->size = 0;
-  cache->capacity = bitToPrimeNumber[image->header.clusterBits - QCOW2_MIN_CLUSTER_BITS];
-  TAILQ_INIT(&cache->sortedEntries);
-  if (!(cache->entries = malloc(cache->capacity * sizeof *cache->entries))) {
+int qcow2_l2_cache_init (QCow2L2Cache *cache, size_t memoryLimit, char **error) {
+  memset(cache, 0, sizeof *cache);
+  cache->capacity = QCOW2_L2_CACHE_MIN_CAPACITY;
+  cache->memoryLimit = memoryLimit ? memoryLimit : QCOW2_L2_CACHE_DEFAULT_SIZE;
+  if (!(cache->slots = calloc(cache->capacity, sizeof *cache->slots))) {
     set_error(error, "Failed to create L2 cache (%s)", strerror(errno));
     return -1;
   }
-  for (size_t i = 0; i < cache->capacity; ++i)
-    TAILQ_INIT(&cache->entries[i]);
 
+  pthread_rwlock_init(&cache->lock, NULL);
   return 0;
 }
 
-static void qcow2_l2_cache_uninit (QCow2Image *image) {
-  QCow2L2Cache *cache = &image->l2Cache;
+void qcow2_l2_cache_uninit (QCow2L2Cache *cache) {
+  if (!cache->slots)
+    return;
 
-  Qcow2L2CacheEntry *entry;
-  while ((entry = TAILQ_FIRST(&cache->sortedEntries))) {
-    TAILQ_REMOVE(&cache->sortedEntries, entry, sortedEntry);
-    free(entry);
-  }
+  debug_log(
+    "L2 cache: %" PRIu64 " hits, %" PRIu64 " misses, %" PRIu64 " evictions.",
+    cache->hits, cache->misses, cache->evictions
+  );
 
-  free(cache->entries);
-  cache->entries = NULL;
+  pthread_rwlock_destroy(&cache->lock);
+  for (size_t i = 0; i < cache->capacity; ++i)
+    free(cache->slots[i].l2Table);
+  free(cache->slots);
+  cache->slots = NULL;
 }
 
-static inline uint32_t qcow2_l2_cache_hash (const QCow2Image *image, uint64_t l2TableOffset) {
-  // TODO: Maybe use a seed.
-  return (uint32_t)((l2TableOffset >> 32) ^ (l2TableOffset & 0xFFFFFFFF)) % (uint32_t)image->l2Cache.capacity;
+static inline size_t qcow2_l2_cache_hash (const QCow2L2Cache *cache, const QCow2Image *image, uint64_t l2TableOffset) {
+  // Tables are aligned on clusters: the low bits are useless, a multiplicative hash spreads the keys.
+  const uint64_t key = (l2TableOffset >> QCOW2_MIN_CLUSTER_BITS) ^ (uint64_t)(uintptr_t)image;
+  return (size_t)((key * 0x9E3779B97F4A7C15ULL) >> 32) & (cache->capacity - 1);
 }
 
-static uint64_t *qcow2_l2_cache_get_table (QCow2Image *image, uint64_t l2TableOffset, char **error) {
-  const uint32_t hash = qcow2_l2_cache_hash(image, l2TableOffset);
-  QCow2L2Cache *cache = &image->l2Cache;
+// Remove a slot and shift the next ones of its probe sequence (no tombstone).
+static void qcow2_l2_cache_remove (QCow2L2Cache *cache, size_t index) {
+  Qcow2L2CacheSlot *slots = cache->slots;
+  const size_t mask = cache->capacity - 1;
+
+  free(slots[index].l2Table);
+  cache->memoryUsage -= slots[index].size;
+  --cache->count;
+
+  for (size_t next = (index + 1) & mask; slots[next].image; next = (next + 1) & mask) {
+    // Keep the slot if its home is in ]index, next] (cyclic).
+    const size_t home = qcow2_l2_cache_hash(cache, slots[next].image, slots[next].l2TableOffset);
+    if (((next - home) & mask) < ((next - index) & mask))
+      continue;
+    slots[index] = slots[next];
+    index = next;
+  }
+
+  slots[index] = (Qcow2L2CacheSlot){ .image = NULL, .l2Table = NULL };
+}
 
-  // 1. First case: entry already exists => update and return it.
-  Qcow2L2CacheEntry *entry;
-  TAILQ_FOREACH(entry, &cache->entries[hash], entry) {
-    if (entry->l2TableOffset == l2TableOffset) {
-      TAILQ_REMOVE(&cache->sortedEntries, entry, sortedEntry);
-      TAILQ_INSERT_HEAD(&cache->sortedEntries, entry, sortedEntry);
-      return entry->l2Table;
+// CLOCK: a referenced slot gets a second chance, the first unreferenced one is evicted.
+static void qcow2_l2_cache_evict (QCow2L2Cache *cache) {
+  const size_t mask = cache->capacity - 1;
+  for (;;) {
+    const size_t index = cache->hand;
+    cache->hand = (cache->hand + 1) & mask;
+
+    Qcow2L2CacheSlot *slot = &cache->slots[index];
+    if (!slot->image)
+      continue;
+    if (slot->referenced) {
+      slot->referenced = false;
+      continue;
     }
+
+    qcow2_l2_cache_remove(cache, index);
+    ++cache->evictions;
+    return;
+  }
+}
+
+static int qcow2_l2_cache_grow (QCow2L2Cache *cache, char **error) {
+  const size_t capacity = cache->capacity << 1;
+  Qcow2L2CacheSlot *slots = calloc(capacity, sizeof *slots);
+  if (!slots) {
+    set_error(error, "Failed to grow L2 cache (%s)", strerror(errno));
+    return -1;
+  }
+
+  Qcow2L2CacheSlot *oldSlots = cache->slots;
+  const size_t oldCapacity = cache->capacity;
+  cache->slots = slots;
+  cache->capacity = capacity;
+  cache->hand = 0;
+
+  for (size_t i = 0; i < oldCapacity; ++i) {
+    if (!oldSlots[i].image)
+      continue;
+    size_t index = qcow2_l2_cache_hash(cache, oldSlots[i].image, oldSlots[i].l2TableOffset);
+    while (slots[index].image)
+      index = (index + 1) & (capacity - 1);
+    slots[index] = oldSlots[i];
+  }
+  free(oldSlots);
+
+  return 0;
+}
+
+static Qcow2L2CacheSlot *qcow2_l2_cache_find (QCow2L2Cache *cache, const QCow2Image *image, uint64_t l2TableOffset) {
+  const size_t mask = cache->capacity - 1;
+  size_t index = qcow2_l2_cache_hash(cache, image, l2TableOffset);
+  for (; cache->slots[index].image; index = (index + 1) & mask) {
+    Qcow2L2CacheSlot *slot = &cache->slots[index];
+    if (slot->image == image && slot->l2TableOffset == l2TableOffset)
+      return slot;
   }
+  return NULL;
+}
 
+// Add a table (allocated with aligned_block_alloc) which is not in the cache.
+static int qcow2_l2_cache_insert (
+  QCow2L2Cache *cache, const QCow2Image *image, uint64_t l2TableOffset, uint64_t *l2Table, char **error
+) {
+  // 1. Make room in the memory budget, at least one table is kept.
   const uint32_t clusterSize = image->clusterSize;
-  if (cache->size < cache->capacity) {
-    // 2. Entry must be created.
-    if (!(entry = aligned_block_alloc(sizeof *entry + clusterSize))) {
-      set_error(error, "Unable to create new L2 table cache entry (%s)", strerror(errno));
-      return NULL;
-    }
-    ++cache->size;
-  } else {
-    // 3. Reuse the oldest entry.
-    entry = TAILQ_LAST(&cache->sortedEntries, Qcow2L2CacheHead);
-    TAILQ_REMOVE(&cache->entries[hash], entry, entry);
-    TAILQ_REMOVE(&cache->sortedEntries, entry, sortedEntry);
+  while (cache->count && cache->memoryUsage + clusterSize > cache->memoryLimit)
+    qcow2_l2_cache_evict(cache);
+
+  if (((cache->count + 1) << 1) > cache->capacity && qcow2_l2_cache_grow(cache, error) < 0)
+    return -1;
+
+  // 2. Insert it.
+  size_t index = qcow2_l2_cache_hash(cache, image, l2TableOffset);
+  while (cache->slots[index].image)
+    index = (index + 1) & (cache->capacity - 1);
+
+  cache->slots[index] = (Qcow2L2CacheSlot){
+    .image = image,
+    .l2TableOffset = l2TableOffset,
+    .l2Table = l2Table,
+    .size = clusterSize,
+    .referenced = false
+  };
+  ++cache->count;
+  cache->memoryUsage += clusterSize;
+
+  return 0;
+}
+
+// Remove the tables of an image, it must be called before its memory is released.
+static void qcow2_l2_cache_remove_image (QCow2L2Cache *cache, const QCow2Image *image) {
+  pthread_rwlock_wrlock(&cache->lock);
+  for (size_t i = 0; i < cache->capacity; )
+    if (cache->slots[i].image == image)
+      qcow2_l2_cache_remove(cache, i); // The next slots are shifted to `i`.
+    else
+      ++i;
+  pthread_rwlock_unlock(&cache->lock);
+}
+
+// Must be called with the shared lock. A table given by the cache is valid only while the lock is held.
+static const uint64_t *qcow2_l2_cache_lookup (QCow2L2Cache *cache, const QCow2Image *image, uint64_t l2TableOffset) {
+  Qcow2L2CacheSlot *slot = qcow2_l2_cache_find(cache, image, l2TableOffset);
+  if (!slot)
+    return NULL;
+
+  __atomic_store_n(&slot->referenced, true, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&cache->hits, 1, __ATOMIC_RELAXED);
+  return slot->l2Table;
+}
+
+// Must be called with the exclusive lock. Add a table read without the lock: if another thread added it
+// meanwhile, the given table is released and the cached one is used.
+static const uint64_t *qcow2_l2_cache_add (
+  QCow2L2Cache *cache, const QCow2Image *image, uint64_t l2TableOffset, uint64_t *l2Table, char **error
+) {
+  ++cache->misses;
+
+  const Qcow2L2CacheSlot *slot = qcow2_l2_cache_find(cache, image, l2TableOffset);
+  if (slot) {
+    free(l2Table);
+    return slot->l2Table;
   }
 
-  entry->l2TableOffset = l2TableOffset;
-  TAILQ_INSERT_TAIL(&cache->entries[hash], entry, entry);
-  TAILQ_INSERT_HEAD(&cache->sortedEntries, entry, sortedEntry);
+  if (qcow2_l2_cache_insert(cache, image, l2TableOffset, l2Table, error) < 0) {
+    free(l2Table);
+    return NULL;
+  }
+  return l2Table;
+}
 
-  const XcpError ret = xcp_fd_pread(image->fd, entry->l2Table, clusterSize, (off_t)l2TableOffset);
-  if (ret == XCP_ERR_ERRNO) {
-    set_error(error, "Unable to read L2 table at offset %#" PRIx64 " in %s (%s)", l2TableOffset, image->filename, strerror(errno));
+static uint64_t *qcow2_image_read_l2_table (const QCow2Image *image, uint64_t l2TableOffset, char **error) {
+  const uint32_t clusterSize = image->clusterSize;
+  uint64_t *l2Table = aligned_block_alloc(clusterSize);
+  if (!l2Table) {
+    set_error(error, "Unable to create new L2 table cache entry (%s)", strerror(errno));
     return NULL;
   }
-  if ((size_t)ret != clusterSize) {
-    set_error(error, "Truncated L2 table at offset %#" PRIx64 " in %s", l2TableOffset, image->filename);
+
+  const XcpError ret = direct_safe_pread(image->fd, l2Table, clusterSize, (off_t)l2TableOffset);
+  if (ret == XCP_ERR_ERRNO || (size_t)ret != clusterSize) {
+    if (ret == XCP_ERR_ERRNO)
+      set_error(error, "Unable to read L2 table at offset %#" PRIx64 " in %s (%s)", l2TableOffset, image->filename, strerror(errno));
+    else
+      set_error(error, "Truncated L2 table at offset %#" PRIx64 " in %s", l2TableOffset, image->filename);
+    free(l2Table);
     return NULL;
   }
 
-  return entry->l2Table;
+  return l2Table;
+}
+
+// Give a table of the image with the cache lock, it is released by the caller.
+static const uint64_t *qcow2_image_lock_l2_table (const QCow2Image *image, uint64_t l2TableOffset, char **error) {
+  QCow2L2Cache *cache = image->l2Cache;
+
+  // 1. First case: the table is cached.
+  pthread_rwlock_rdlock(&cache->lock);
+  const uint64_t *l2Table = qcow2_l2_cache_lookup(cache, image, l2TableOffset);
+  if (l2Table)
+    return l2Table;
+  pthread_rwlock_unlock(&cache->lock);
+
+  // 2. Read it without lock: the lookups of the other threads are not blocked by the I/O.
+  uint64_t *newTable = qcow2_image_read_l2_table(image, l2TableOffset, error);
+  if (!newTable)
+    return NULL;
+
+  // 3. Add it.
+  pthread_rwlock_wrlock(&cache->lock);
+  if (!(l2Table = qcow2_l2_cache_add(cache, image, l2TableOffset, newTable, error)))
+    pthread_rwlock_unlock(&cache->lock);
+  return l2Table;
 }
 
 // =============================================================================
@@ -195,31 +345,48 @@ static int qcow2_image_close_basic (QCow2Image *image, char **error) {
   free(image->filename);
   free(image->l1Table);
 
-  qcow2_l2_cache_uninit(image);
+  if (image->index) {
+    qcow2_index_destroy(image->index);
+    image->index = NULL;
+  }
 
+  pthread_mutex_destroy(&image->lazyMutex);
   xcp_fd_close(image->fd);
   image->fd = -1;
 
   return 0;
 }
 
-static int qcow2_image_open_basic (QCow2Image *image, const char *filename, char **error) {
+static int qcow2_image_open_file (const char *filename, int flags) {
+  int fd = open(filename, O_RDONLY | flags);
+  if (fd < 0 && errno == EINVAL && (flags & O_DIRECT)) {
+    debug_log("O_DIRECT is not supported for `%s`, using the page cache.", filename);
+    fd = open(filename, O_RDONLY | (flags & ~O_DIRECT));
+  }
+  return fd;
+}
+
+// Read the image from an opened file, the fd is owned by the image even on failure.
+static int qcow2_image_open_basic_fd (
+  QCow2Image *image, int fd, const char *filename, int flags, QCow2L2Cache *l2Cache, char **error
+) {
   QCow2Header *header = &image->header;
 
   image->parent = NULL;
-  if ((image->fd = open(filename, O_RDONLY)) < 0) {
-    set_error(error, "%s", strerror(errno));
-    return -1;
-  }
+  image->openFlags = flags;
+  image->l2Cache = l2Cache;
+  image->shareParents = false;
+  image->refCount = 0;
+  image->nextRegistered = NULL;
+  image->fd = fd;
+  pthread_mutex_init(&image->lazyMutex, NULL);
 
   // Reset some fields to avoid crash if qcow2_image_close is called.
   {
     *image->backingFile = '\0';
     image->l1Table = NULL;
-
-    QCow2L2Cache *cache = &image->l2Cache;
-    cache->entries = NULL;
-    TAILQ_INIT(&cache->sortedEntries);
+    image->l1TableLoaded = false;
+    image->index = NULL;
   }
 
   if (!(image->filename = strdup(filename))) {
@@ -229,7 +396,7 @@ static int qcow2_image_open_basic (QCow2Image *image, const char *filename, char
 
   // 1. Read QCOW2 header.
   {
-    const XcpError ret = xcp_fd_pread(image->fd, header, sizeof *header, 0);
+    const XcpError ret = direct_safe_pread(image->fd, header, sizeof *header, 0);
     if (ret == XCP_ERR_ERRNO) {
       set_error(error, "Failed to read QCOW2 header (%s)", strerror(errno));
       goto fail;
@@ -257,6 +424,8 @@ static int qcow2_image_open_basic (QCow2Image *image, const char *filename, char
     goto fail;
   }
   image->clusterSize = 1u << header->clusterBits;
+  image->compressionType = QCOW2_COMPRESSION_TYPE_DEFLATE;
+  image->extendedL2 = false;
   image->nbSectors = SIZE_TO_SECTOR_COUNT(header->size);
   image->nbSectorsPerCluster = 1u << (header->clusterBits - N_BITS_PER_SECTOR);
 
@@ -277,6 +446,30 @@ static int qcow2_image_open_basic (QCow2Image *image, const char *filename, char
       set_error(error, "Header is too short");
       goto fail;
     }
+
+    if (header->incompatibleFeatures & QCOW2_INCOMPATIBLE_FEATURE_COMPRESSION_TYPE) {
+      uint8_t compressionType;
+      if (
+        header->headerLength <= sizeof *header ||
+        direct_safe_pread(image->fd, &compressionType, sizeof compressionType, sizeof *header) != sizeof compressionType
+      ) {
+        set_error(error, "Failed to read compression type");
+        goto fail;
+      }
+      if (compressionType != QCOW2_COMPRESSION_TYPE_DEFLATE && compressionType != QCOW2_COMPRESSION_TYPE_ZSTD) {
+        set_error(error, "Unsupported compression type '%u'", compressionType);
+        goto fail;
+      }
+      image->compressionType = compressionType;
+    }
+
+    if (header->incompatibleFeatures & QCOW2_INCOMPATIBLE_FEATURE_EXTENDED_L2) {
+      if (header->clusterBits < QCOW2_MIN_EXTENDED_L2_CLUSTER_BITS) {
+        set_error(error, "Invalid cluster bits '%d' with extended L2 entries", header->clusterBits);
+        goto fail;
+      }
+      image->extendedL2 = true;
+    }
   } else {
     // Default values of the spec file.
     header->incompatibleFeatures = 0;
@@ -314,10 +507,11 @@ static int qcow2_image_open_basic (QCow2Image *image, const char *filename, char
   image->refcountBlockBits = header->clusterBits - (header->refcountOrder - 3);
   image->refcountBlockSize = 1u << image->refcountBlockBits;
 
-  // The size of one L2 table entry is equal to 64 bits (i.e. (1 << 3) == 8 bytes)
-  // and a L2 table occupies one cluster.
-  image->l2Bits = header->clusterBits - 3;
+  // The size of one L2 table entry is equal to 64 bits (i.e. (1 << 3) == 8 bytes), 128 bits
+  // with extended L2 entries, and a L2 table occupies one cluster.
+  image->l2Bits = header->clusterBits - (image->extendedL2 ? 4 : 3);
   image->l2Size = 1u << image->l2Bits;
+  image->subclusterBits = header->clusterBits - (image->extendedL2 ? QCOW2_SUBCLUSTER_BITS : 0);
 
   // 3. Read backing filename.
   if (header->backingFileOffset) {
@@ -326,7 +520,7 @@ static int qcow2_image_open_basic (QCow2Image *image, const char *filename, char
       set_error(error, "Backing filename is so big");
       goto fail;
     }
-    if (xcp_fd_pread(image->fd, image->backingFile, size, (off_t)header->backingFileOffset) < 0) {
+    if (direct_safe_pread(image->fd, image->backingFile, size, (off_t)header->backingFileOffset) < 0) {
       set_error(error, "Failed to read backing filename (%s)", strerror(errno));
       goto fail;
     }
@@ -334,45 +528,18 @@ static int qcow2_image_open_basic (QCow2Image *image, const char *filename, char
   } else
     *image->backingFile = '\0';
 
-  // 4. Init L2 cache.
-  if (qcow2_l2_cache_init(image, error) < 0)
-    goto fail;
-
-  // 5. Read L1 table.
+  // 4. Check L1 table size, the table is read by qcow2_image_load_l1_table.
   {
-    const uint32_t l1Size = header->l1Size;
     const uint32_t minL1Size = qcow2_image_l1_entry_count_from_size(image, header->size);
     if (minL1Size > INT_MAX) {
       set_error(error, "Image is so big");
       goto fail;
     }
 
-    if (l1Size < minL1Size) {
+    if (header->l1Size < minL1Size) {
       set_error(error, "L1 table is so small");
       goto fail;
     }
-
-    if (!l1Size)
-      return 0;
-
-    const size_t expectedBytes = l1Size * sizeof *image->l1Table;
-    if (!(image->l1Table = aligned_block_alloc(SECTOR_ROUND_UP(expectedBytes)))) {
-      set_error(error, "Failed to alloc l1 table (%s)", strerror(errno));
-      goto fail;
-    }
-
-    const XcpError ret = xcp_fd_pread(image->fd, image->l1Table, expectedBytes, (off_t)image->header.l1TableOffset);
-    if (ret == XCP_ERR_ERRNO) {
-      set_error(error, "Failed to read L1 table (%s)", strerror(errno));
-      goto fail;
-    }
-    if ((size_t)ret != expectedBytes) {
-      set_error(error, "Truncated L1 table");
-      goto fail;
-    }
-
-    for (uint32_t i = 0; i < l1Size; ++i)
-      xcp_from_be_u64_p(&image->l1Table[i]);
   }
 
   // TODO: Supports features. (Or maybe log error avoid usage of incompatible features.)
@@ -387,10 +554,132 @@ fail:
   return -1;
 }
 
-static int qcow2_image_open_rec (QCow2Image *child, char **error) {
-  if (!*child->backingFile)
-    return 0;
+static int qcow2_image_open_basic (
+  QCow2Image *image, const char *filename, int flags, QCow2L2Cache *l2Cache, char **error
+) {
+  const int fd = qcow2_image_open_file(filename, flags);
+  if (fd < 0) {
+    set_error(error, "%s", strerror(errno));
+    return -1;
+  }
+  return qcow2_image_open_basic_fd(image, fd, filename, flags, l2Cache, error);
+}
+
+// -----------------------------------------------------------------------------
+
+// Images shared by the chains of the process, see qcow2_chain_open.
+static struct {
+  pthread_mutex_t mutex;
+  QCow2Image *images;   // Registered images, linked by nextRegistered.
+  QCow2L2Cache l2Cache; // Cache of all the images of the chains which share their images.
+  uint32_t chainCount;  // Number of chains which use the cache.
+} Registry = { .mutex = PTHREAD_MUTEX_INITIALIZER };
+
+static QCow2L2Cache *qcow2_registry_acquire_cache (size_t memoryLimit, char **error) {
+  pthread_mutex_lock(&Registry.mutex);
+
+  QCow2L2Cache *cache = &Registry.l2Cache;
+  if (!Registry.chainCount && qcow2_l2_cache_init(cache, memoryLimit, error) < 0)
+    cache = NULL;
+  else {
+    ++Registry.chainCount;
+
+    // The budget is the largest one of the chains.
+    memoryLimit = memoryLimit ? memoryLimit : QCOW2_L2_CACHE_DEFAULT_SIZE;
+    pthread_rwlock_wrlock(&cache->lock);
+    cache->memoryLimit = XCP_MAX(cache->memoryLimit, memoryLimit);
+    pthread_rwlock_unlock(&cache->lock);
+  }
+
+  pthread_mutex_unlock(&Registry.mutex);
+  return cache;
+}
+
+static void qcow2_registry_release_cache (void) {
+  pthread_mutex_lock(&Registry.mutex);
+  if (!--Registry.chainCount)
+    qcow2_l2_cache_uninit(&Registry.l2Cache);
+  pthread_mutex_unlock(&Registry.mutex);
+}
+
+// Must be called with the registry lock.
+static QCow2Image *qcow2_registry_find_image (const struct stat *st, int flags) {
+  for (QCow2Image *image = Registry.images; image; image = image->nextRegistered)
+    if (image->device == (uint64_t)st->st_dev && image->inode == (uint64_t)st->st_ino && image->openFlags == flags)
+      return image;
+  return NULL;
+}
+
+// Give a reference to a registered image, it is opened if it is not used by another chain.
+// The file is identified from the opened fd: the path can be replaced between a stat and an open.
+static QCow2Image *qcow2_registry_acquire_image (const char *filename, int flags, char **error) {
+  const int fd = qcow2_image_open_file(filename, flags);
+  if (fd < 0) {
+    set_error(error, "%s", strerror(errno));
+    return NULL;
+  }
+
+  struct stat st;
+  if (fstat(fd, &st) < 0) {
+    set_error(error, "%s", strerror(errno));
+    xcp_fd_close(fd);
+    return NULL;
+  }
+
+  pthread_mutex_lock(&Registry.mutex);
+
+  QCow2Image *image = qcow2_registry_find_image(&st, flags);
+  if (image) {
+    ++image->refCount;
+    xcp_fd_close(fd);
+  } else if (!(image = malloc(sizeof *image))) {
+    set_error(error, "Unable to alloc parent image");
+    xcp_fd_close(fd);
+  } else if (qcow2_image_open_basic_fd(image, fd, filename, flags, &Registry.l2Cache, error) < 0) {
+    free(image);
+    image = NULL;
+  } else {
+    image->shareParents = true;
+    image->refCount = 1;
+    image->device = (uint64_t)st.st_dev;
+    image->inode = (uint64_t)st.st_ino;
+    image->nextRegistered = Registry.images;
+    Registry.images = image;
+  }
+
+  pthread_mutex_unlock(&Registry.mutex);
+  return image;
+}
+
+// Release a reference to a registered image. The last one closes the image and gives its parent:
+// the reference of the image to its parent must be released in turn. Otherwise NULL is returned.
+static QCow2Image *qcow2_registry_release_image (QCow2Image *image) {
+  pthread_mutex_lock(&Registry.mutex);
+
+  QCow2Image *parent = NULL;
+  const bool closed = !--image->refCount;
+  if (closed) {
+    QCow2Image **it = &Registry.images;
+    while (*it != image)
+      it = &(*it)->nextRegistered;
+    *it = image->nextRegistered;
+    parent = image->parent;
+  }
 
+  pthread_mutex_unlock(&Registry.mutex);
+
+  if (closed) {
+    // The address of the image can be reused by another one: its tables must be removed.
+    qcow2_l2_cache_remove_image(image->l2Cache, image);
+    qcow2_image_close_basic(image, NULL);
+    free(image);
+  }
+  return parent;
+}
+
+// -----------------------------------------------------------------------------
+
+static int qcow2_image_open_parent (QCow2Image *child, char **error) {
   char *dir = xcp_path_parent_dir(child->filename);
   if (!dir) {
     set_error(error, "Unable to compute parent dir of `%s`\n", child->filename);
@@ -408,49 +697,115 @@ static int qcow2_image_open_rec (QCow2Image *child, char **error) {
   }
   free(combinedParentPath);
 
-  // 2. Open parent image.
-  QCow2Image *parent = malloc(sizeof *parent);
-  if (!parent) {
+  // 2. Open parent image or use the registered one.
+  QCow2Image *parent = NULL;
+  if (child->shareParents)
+    parent = qcow2_registry_acquire_image(absParentPath, child->openFlags, error);
+  else if (!(parent = malloc(sizeof *parent)))
     set_error(error, "Unable to alloc parent image");
-    return -1;
+  else if (qcow2_image_open_basic(parent, absParentPath, child->openFlags, child->l2Cache, error) < 0) {
+    free(parent);
+    parent = NULL;
   }
 
-  if (qcow2_image_open_basic(parent, absParentPath, error) < 0) {
+  if (!parent) {
     set_error(error, "Failed to open parent image `%s`: `%s`", absParentPath, *error);
-    free(parent);
     return -1;
   }
-  child->parent = parent;
 
-  // 3. Open parent of parent image...
-  return qcow2_image_open_rec(parent, error);
+  // The lookups of other threads can read the parent without the lock.
+  __atomic_store_n(&child->parent, parent, __ATOMIC_RELEASE);
+  return 0;
 }
 
-int qcow2_image_open (QCow2Image *image, const char *filename, char **error) {
+int qcow2_image_open (QCow2Image *image, const char *filename, int flags, QCow2L2Cache *l2Cache, char **error) {
   char absoluteFilename[PATH_MAX];
   if (!realpath(filename, absoluteFilename)) {
     set_error(error, "Unable to get abs path of image `%s` (%s)", filename, strerror(errno));
     return -1;
   }
 
-  if (qcow2_image_open_basic(image, absoluteFilename, error) < 0) {
+  if (qcow2_image_open_basic(image, absoluteFilename, flags, l2Cache, error) < 0) {
     set_error(error, "Failed to open image `%s`: `%s`", absoluteFilename, *error);
     return -1;
   }
 
-  if (qcow2_image_open_rec(image, error) < 0) {
+  // The table of the opened image is always used.
+  if (qcow2_image_load_l1_table(image, error) < 0) {
     qcow2_image_close(image, NULL);
     return -1;
   }
   return 0;
 }
 
+int qcow2_image_get_parent (const QCow2Image *image, const QCow2Image **parent, char **error) {
+  if ((*parent = __atomic_load_n(&image->parent, __ATOMIC_ACQUIRE)) || !*image->backingFile)
+    return 0;
+
+  QCow2Image *child = (QCow2Image *)image;
+  pthread_mutex_lock(&child->lazyMutex);
+  const int ret = child->parent ? 0 : qcow2_image_open_parent(child, error);
+  pthread_mutex_unlock(&child->lazyMutex);
+
+  *parent = child->parent;
+  return ret;
+}
+
+int qcow2_image_load_l1_table (const QCow2Image *image, char **error) {
+  if (__atomic_load_n(&image->l1TableLoaded, __ATOMIC_ACQUIRE))
+    return 0;
+
+  QCow2Image *mutableImage = (QCow2Image *)image;
+  pthread_mutex_lock(&mutableImage->lazyMutex);
+
+  int ret = 0;
+  const uint32_t l1Size = image->header.l1Size;
+  if (!image->l1TableLoaded && l1Size) {
+    const size_t expectedBytes = l1Size * sizeof *image->l1Table;
+    uint64_t *l1Table = aligned_block_alloc(SECTOR_ROUND_UP(expectedBytes));
+    if (!l1Table) {
+      set_error(error, "Failed to alloc l1 table (%s)", strerror(errno));
+      ret = -1;
+    } else {
+      const XcpError readRet = direct_safe_pread(image->fd, l1Table, expectedBytes, (off_t)image->header.l1TableOffset);
+      if (readRet == XCP_ERR_ERRNO) {
+        set_error(error, "Failed to read L1 table of `%s` (%s)", image->filename, strerror(errno));
+        ret = -1;
+      } else if ((size_t)readRet != expectedBytes) {
+        set_error(error, "Truncated L1 table of `%s`", image->filename);
+        ret = -1;
+      }
+    }
+
+    if (ret < 0)
+      free(l1Table);
+    else {
+      qcow2_l2_scan_from_be(l1Table, l1Size);
+      mutableImage->l1Table = l1Table;
+    }
+  }
+
+  if (!ret)
+    __atomic_store_n(&mutableImage->l1TableLoaded, true, __ATOMIC_RELEASE);
+  pthread_mutex_unlock(&mutableImage->lazyMutex);
+
+  return ret;
+}
+
 int qcow2_image_close (QCow2Image *image, char **error) {
   XCP_UNUSED(error);
 
+  // The parents of an image which shares them are all registered.
+  const bool registered = image->shareParents;
   qcow2_image_close_basic(image, NULL);
   for (image = image->parent; image; ) {
     QCow2Image *cur = image;
+    if (registered) {
+      // The parents are still used if other chains use the image.
+      image = qcow2_registry_release_image(cur);
+      continue;
+    }
+
     qcow2_image_close_basic(cur, NULL);
     image = image->parent;
     free(cur);
@@ -473,37 +828,164 @@ static uint32_t qcow2_compute_contiguous_cluster_count (
     ((typeMask & ClusterTypeUnallocated) && !(typeMask & ClusterTypeAllocated))
   );
 
+  const uint64_t mask =
+    QCOW2_L2_ENTRY_FLAG_ZERO | QCOW2_L2_ENTRY_FLAG_COMPRESSED | QCOW2_L2_ENTRY_HOST_CLUSTER_OFFSET_MASK;
+
   // First case:
   // Read all contiguous unallocated clusters of type:
   // { ClusterTypeUnallocated } XOR { ClusterTypeUnallocated, ClusterTypeZero }.
-  if (typeMask & ClusterTypeUnallocated) {
-    uint32_t i = 0;
-    for (i = 0; i < maxClusterCount; ++i)
-      if (qcow2_get_cluster_type_mask(xcp_from_be_u64(l2Slice[i])) != typeMask)
-        break;
-    return i;
-  }
+  // Same type <=> not compressed, no host offset and same zero flag.
+  if (typeMask & ClusterTypeUnallocated)
+    return qcow2_l2_scan_count_sequence(l2Slice, maxClusterCount, mask, l2Entry & QCOW2_L2_ENTRY_FLAG_ZERO, 0);
 
   // Second case:
   // Read all contiguous allocated clusters of type:
   // { ClusterTypeAllocated } XOR { ClusterTypeAllocated, ClusterTypeZero }.
-  const uint64_t mask =
-    QCOW2_L2_ENTRY_FLAG_ZERO | QCOW2_L2_ENTRY_FLAG_COMPRESSED | QCOW2_L2_ENTRY_HOST_CLUSTER_OFFSET_MASK;
-  uint64_t clustersOffset = l2Entry & mask;
+  const uint64_t clustersOffset = l2Entry & mask;
   assert(clustersOffset);
 
-  uint32_t i;
-  for (i = 0; i < maxClusterCount; ++i) {
-    if (clustersOffset != (xcp_from_be_u64(l2Slice[i]) & mask))
+  return qcow2_l2_scan_count_sequence(l2Slice, maxClusterCount, mask, clustersOffset, image->clusterSize);
+}
+
+// Must be called with the L2 cache lock.
+static uint64_t qcow2_image_find_clusters_offset_in_l2_table (
+  const QCow2Image *image,
+  const uint64_t *l2Table,
+  uint64_t l2TableOffset,
+  uint32_t l1Index,
+  uint32_t l2Index,
+  size_t nBytes,
+  size_t *nAvailableBytes,
+  uint32_t *typeMask,
+  char **error
+) {
+  // 3. Compute clusters offset.
+  uint64_t clustersOffset;
+  {
+    const uint64_t l2Entry = xcp_from_be_u64(l2Table[l2Index]);
+    *typeMask = qcow2_get_cluster_type_mask(l2Entry);
+    clustersOffset = l2Entry & QCOW2_L2_ENTRY_HOST_CLUSTER_OFFSET_MASK;
+
+    // A compressed cluster is alone: its descriptor is returned instead of an offset.
+    if (*typeMask & ClusterTypeCompressed) {
+      *nAvailableBytes = image->clusterSize;
+      return l2Entry & QCOW2_L2_ENTRY_COMPRESSED_DESCRIPTOR_MASK;
+    }
+  }
+
+  // 4. Count contiguous cluster of the same type and update available bytes.
+  if (*typeMask & ClusterTypeAllocated) {
+    // Check if cluster is correctly aligned.
+    if (qcow2_image_offset_to_cluster_padding(image, clustersOffset)) {
+      set_error(
+        error, "Unaligned cluster at (L1 Index: %" PRIu32 ", L2 index: %" PRIu32 ", L2 table offset: %#" PRIx64 ", %#" PRIx64 ")",
+        l1Index, l2Index, l2TableOffset, clustersOffset
+      );
+      return (uint64_t)-1;
+    }
+  } else if (!(*typeMask & ClusterTypeUnallocated)) {
+    // Missing cluster type?
+    abort();
+  }
+
+  {
+    uint32_t clusterCount = qcow2_image_cluster_count_from_size(image, nBytes);
+    clusterCount = qcow2_compute_contiguous_cluster_count(image, &l2Table[l2Index], clusterCount);
+    *nAvailableBytes = clusterCount << image->header.clusterBits;
+  }
+
+  return clustersOffset;
+}
+
+// Check an extended L2 entry: a subcluster cannot be allocated and zero, and the allocated ones need a host cluster.
+static int qcow2_image_check_extended_l2_entry (
+  const QCow2Image *image, uint64_t l2Entry, uint64_t bitmap, uint32_t l1Index, uint32_t l2Index, char **error
+) {
+  const uint32_t allocated = (uint32_t)bitmap;
+  const uint32_t zero = (uint32_t)(bitmap >> QCOW2_SUBCLUSTER_BITMAP_ZERO_SHIFT);
+  const uint64_t clustersOffset = l2Entry & QCOW2_L2_ENTRY_HOST_CLUSTER_OFFSET_MASK;
+  if (
+    (allocated & zero) ||
+    (allocated && (!clustersOffset || qcow2_image_offset_to_cluster_padding(image, clustersOffset)))
+  ) {
+    set_error(
+      error, "Invalid extended L2 entry at (L1 Index: %" PRIu32 ", L2 index: %" PRIu32 "): %#" PRIx64 " %#" PRIx64,
+      l1Index, l2Index, l2Entry, bitmap
+    );
+    return -1;
+  }
+  return 0;
+}
+
+// Same as qcow2_image_find_clusters_offset_in_l2_table with extended L2 entries: the set of subclusters
+// starts at the subcluster which contains the cluster padding and can use several entries.
+// Must be called with the L2 cache lock.
+static uint64_t qcow2_image_find_subclusters_offset_in_l2_table (
+  const QCow2Image *image,
+  const uint64_t *l2Table,
+  uint32_t l1Index,
+  uint32_t l2Index,
+  uint32_t clusterPadding,
+  size_t nBytes,
+  size_t *nAvailableBytes,
+  uint32_t *typeMask,
+  char **error
+) {
+  const uint32_t subclusterBits = image->subclusterBits;
+  const uint64_t firstSubcluster = (uint64_t)l2Index << QCOW2_SUBCLUSTER_BITS;
+  const uint64_t endSubcluster = firstSubcluster + ((nBytes + (1u << subclusterBits) - 1) >> subclusterBits);
+
+  uint64_t clustersOffset = 0;
+  uint64_t bitmap = 0;
+  uint32_t entryIndex = UINT32_MAX;
+  uint64_t subcluster = firstSubcluster + (clusterPadding >> subclusterBits);
+  for (; subcluster < endSubcluster; ++subcluster) {
+    const uint32_t index = (uint32_t)(subcluster >> QCOW2_SUBCLUSTER_BITS);
+    const uint32_t bit = subcluster & (QCOW2_SUBCLUSTER_COUNT - 1);
+
+    // 1. Read each entry once, a compressed cluster ends the set.
+    if (index != entryIndex) {
+      entryIndex = index;
+      const uint64_t l2Entry = xcp_from_be_u64(l2Table[2 * index]);
+      bitmap = xcp_from_be_u64(l2Table[2 * index + 1]);
+      if (index == l2Index && (l2Entry & QCOW2_L2_ENTRY_FLAG_COMPRESSED)) {
+        *typeMask = ClusterTypeCompressed;
+        *nAvailableBytes = image->clusterSize;
+        return l2Entry & QCOW2_L2_ENTRY_COMPRESSED_DESCRIPTOR_MASK;
+      }
+      if (l2Entry & QCOW2_L2_ENTRY_FLAG_COMPRESSED)
+        break;
+      if (qcow2_image_check_extended_l2_entry(image, l2Entry, bitmap, l1Index, index, error) < 0)
+        return (uint64_t)-1;
+
+      const uint64_t hostOffset = l2Entry & QCOW2_L2_ENTRY_HOST_CLUSTER_OFFSET_MASK;
+      if (index == l2Index) {
+        *typeMask = qcow2_get_subcluster_type_mask(bitmap, bit);
+        if (*typeMask & ClusterTypeAllocated)
+          clustersOffset = hostOffset;
+      } else if (
+        (*typeMask & ClusterTypeAllocated) &&
+        hostOffset != clustersOffset + ((uint64_t)(index - l2Index) << image->header.clusterBits)
+      )
+        break;
+    }
+
+    // 2. Count contiguous subclusters of the same type.
+    if (qcow2_get_subcluster_type_mask(bitmap, bit) != *typeMask)
       break;
-    clustersOffset += image->clusterSize;
   }
-  return i;
+
+  *nAvailableBytes = (subcluster - firstSubcluster) << subclusterBits;
+  return clustersOffset;
 }
 
 uint64_t qcow2_image_find_clusters_offset (
   const QCow2Image *image, uint64_t vaddr, size_t nBytes, size_t *nAvailableBytes, uint32_t *typeMask, char **error
 ) {
+  const QCow2Index *index = qcow2_image_get_index(image);
+  if (index)
+    return qcow2_index_find_clusters_offset(index, image, vaddr, nBytes, nAvailableBytes, typeMask);
+
   uint64_t clustersOffset = 0;
 
   // 1. Cumpute available bytes at this vaddr.
@@ -517,7 +999,6 @@ uint64_t qcow2_image_find_clusters_offset (
 
   // 2. Compute L2 slice.
   uint64_t l2TableOffset;
-  uint64_t *l2Table;
 
   const uint32_t l1Index = qcow2_image_vaddr_to_l1_index(image, vaddr);
   if (l1Index >= image->header.l1Size) {
@@ -525,6 +1006,9 @@ uint64_t qcow2_image_find_clusters_offset (
     goto end;
   }
 
+  if (qcow2_image_load_l1_table(image, error) < 0)
+    return (uint64_t)-1;
+
   if (!(l2TableOffset = image->l1Table[l1Index] & QCOW2_L1_ENTRY_L2_TABLE_OFFSET_MASK)) {
     *typeMask = ClusterTypeUnallocated;
     goto end;
@@ -535,44 +1019,26 @@ uint64_t qcow2_image_find_clusters_offset (
     set_error(error, "Unaligned L2 table at L1 index %" PRIu32 ": %#" PRIx64, l1Index, l2TableOffset);
     return (uint64_t)-1;
   }
-  if (!(l2Table = qcow2_l2_cache_get_table((QCow2Image *)image, l2TableOffset, error)))
-    return (uint64_t)-1;
 
-  // 3. Compute clusters offset.
   {
-    const uint64_t l2Entry = xcp_from_be_u64(l2Table[l2Index]);
-    *typeMask = qcow2_get_cluster_type_mask(l2Entry);
-    clustersOffset = l2Entry & QCOW2_L2_ENTRY_HOST_CLUSTER_OFFSET_MASK;
-  }
-
-  // 4. Count contiguous cluster of the same type and update available bytes.
-  if (*typeMask & ClusterTypeCompressed) {
-    set_error(error, "Unsupported compressed cluster");
-    return (uint64_t)-1;
-  }
+    const uint64_t *l2Table = qcow2_image_lock_l2_table(image, l2TableOffset, error);
+    if (!l2Table)
+      return (uint64_t)-1;
 
-  if (*typeMask & ClusterTypeAllocated) {
-    // Check if cluster is correctly aligned.
-    if (qcow2_image_offset_to_cluster_padding(image, clustersOffset)) {
-      set_error(
-        error, "Unaligned cluster at (L1 Index: %" PRIu32 ", L2 index: %" PRIu32 ", L2 table offset: %#" PRIx64 ", %#" PRIx64 ")",
-        l1Index, l2Index, l2TableOffset, clustersOffset
+    clustersOffset = image->extendedL2
+      ? qcow2_image_find_subclusters_offset_in_l2_table(
+        image, l2Table, l1Index, l2Index, clusterPadding, nBytes, nAvailableBytes, typeMask, error
+      )
+      : qcow2_image_find_clusters_offset_in_l2_table(
+        image, l2Table, l2TableOffset, l1Index, l2Index, nBytes, nAvailableBytes, typeMask, error
       );
+    pthread_rwlock_unlock(&image->l2Cache->lock);
+    if (clustersOffset == (uint64_t)-1)
       return (uint64_t)-1;
-    }
-  } else if (!(*typeMask & ClusterTypeUnallocated)) {
-    // Missing cluster type?
-    abort();
-  }
-
-  {
-    uint32_t clusterCount = qcow2_image_cluster_count_from_size(image, nBytes);
-    clusterCount = qcow2_compute_contiguous_cluster_count(image, &l2Table[l2Index], clusterCount);
-    *nAvailableBytes = clusterCount << image->header.clusterBits;
   }
 
 end:
-  assert(!qcow2_image_offset_to_cluster_padding(image, *nAvailableBytes));
+  assert(!(*nAvailableBytes & ((1u << image->subclusterBits) - 1)));
 
   if (nBytes < *nAvailableBytes)
     *nAvailableBytes = nBytes;
@@ -585,8 +1051,27 @@ end:
 
 // -----------------------------------------------------------------------------
 
-ssize_t qcow2_image_read (const QCow2Image *image, uint64_t vaddr, size_t nBytes, void *buf, char **error) {
-  const uint64_t startVaddr = vaddr;
+static inline int qcow2_image_map_compressed (
+  const QCow2Image *image,
+  uint64_t vaddr,
+  uint64_t descriptor,
+  size_t nBytes,
+  Qcow2MapCb cb,
+  void *userData,
+  char **error
+) {
+  const QCow2CompressedRange compressed = {
+    .descriptor = descriptor,
+    .clusterOffset = qcow2_image_offset_to_cluster_padding(image, vaddr)
+  };
+  return (*cb)(
+    image, qcow2_compressed_offset(descriptor, image->header.clusterBits), nBytes, &compressed, userData, error
+  );
+}
+
+int qcow2_image_map (
+  const QCow2Image *image, uint64_t vaddr, size_t nBytes, Qcow2MapCb cb, void *userData, char **error
+) {
   while (nBytes) {
     // 1. Find contiguous clusters at vaddr.
     size_t nAvailableBytes;
@@ -596,78 +1081,177 @@ ssize_t qcow2_image_read (const QCow2Image *image, uint64_t vaddr, size_t nBytes
     if (clustersOffset == (uint64_t)-1)
       return -1;
 
-    // TODO: Support it one day. Cannot be reached because qcow2_find_clusters_offset returns -1
-    // if the cluster is compressed.
-    assert(!(typeMask & ClusterTypeCompressed));
-
-    // 2. Read.
-    uint64_t readOffset = 0;
-    ssize_t ret;
-
-    if ((typeMask & ClusterTypeZero) || ((typeMask & ClusterTypeUnallocated) && !image->parent)) {
-      memset(buf, 0, nAvailableBytes);
-      goto next;
-    }
+    // 2. Map.
+    int ret;
+    const QCow2Image *parent = NULL;
+    if (
+      !(typeMask & (ClusterTypeZero | ClusterTypeAllocated | ClusterTypeCompressed)) &&
+      qcow2_image_get_parent(image, &parent, error) < 0
+    )
+      return -1;
 
-    if (typeMask & ClusterTypeAllocated) {
-      readOffset = clustersOffset + qcow2_image_offset_to_cluster_padding(image, vaddr);
-      ret = xcp_fd_pread(image->fd, buf, nAvailableBytes, (off_t)readOffset);
-    } else if (typeMask & ClusterTypeUnallocated)
-      ret = qcow2_image_read(image->parent, vaddr, nAvailableBytes, buf, error);
+    if (typeMask & ClusterTypeCompressed)
+      ret = qcow2_image_map_compressed(image, vaddr, clustersOffset, nAvailableBytes, cb, userData, error);
+    else if ((typeMask & ClusterTypeZero) || ((typeMask & ClusterTypeUnallocated) && !parent))
+      ret = (*cb)(NULL, 0, nAvailableBytes, NULL, userData, error);
+    else if (typeMask & ClusterTypeAllocated)
+      ret = (*cb)(
+        image, clustersOffset + qcow2_image_offset_to_cluster_padding(image, vaddr), nAvailableBytes, NULL,
+        userData, error
+      );
+    else if (typeMask & ClusterTypeUnallocated)
+      ret = qcow2_image_map(parent, vaddr, nAvailableBytes, cb, userData, error);
     else
       abort();
 
-    if (ret < 0) {
-      set_error(
-        error, "Failed to read %s block(s) at offset %#" PRIx64 " (%s)",
-        typeMask & ClusterTypeAllocated ? "allocated" : "unallocated", readOffset, strerror(errno)
-      );
+    if (ret < 0)
+      return -1;
+
+    nBytes -= nAvailableBytes;
+    vaddr += nAvailableBytes;
+  }
+
+  return 0;
+}
+
+// -----------------------------------------------------------------------------
+
+int qcow2_image_read_compressed (
+  const QCow2Image *image, const QCow2CompressedRange *compressed, void *buf, size_t nBytes, char **error
+) {
+  const uint32_t clusterBits = image->header.clusterBits;
+  const uint64_t offset = qcow2_compressed_offset(compressed->descriptor, clusterBits);
+  const size_t size = qcow2_compressed_size(compressed->descriptor, clusterBits);
+  if (compressed->clusterOffset + nBytes > image->clusterSize) {
+    set_error(
+      error, "Invalid read of %zuB at %" PRIu32 " in compressed cluster at offset %#" PRIx64 " of %s",
+      nBytes, compressed->clusterOffset, offset, image->filename
+    );
+    return -1;
+  }
+
+  // The cluster is decompressed in place if it is entirely read.
+  const bool inPlace = !compressed->clusterOffset && nBytes == image->clusterSize;
+  unsigned char *data = malloc(size + (inPlace ? 0 : image->clusterSize));
+  if (!data) {
+    set_error(error, "Failed to alloc compressed cluster buffer (%s)", strerror(errno));
+    return -1;
+  }
+
+  // The last sector of the last compressed cluster can be truncated at the end of the file.
+  int ret = -1;
+  const XcpError readSize = direct_safe_pread(image->fd, data, size, (off_t)offset);
+  if (readSize == XCP_ERR_ERRNO)
+    set_error(error, "Failed to read compressed cluster at offset %#" PRIx64 " (%s)", offset, strerror(errno));
+  else {
+    unsigned char *cluster = inPlace ? buf : data + size;
+    const XcpVdiStreamCompression type = image->compressionType == QCOW2_COMPRESSION_TYPE_ZSTD
+      ? XCP_VDI_STREAM_COMPRESSION_ZSTD
+      : XCP_VDI_STREAM_COMPRESSION_DEFLATE;
+    if ((ret = decompress_cluster(type, data, (size_t)readSize, cluster, image->clusterSize, error)) == 0 && !inPlace)
+      memcpy(buf, cluster + compressed->clusterOffset, nBytes);
+  }
+
+  free(data);
+  return ret;
+}
+
+static int map_cb_read (
+  const QCow2Image *image,
+  uint64_t offset,
+  size_t nBytes,
+  const QCow2CompressedRange *compressed,
+  void *userData,
+  char **error
+) {
+  char **buf = userData;
+
+  if (!image)
+    memset(*buf, 0, nBytes);
+  else if (compressed) {
+    if (qcow2_image_read_compressed(image, compressed, *buf, nBytes, error) < 0)
+      return -1;
+  } else {
+    const XcpError ret = direct_safe_pread(image->fd, *buf, nBytes, (off_t)offset);
+    if (ret == XCP_ERR_ERRNO) {
+      set_error(error, "Failed to read allocated block(s) at offset %#" PRIx64 " (%s)", offset, strerror(errno));
       return -1;
     }
-    if ((size_t)ret != nAvailableBytes) {
+    if ((size_t)ret != nBytes) {
       set_error(
-        error, "Truncated read (expected=%zu, current=%zu) of %s block(s) at offset %#" PRIx64,
-        nAvailableBytes, ret, typeMask & ClusterTypeAllocated ? "allocated" : "unallocated", readOffset
+        error, "Truncated read (expected=%zu, current=%zu) of allocated block(s) at offset %#" PRIx64,
+        nBytes, (size_t)ret, offset
       );
       return -1;
     }
-
-  next:
-    nBytes -= nAvailableBytes;
-    *(char **)&buf += nAvailableBytes;
-    vaddr += nAvailableBytes;
   }
 
-  return (ssize_t)(vaddr - startVaddr);
+  *buf += nBytes;
+  return 0;
+}
+
+ssize_t qcow2_image_read (const QCow2Image *image, uint64_t vaddr, size_t nBytes, void *buf, char **error) {
+  char *dest = buf;
+  if (qcow2_image_map(image, vaddr, nBytes, map_cb_read, &dest, error) < 0)
+    return -1;
+  return (ssize_t)nBytes;
 }
 
 // =============================================================================
 
-int qcow2_chain_open (QCow2Chain *chain, const char *filename, const char *base, char **error) {
-  // 1. Open image.
-  QCow2Image *image = &chain->image;
-  if (qcow2_image_open(image, filename, error) < 0)
+int qcow2_chain_open (
+  QCow2Chain *chain,
+  const char *filename,
+  const char *base,
+  int flags,
+  size_t l2CacheSize,
+  bool shareImages,
+  char **error
+) {
+  // 1. Open image with a cache shared by the chain (or by the chains which share their images).
+  QCow2L2Cache *l2Cache = &chain->l2Cache;
+  if (shareImages) {
+    memset(&chain->l2Cache, 0, sizeof chain->l2Cache);
+    if (!(l2Cache = qcow2_registry_acquire_cache(l2CacheSize, error)))
+      return -1;
+  } else if (qcow2_l2_cache_init(l2Cache, l2CacheSize, error) < 0)
     return -1;
 
-  // 2. Find base.
-  if (!base) {
-    chain->base = NULL;
-    return 0;
+  QCow2Image *image = &chain->image;
+  if (qcow2_image_open(image, filename, flags, l2Cache, error) < 0) {
+    if (shareImages)
+      qcow2_registry_release_cache();
+    else
+      qcow2_l2_cache_uninit(l2Cache);
+    return -1;
   }
+  image->shareParents = shareImages;
 
+  // 2. Open the parents until the base. Their L1 tables are read at the first lookup.
+  chain->base = NULL;
   char absBase[PATH_MAX];
-  if (!realpath(base, absBase)) {
+  if (base && !realpath(base, absBase)) {
     set_error(error, "Unable to compute absolute base path (%s)", strerror(errno));
     qcow2_chain_close(chain, NULL);
     return -1;
   }
 
-  for (; image; image = image->parent)
-    if (!strcmp(image->filename, absBase)) {
-      chain->base = image;
+  const QCow2Image *it = image;
+  while (it) {
+    if (base && !strcmp(it->filename, absBase)) {
+      chain->base = (QCow2Image *)it;
       return 0; // Base found!
     }
 
+    if (qcow2_image_get_parent(it, &it, error) < 0) {
+      qcow2_chain_close(chain, NULL);
+      return -1;
+    }
+  }
+
+  if (!base)
+    return 0;
+
   set_error(error, "Unable to find base `%s`", absBase);
   qcow2_chain_close(chain, NULL);
   return -1;
@@ -675,7 +1259,209 @@ int qcow2_chain_open (QCow2Chain *chain, const char *filename, const char *base,
 
 int qcow2_chain_close (QCow2Chain *chain, char **error) {
   chain->base = NULL;
-  return qcow2_image_close(&chain->image, error);
+
+  // The tables of the image are removed from the registry cache: the chain memory can be reused.
+  const bool shareImages = chain->image.shareParents;
+  if (shareImages)
+    qcow2_l2_cache_remove_image(chain->image.l2Cache, &chain->image);
+
+  const int ret = qcow2_image_close(&chain->image, error);
+  if (shareImages)
+    qcow2_registry_release_cache();
+  else
+    qcow2_l2_cache_uninit(&chain->l2Cache);
+  return ret;
+}
+
+// -----------------------------------------------------------------------------
+
+// Max size of one merged read of L2 tables.
+#define QCOW2_L2_PRELOAD_MAX_READ_SIZE (4u << 20)
+
+// Max bytes read before the tables are moved in the cache.
+#define QCOW2_L2_PRELOAD_BATCH_SIZE (32u << 20)
+
+typedef struct {
+  const QCow2Image *image;
+  uint64_t offset;
+  size_t size;   // Multiple of the cluster size: adjacent tables are merged.
+  uint64_t *buf; // Destination of the read.
+} L2TableRead;
+
+static int l2_table_read_cmp (const void *a, const void *b) {
+  const L2TableRead *readA = a;
+  const L2TableRead *readB = b;
+  if (readA->image != readB->image)
+    return (uintptr_t)readA->image < (uintptr_t)readB->image ? -1 : 1;
+  return readA->offset < readB->offset ? -1 : readA->offset > readB->offset;
+}
+
+// Collect the L2 tables in the order of the virtual walk, until the cache budget is reached.
+static size_t qcow2_chain_collect_l2_tables (const QCow2Chain *chain, L2TableRead *reads, size_t maxCount) {
+  QCow2L2Cache *cache = chain->image.l2Cache;
+
+  pthread_rwlock_rdlock(&cache->lock);
+  size_t size = cache->memoryUsage;
+  const size_t memoryLimit = cache->memoryLimit;
+  pthread_rwlock_unlock(&cache->lock);
+
+  size_t count = 0;
+  for (const QCow2Image *image = &chain->image; image && image != chain->base; image = image->parent) {
+    // The L2 tables of an indexed image are never read.
+    if (qcow2_image_get_index(image))
+      continue;
+
+    for (uint32_t i = 0; i < image->header.l1Size && count < maxCount; ++i) {
+      const uint64_t offset = image->l1Table[i] & QCOW2_L1_ENTRY_L2_TABLE_OFFSET_MASK;
+      if (!offset || qcow2_image_offset_to_cluster_padding(image, offset))
+        continue;
+      if (size + image->clusterSize > memoryLimit)
+        return count;
+
+      size += image->clusterSize;
+      reads[count++] = (L2TableRead){ .image = image, .offset = offset, .size = image->clusterSize, .buf = NULL };
+    }
+  }
+
+  return count;
+}
+
+// Sort the tables of each image by physical offset and merge the adjacent ones.
+static size_t merge_l2_table_reads (L2TableRead *reads, size_t count) {
+  if (!count)
+    return 0;
+
+  qsort(reads, count, sizeof *reads, l2_table_read_cmp);
+
+  size_t mergedCount = 1;
+  for (size_t i = 1; i < count; ++i) {
+    L2TableRead *last = &reads[mergedCount - 1];
+    if (last->image == reads[i].image && last->offset + last->size > reads[i].offset)
+      continue; // Same table used twice.
+
+    if (
+      last->image == reads[i].image &&
+      last->offset + last->size == reads[i].offset &&
+      last->size + reads[i].size <= QCOW2_L2_PRELOAD_MAX_READ_SIZE
+    )
+      last->size += reads[i].size;
+    else
+      reads[mergedCount++] = reads[i];
+  }
+
+  return mergedCount;
+}
+
+// Wait the reads of a batch and move the tables in the cache.
+static int qcow2_chain_finish_l2_reads (
+  QCow2Chain *chain, IoEngine *engine, L2TableRead *reads, size_t count, char **error
+) {
+  if (engine && io_engine_wait(engine, error) < 0)
+    return -1;
+
+  QCow2L2Cache *cache = chain->image.l2Cache;
+  pthread_rwlock_wrlock(&cache->lock);
+
+  int ret = 0;
+  for (size_t i = 0; i < count && !ret; ++i) {
+    const QCow2Image *image = reads[i].image;
+    for (size_t offset = 0; offset < reads[i].size && !ret; offset += image->clusterSize) {
+      const uint64_t l2TableOffset = reads[i].offset + offset;
+      if (
+        qcow2_l2_cache_find(cache, image, l2TableOffset) ||
+        cache->memoryUsage + image->clusterSize > cache->memoryLimit
+      )
+        continue;
+
+      uint64_t *l2Table = aligned_block_alloc(image->clusterSize);
+      if (!l2Table) {
+        set_error(error, "Unable to create new L2 table cache entry (%s)", strerror(errno));
+        ret = -1;
+      } else {
+        memcpy(l2Table, (const char *)reads[i].buf + offset, image->clusterSize);
+        if ((ret = qcow2_l2_cache_insert(cache, image, l2TableOffset, l2Table, error)) < 0)
+          free(l2Table);
+      }
+    }
+  }
+
+  pthread_rwlock_unlock(&cache->lock);
+  return ret;
+}
+
+static int qcow2_chain_read_l2_tables (
+  QCow2Chain *chain, IoEngine *engine, L2TableRead *reads, size_t count, char **error
+) {
+  size_t first = 0;
+  size_t batchSize = 0;
+  for (size_t i = 0; i < count; ++i) {
+    if (!(reads[i].buf = aligned_block_alloc(reads[i].size))) {
+      set_error(error, "Unable to allocate L2 tables buffer (%s)", strerror(errno));
+      return -1;
+    }
+
+    const int ret = engine
+      ? io_engine_read(engine, reads[i].image->fd, reads[i].buf, reads[i].size, reads[i].offset, error)
+      : io_engine_pread(reads[i].image->fd, reads[i].buf, reads[i].size, reads[i].offset, error);
+    if (ret < 0)
+      return -1;
+
+    // Limit the memory of the reads in flight.
+    batchSize += reads[i].size;
+    if (batchSize >= QCOW2_L2_PRELOAD_BATCH_SIZE || i + 1 == count) {
+      if (qcow2_chain_finish_l2_reads(chain, engine, reads + first, i + 1 - first, error) < 0)
+        return -1;
+      for (; first <= i; ++first) {
+        free(reads[first].buf);
+        reads[first].buf = NULL;
+      }
+      batchSize = 0;
+    }
+  }
+
+  return 0;
+}
+
+int qcow2_chain_preload_l2_tables (QCow2Chain *chain, unsigned queueDepth, char **error) {
+  // 1. Find the tables which can be cached. The base and its parents are rarely used, they are skipped.
+  size_t maxCount = 0;
+  for (const QCow2Image *image = &chain->image; image && image != chain->base; image = image->parent) {
+    if (qcow2_image_get_index(image))
+      continue;
+    if (qcow2_image_load_l1_table(image, error) < 0)
+      return -1;
+    maxCount += image->header.l1Size;
+  }
+  if (!maxCount)
+    return 0;
+
+  L2TableRead *reads = malloc(maxCount * sizeof *reads);
+  if (!reads) {
+    set_error(error, "Unable to allocate L2 tables reads (%s)", strerror(errno));
+    return -1;
+  }
+
+  const size_t tableCount = qcow2_chain_collect_l2_tables(chain, reads, maxCount);
+  const size_t count = merge_l2_table_reads(reads, tableCount);
+
+  // 2. Read them concurrently if possible.
+  char *engineError = NULL;
+  IoEngine *engine = io_engine_create(XCP_VDI_STREAM_IO_ENGINE_IO_URING, queueDepth, 0, &engineError);
+  if (!engine) {
+    debug_log("L2 tables are read without I/O engine: %s.", engineError);
+    free(engineError);
+  }
+
+  debug_log("Preloading %zu L2 tables with %zu reads.", tableCount, count);
+  const int ret = qcow2_chain_read_l2_tables(chain, engine, reads, count, error);
+
+  // Reads in flight use the buffers.
+  io_engine_destroy(engine);
+  for (size_t i = 0; i < count; ++i)
+    free(reads[i].buf);
+  free(reads);
+
+  return ret;
 }
 
 // -----------------------------------------------------------------------------
@@ -718,7 +1504,7 @@ uint64_t qcow2_chain_find_clusters_offset (
     if (clustersOffset == (uint64_t)-1)
       break;
 
-    if (*typeMask & (ClusterTypeAllocated | ClusterTypeZero))
+    if (*typeMask & (ClusterTypeAllocated | ClusterTypeZero | ClusterTypeCompressed))
       break;
 
     nBytes = XCP_MIN(nBytes, *nAvailableBytes);
@@ -731,8 +1517,19 @@ uint64_t qcow2_chain_find_clusters_offset (
 // -----------------------------------------------------------------------------
 
 int qcow2_chain_foreach_clusters (const QCow2Chain *chain, Qcow2ForeachCb cb, void *userData, char **error) {
-  const uint64_t nbSectors = chain->image.nbSectors;
-  for (uint64_t sector = 0; sector < nbSectors; ) {
+  return qcow2_chain_foreach_clusters_in_range(chain, 0, chain->image.nbSectors, cb, userData, error);
+}
+
+int qcow2_chain_foreach_clusters_in_range (
+  const QCow2Chain *chain,
+  uint64_t startSector,
+  uint64_t endSector,
+  Qcow2ForeachCb cb,
+  void *userData,
+  char **error
+) {
+  const uint64_t nbSectors = XCP_MIN(endSector, chain->image.nbSectors);
+  for (uint64_t sector = startSector; sector < nbSectors; ) {
     const uint64_t vaddr = sector << N_BITS_PER_SECTOR;
     const size_t nBytes = XCP_MIN((nbSectors - sector), N_SECTORS_MAX_PER_REQUEST) << N_BITS_PER_SECTOR;
 
@@ -755,3 +1552,229 @@ int qcow2_chain_foreach_clusters (const QCow2Chain *chain, Qcow2ForeachCb cb, vo
 
   return 0;
 }
+
+// =============================================================================
+
+static inline bool qcow2_extent_has_data (const QCow2Extent *extent) {
+  return (extent->typeMask & ClusterTypeAllocated) && !(extent->typeMask & ClusterTypeZero);
+}
+
+static int clusters_cb_build_extent_map (
+  uint64_t sector,
+  uint64_t nAvailableBytes,
+  uint32_t typeMask,
+  const QCow2Image *image,
+  uint64_t clustersOffset,
+  void *userData,
+  char **error
+) {
+  QCow2ExtentMap *map = userData;
+  const uint64_t vaddr = sector << N_BITS_PER_SECTOR;
+
+  // 1. The memory budget is reached: the runs are not stored but the compressed clusters are still counted.
+  if (map->size != vaddr) {
+    if (typeMask & ClusterTypeCompressed)
+      ++map->compressedCount;
+    return 0;
+  }
+
+  const QCow2Extent extent = {
+    .vaddr = vaddr,
+    .offset = (typeMask & ClusterTypeAllocated)
+      ? clustersOffset + qcow2_image_offset_to_cluster_padding(image, vaddr)
+      : (typeMask & ClusterTypeCompressed) ? clustersOffset : 0,
+    .image = image,
+    .typeMask = typeMask
+  };
+
+  // 2. Merge with the previous run if possible: a compressed run is the part of one compressed cluster.
+  // Adjacent clusters can share the same compressed cluster, so the runs must be in the same cluster.
+  if (map->count) {
+    const QCow2Extent *last = &map->extents[map->count - 1];
+    if (last->image == image && last->typeMask == typeMask && (
+      (typeMask & ClusterTypeCompressed) ? last->offset == extent.offset &&
+        (last->vaddr >> image->header.clusterBits) == (vaddr >> image->header.clusterBits) :
+      (!qcow2_extent_has_data(last) || last->offset + (vaddr - last->vaddr) == extent.offset)
+    )) {
+      map->size = vaddr + nAvailableBytes;
+      return 0;
+    }
+  }
+
+  // 3. Otherwise add a new run.
+  if (map->count == map->capacity) {
+    if (map->capacity == map->maxCount) {
+      if (typeMask & ClusterTypeCompressed)
+        ++map->compressedCount;
+      return 0;
+    }
+
+    const size_t capacity = XCP_MIN(map->capacity ? map->capacity << 1 : 64, map->maxCount);
+    QCow2Extent *extents = realloc(map->extents, capacity * sizeof *extents);
+    if (!extents) {
+      set_error(error, "Failed to grow extent map (%s)", strerror(errno));
+      return -1;
+    }
+    map->extents = extents;
+    map->capacity = capacity;
+  }
+  map->extents[map->count++] = extent;
+  map->size = vaddr + nAvailableBytes;
+  if (typeMask & ClusterTypeCompressed)
+    ++map->compressedCount;
+
+  return 0;
+}
+
+int qcow2_extent_map_build (QCow2ExtentMap *map, const QCow2Chain *chain, size_t memoryLimit, char **error) {
+  map->chain = chain;
+  map->extents = NULL;
+  map->count = map->capacity = 0;
+  memoryLimit = memoryLimit ? memoryLimit : QCOW2_L2_CACHE_DEFAULT_SIZE;
+  map->maxCount = XCP_MAX(memoryLimit / sizeof *map->extents, (size_t)1);
+  map->size = 0;
+  map->compressedCount = 0;
+
+  if (qcow2_chain_foreach_clusters(chain, clusters_cb_build_extent_map, map, error) < 0) {
+    qcow2_extent_map_destroy(map);
+    return -1;
+  }
+  return 0;
+}
+
+void qcow2_extent_map_destroy (QCow2ExtentMap *map) {
+  free(map->extents);
+  map->extents = NULL;
+  map->count = map->capacity = 0;
+  map->size = 0;
+  map->compressedCount = 0;
+}
+
+// Find the index of the run which contains vaddr.
+static size_t qcow2_extent_map_find (const QCow2ExtentMap *map, uint64_t vaddr) {
+  size_t low = 0;
+  size_t high = map->count;
+  while (high - low > 1) {
+    const size_t mid = low + (high - low) / 2;
+    if (map->extents[mid].vaddr <= vaddr)
+      low = mid;
+    else
+      high = mid;
+  }
+  return low;
+}
+
+static inline uint64_t qcow2_extent_map_get_end (const QCow2ExtentMap *map, size_t index) {
+  return index + 1 < map->count ? map->extents[index + 1].vaddr : map->size;
+}
+
+int qcow2_extent_map_foreach_in_range (
+  const QCow2ExtentMap *map,
+  uint64_t startSector,
+  uint64_t endSector,
+  Qcow2ForeachCb cb,
+  void *userData,
+  char **error
+) {
+  const uint64_t endVaddr = XCP_MIN(endSector << N_BITS_PER_SECTOR, map->size);
+  uint64_t vaddr = startSector << N_BITS_PER_SECTOR;
+
+  for (size_t i = vaddr < endVaddr ? qcow2_extent_map_find(map, vaddr) : map->count; vaddr < endVaddr; ++i) {
+    const QCow2Extent *extent = &map->extents[i];
+    const uint64_t end = XCP_MIN(qcow2_extent_map_get_end(map, i), endVaddr);
+    uint64_t offset = 0;
+    if (qcow2_extent_has_data(extent))
+      offset = extent->offset + (vaddr - extent->vaddr);
+    else if (extent->typeMask & ClusterTypeCompressed)
+      offset = extent->offset;
+    if ((*cb)(vaddr >> N_BITS_PER_SECTOR, end - vaddr, extent->typeMask, extent->image, offset, userData, error) < 0)
+      return -1;
+    vaddr = end;
+  }
+
+  // Runs which are not stored in the map.
+  return qcow2_chain_foreach_clusters_in_range(
+    map->chain, XCP_MAX(vaddr, map->size) >> N_BITS_PER_SECTOR, endSector, cb, userData, error
+  );
+}
+
+int qcow2_extent_map_map (
+  const QCow2ExtentMap *map, uint64_t vaddr, size_t nBytes, Qcow2MapCb cb, void *userData, char **error
+) {
+  const QCow2Chain *chain = map->chain;
+  const uint64_t endVaddr = vaddr + nBytes;
+  const uint64_t mapEndVaddr = XCP_MIN(endVaddr, map->size);
+
+  for (size_t i = vaddr < mapEndVaddr ? qcow2_extent_map_find(map, vaddr) : map->count; vaddr < mapEndVaddr; ++i) {
+    const QCow2Extent *extent = &map->extents[i];
+    const uint64_t end = XCP_MIN(qcow2_extent_map_get_end(map, i), mapEndVaddr);
+    const size_t count = (size_t)(end - vaddr);
+
+    int ret;
+    if (qcow2_extent_has_data(extent))
+      ret = (*cb)(extent->image, extent->offset + (vaddr - extent->vaddr), count, NULL, userData, error);
+    else if (extent->typeMask & ClusterTypeCompressed)
+      ret = qcow2_image_map_compressed(extent->image, vaddr, extent->offset, count, cb, userData, error);
+    else if (!(extent->typeMask & ClusterTypeZero) && (extent->typeMask & ClusterTypeUnallocated) && chain->base)
+      ret = qcow2_image_map(chain->base, vaddr, count, cb, userData, error); // Data of the base or its parents.
+    else
+      ret = (*cb)(NULL, 0, count, NULL, userData, error);
+    if (ret < 0)
+      return -1;
+
+    vaddr = end;
+  }
+
+  // Runs which are not stored in the map.
+  if (vaddr < endVaddr)
+    return qcow2_image_map(&chain->image, vaddr, (size_t)(endVaddr - vaddr), cb, userData, error);
+  return 0;
+}
+
+typedef struct {
+  uint64_t vaddr; // Start of the first compressed run, UINT64_MAX if there is none.
+} CompressedRunSearch;
+
+static int clusters_cb_find_compressed (
+  uint64_t sector,
+  uint64_t nAvailableBytes,
+  uint32_t typeMask,
+  const QCow2Image *image,
+  uint64_t clustersOffset,
+  void *userData,
+  char **error
+) {
+  XCP_UNUSED(nAvailableBytes);
+  XCP_UNUSED(image);
+  XCP_UNUSED(clustersOffset);
+  XCP_UNUSED(error);
+
+  CompressedRunSearch *search = userData;
+  if ((typeMask & ClusterTypeCompressed) && search->vaddr == UINT64_MAX)
+    search->vaddr = sector << N_BITS_PER_SECTOR;
+  return 0;
+}
+
+uint64_t qcow2_extent_map_find_compressed (const QCow2ExtentMap *map, uint64_t vaddr, uint64_t endVaddr) {
+  if (!map->compressedCount || vaddr >= endVaddr)
+    return endVaddr;
+
+  if (vaddr < map->size) {
+    for (size_t i = qcow2_extent_map_find(map, vaddr); i < map->count && map->extents[i].vaddr < endVaddr; ++i)
+      if (map->extents[i].typeMask & ClusterTypeCompressed)
+        return XCP_MAX(map->extents[i].vaddr, vaddr);
+    if (endVaddr <= map->size)
+      return endVaddr;
+    vaddr = map->size;
+  }
+
+  // Runs which are not stored in the map. In case of error, the range is handled as compressed:
+  // the error is given by the decompression.
+  CompressedRunSearch search = { .vaddr = UINT64_MAX };
+  if (qcow2_chain_foreach_clusters_in_range(
+    map->chain, vaddr >> N_BITS_PER_SECTOR, (endVaddr + SECTOR_SIZE - 1) >> N_BITS_PER_SECTOR,
+    clusters_cb_find_compressed, &search, NULL
+  ) < 0)
+    return vaddr;
+  return XCP_MIN(search.vaddr, endVaddr);
+}
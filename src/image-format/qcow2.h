@@ -18,8 +18,10 @@
 #ifndef _XCP_NG_VDI_STREAM_QCOW2_H_
 #define _XCP_NG_VDI_STREAM_QCOW2_H_
 
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
-#include <sys/queue.h>
 
 #include <xcp-ng/generic/global.h>
 
@@ -42,6 +44,13 @@
 #define QCOW2_INCOMPATIBLE_FEATURE_DIRTY (1 << 0)
 #define QCOW2_INCOMPATIBLE_FEATURE_CORRUPT (1 << 1)
 #define QCOW2_INCOMPATIBLE_FEATURE_EXT_FILE (1 << 2)
+#define QCOW2_INCOMPATIBLE_FEATURE_COMPRESSION_TYPE (1 << 3)
+#define QCOW2_INCOMPATIBLE_FEATURE_EXTENDED_L2 (1 << 4)
+
+// Byte 104 of a v3 header if the compression type feature is set (the header length is padded to 112).
+#define QCOW2_COMPRESSION_TYPE_DEFLATE 0
+#define QCOW2_COMPRESSION_TYPE_ZSTD 1
+#define QCOW2_COMPRESSION_TYPE_FIELD_LENGTH 8
 
 #define QCOW2_MAX_L1_SIZE (1ULL << 22)
 
@@ -57,6 +66,19 @@
 // Bits 9-55 of host cluster offset.
 #define QCOW2_L2_ENTRY_HOST_CLUSTER_OFFSET_MASK 0x00FFFFFFFFFFFE00ULL
 
+// Compressed cluster descriptor: bits 0 to x - 1 give the host offset of the compressed data,
+// bits x to 61 the number of additional 512-byte sectors used by the data.
+#define QCOW2_COMPRESSED_OFFSET_BITS(CLUSTER_BITS) (62u - ((CLUSTER_BITS) - 8u))
+#define QCOW2_L2_ENTRY_COMPRESSED_DESCRIPTOR_MASK ((1ULL << 62) - 1)
+
+// Extended L2 entries: a cluster is divided in 32 subclusters and its L2 entry is followed by a bitmap.
+// Bits 0 to 31 give the allocated subclusters, bits 32 to 63 the subclusters which read as zeros.
+// Like qemu, the subclusters cannot be smaller than 512 bytes.
+#define QCOW2_SUBCLUSTER_BITS 5
+#define QCOW2_SUBCLUSTER_COUNT (1u << QCOW2_SUBCLUSTER_BITS)
+#define QCOW2_MIN_EXTENDED_L2_CLUSTER_BITS 14
+#define QCOW2_SUBCLUSTER_BITMAP_ZERO_SHIFT 32
+
 // -----------------------------------------------------------------------------
 
 typedef struct {
@@ -103,32 +125,58 @@ typedef enum {
 
 // =============================================================================
 
-typedef struct Qcow2L2CacheEntry {
-  TAILQ_ENTRY(Qcow2L2CacheEntry) entry;
-  TAILQ_ENTRY(Qcow2L2CacheEntry) sortedEntry;
+// Memory budget of the L2 tables of a chain if not given.
+#define QCOW2_L2_CACHE_DEFAULT_SIZE (8u << 20)
 
-  uint64_t l2TableOffset; // Key.
-  uint64_t l2Table[];     // Value.
-} Qcow2L2CacheEntry;
+struct QCow2Image;
 
 typedef struct {
-  // Hash table of entries.
-  TAILQ_HEAD(, Qcow2L2CacheEntry) *entries;
+  const struct QCow2Image *image; // Key, NULL if the slot is free.
+  uint64_t l2TableOffset;         // Key.
+
+  uint64_t *l2Table;              // Value. Aligned on a page to be read with O_DIRECT.
+  uint32_t size;                  // Size of the table: cluster size of the image.
+  bool referenced;                // Second chance of the CLOCK eviction, set atomically by the lookups.
+} Qcow2L2CacheSlot;
 
-  // List of all entries sorted by  the most recently accessed.
-  TAILQ_HEAD(Qcow2L2CacheHead, Qcow2L2CacheEntry) sortedEntries;
+// Cache of the L2 tables shared by all the images of a chain, or by all the chains which share their images.
 
-  size_t size;
+typedef struct {
+  // Open addressing with linear probing: a lookup scans contiguous slots.
+  // The capacity is a power of two and the load factor is lower than 1/2.
+  Qcow2L2CacheSlot *slots;
   size_t capacity;
+  size_t count;
+  size_t hand; // Next slot checked by the CLOCK eviction.
+
+  size_t memoryLimit;
+  size_t memoryUsage;
+
+  uint64_t hits; // Incremented atomically by the lookups.
+  uint64_t misses;
+  uint64_t evictions;
+
+  // The cache can be used by several threads (see xcp_vdi_stream_pread) and by several streams
+  // (see qcow2_chain_open). The lookups share the lock, the insertions take it exclusively and
+  // the tables are read without it. A table given by the cache is valid only while the lock is held.
+  pthread_rwlock_t lock;
 } QCow2L2Cache;
 
+// A zero memory limit uses QCOW2_L2_CACHE_DEFAULT_SIZE. At least one table is cached.
+int qcow2_l2_cache_init (QCow2L2Cache *cache, size_t memoryLimit, char **error);
+void qcow2_l2_cache_uninit (QCow2L2Cache *cache);
+
+typedef struct QCow2Index QCow2Index;
+
 typedef struct QCow2Image {
   int fd; // Descriptor of the current image.
+  int openFlags; // Flags added to O_RDONLY, also used to open the parents.
   char *filename; // Absolute filename of the image.
 
   QCow2Header header;
 
   uint32_t clusterSize;         // Size of one cluster in bytes.
+  uint32_t compressionType;     // QCOW2_COMPRESSION_TYPE_* of the compressed clusters.
 
   uint64_t nbSectors;           // Total number of sectors.
   uint32_t nbSectorsPerCluster; // Number of sectors per cluster.
@@ -143,15 +191,34 @@ typedef struct QCow2Image {
   uint32_t l2Bits;              // Number of bits to address a L2 table entry.
   uint32_t l2Size;              // Number of L2 entries in one table.
 
-  QCow2L2Cache l2Cache;         // LRU cache to L2 tables, a great boost to avoid disk access!
+  bool extendedL2;              // Entries of 128 bits with a subcluster bitmap, see QCOW2_SUBCLUSTER_BITS.
+  uint32_t subclusterBits;      // Number of bits to address an offset within a subcluster (cluster bits otherwise).
+
+  QCow2L2Cache *l2Cache;        // Cache to L2 tables (shared with the chain), a great boost to avoid disk access!
+
+  uint64_t *l1Table;            // All L1 entries, the table of a parent is read at its first lookup.
+  bool l1TableLoaded;           // See qcow2_image_load_l1_table.
 
-  uint64_t *l1Table;            // All L1 entries.
+  QCow2Index *index;            // Used instead of the L2 tables if not NULL, see qcow2_chain_load_indexes.
 
   char backingFile[1024];       // Backing file, can be relative or absolute.
 
-  struct QCow2Image *parent;
+  struct QCow2Image *parent;    // Opened on demand below the chain base, see qcow2_image_get_parent.
+  pthread_mutex_t lazyMutex;    // Protects the loading of the L1 table and the opening of the parent.
+
+  // Parents given by the image registry, see qcow2_chain_open.
+  bool shareParents;            // The parent is taken from the registry (and so are its own parents).
+  uint32_t refCount;            // Number of users of a registered image, 0 if it is not registered.
+  uint64_t device;              // Registry key with the inode and the open flags.
+  uint64_t inode;
+  struct QCow2Image *nextRegistered;
 } QCow2Image;
 
+// The index of a shared image can be attached by another chain during the lookups.
+XCP_DECL_UNUSED static inline const QCow2Index *qcow2_image_get_index (const QCow2Image *image) {
+  return __atomic_load_n(&image->index, __ATOMIC_ACQUIRE);
+}
+
 // =============================================================================
 
 void qcow2_header_from_be (QCow2Header *header);
@@ -159,9 +226,18 @@ void qcow2_header_to_be (QCow2Header *header);
 
 // -----------------------------------------------------------------------------
 
-int qcow2_image_open (QCow2Image *image, const char *filename, char **error);
+// Flags are added to O_RDONLY (e.g. O_DIRECT). If O_DIRECT is not supported by the file system, it is ignored.
+// The L2 cache is also used by the parents. The parents are not opened, see qcow2_image_get_parent.
+int qcow2_image_open (QCow2Image *image, const char *filename, int flags, QCow2L2Cache *l2Cache, char **error);
 int qcow2_image_close (QCow2Image *image, char **error);
 
+// Give the parent of an image, NULL if there is no backing file. Its header is read at the first call,
+// its L1 table at its first lookup. Can be called by several threads.
+int qcow2_image_get_parent (const QCow2Image *image, const QCow2Image **parent, char **error);
+
+// Read the L1 table if it is not loaded. Called by the lookups, can be called by several threads.
+int qcow2_image_load_l1_table (const QCow2Image *image, char **error);
+
 // -----------------------------------------------------------------------------
 
 // Compute the minimum number of L1 entries to address N bytes.
@@ -199,12 +275,53 @@ XCP_DECL_UNUSED static inline uint32_t qcow2_image_vaddr_to_l2_index (const QCow
 
 // Find a sequential set of clusters (of a type mask) given an vaddr and a number of bytes to read.
 // Return -1 if there is an error, otherwise return the clusters offset.
+// With extended L2 entries, the set can start and end on a subcluster: the offset is still the offset
+// of the host cluster which contains vaddr.
 uint64_t qcow2_image_find_clusters_offset (
   const QCow2Image *image, uint64_t vaddr, size_t nBytes, size_t *nAvailableBytes, uint32_t *typeMask, char **error
 );
 
 // -----------------------------------------------------------------------------
 
+// Host offset of a compressed cluster.
+XCP_DECL_UNUSED static inline uint64_t qcow2_compressed_offset (uint64_t descriptor, uint32_t clusterBits) {
+  return descriptor & ((1ULL << QCOW2_COMPRESSED_OFFSET_BITS(clusterBits)) - 1);
+}
+
+// Maximum size of a compressed cluster: the data end somewhere in its last 512-byte sector.
+XCP_DECL_UNUSED static inline uint32_t qcow2_compressed_size (uint64_t descriptor, uint32_t clusterBits) {
+  const uint64_t sectorCount = (descriptor >> QCOW2_COMPRESSED_OFFSET_BITS(clusterBits)) + 1;
+  return (uint32_t)((sectorCount << 9) - (descriptor & 511u));
+}
+
+// Part of a compressed cluster.
+typedef struct {
+  uint64_t descriptor;    // L2 entry without the flags.
+  uint32_t clusterOffset; // Offset of the N bytes in the decompressed cluster.
+} QCow2CompressedRange;
+
+// Callback used to locate data: `image` is NULL if the N bytes are zeros,
+// otherwise the N bytes are stored at `offset` in the image file. If `compressed` is not NULL,
+// the bytes are in the compressed cluster stored at `offset`, see qcow2_image_read_compressed.
+typedef int (*Qcow2MapCb)(
+  const QCow2Image *image,
+  uint64_t offset,
+  size_t nBytes,
+  const QCow2CompressedRange *compressed,
+  void *userData,
+  char **error
+);
+
+// Locate data at vaddr. The parents are used when clusters are not allocated.
+int qcow2_image_map (
+  const QCow2Image *image, uint64_t vaddr, size_t nBytes, Qcow2MapCb cb, void *userData, char **error
+);
+
+// Decompress a cluster and copy N bytes of it. Can be called by several threads.
+int qcow2_image_read_compressed (
+  const QCow2Image *image, const QCow2CompressedRange *compressed, void *buf, size_t nBytes, char **error
+);
+
 // Read data at vaddr.
 ssize_t qcow2_image_read (const QCow2Image *image, uint64_t vaddr, size_t nBytes, void *buf, char **error);
 
@@ -234,6 +351,17 @@ XCP_DECL_UNUSED static inline uint32_t qcow2_get_cluster_type_mask (uint64_t l2E
   return ClusterTypeUnallocated;
 }
 
+// Type of a subcluster given the bitmap of an extended L2 entry.
+XCP_DECL_UNUSED static inline uint32_t qcow2_get_subcluster_type_mask (uint64_t bitmap, uint32_t subcluster) {
+  if (bitmap & (1ULL << subcluster))
+    return ClusterTypeAllocated;
+
+  if (bitmap & (1ULL << (subcluster + QCOW2_SUBCLUSTER_BITMAP_ZERO_SHIFT)))
+    return ClusterTypeUnallocated | ClusterTypeZero;
+
+  return ClusterTypeUnallocated;
+}
+
 XCP_DECL_UNUSED static inline const char *qcow2_cluster_type_mask_to_string (uint32_t typeMask) {
   if (typeMask & ClusterTypeCompressed)
     return "{ Compressed }";
@@ -255,13 +383,31 @@ XCP_DECL_UNUSED static inline const char *qcow2_cluster_type_mask_to_string (uin
 typedef struct QCow2Chain {
   QCow2Image image;
   QCow2Image *base;
+  QCow2L2Cache l2Cache; // Not used if the images are shared: image.l2Cache is the cache of the registry.
 } QCow2Chain;
 
 // -----------------------------------------------------------------------------
 
-int qcow2_chain_open (QCow2Chain *chain, const char *filename, const char *base, char **error);
+// A zero L2 cache size uses a default memory budget. Only the images between chain->image and chain->base
+// are opened: the parents of the base are opened if a lookup falls through it (see qcow2_extent_map_map).
+// If `shareImages` is set, the parents are registered in the process: the chains which have common
+// ancestors (e.g. clones of a template) open them once. Then the L2 tables of these chains are stored
+// in one cache, its budget is the largest L2 cache size of the chains.
+int qcow2_chain_open (
+  QCow2Chain *chain,
+  const char *filename,
+  const char *base,
+  int flags,
+  size_t l2CacheSize,
+  bool shareImages,
+  char **error
+);
 int qcow2_chain_close (QCow2Chain *chain, char **error);
 
+// Read the L2 tables of all the images in the cache (up to its memory budget) before the first lookup.
+// Tables are sorted by offset, adjacent ones are merged and the reads are queued with io_uring if available.
+int qcow2_chain_preload_l2_tables (QCow2Chain *chain, unsigned queueDepth, char **error);
+
 // -----------------------------------------------------------------------------
 
 // Similar to qcow2_image_find_clusters_offset but used on a chain.
@@ -291,4 +437,61 @@ typedef int (*Qcow2ForeachCb)(
 // Apply a callback on each contiguous clusters.
 int qcow2_chain_foreach_clusters (const QCow2Chain *chain, Qcow2ForeachCb cb, void *userData, char **error);
 
+// Same as qcow2_chain_foreach_clusters but limited to the sectors range [startSector, endSector[.
+int qcow2_chain_foreach_clusters_in_range (
+  const QCow2Chain *chain,
+  uint64_t startSector,
+  uint64_t endSector,
+  Qcow2ForeachCb cb,
+  void *userData,
+  char **error
+);
+
+// =============================================================================
+
+// Run of contiguous virtual bytes with the same type in the same image.
+typedef struct {
+  uint64_t vaddr;          // Start of the run, it ends at the start of the next one.
+  uint64_t offset;         // Offset of vaddr in the image file if the run is allocated, descriptor if compressed.
+  const QCow2Image *image; // Owner of the run (last visited image if unallocated).
+  uint32_t typeMask;
+} QCow2Extent;
+
+// Chain resolved once: the memory usage depends on the number of runs, not on the virtual size.
+// The runs are stored up to a memory budget, the end of the disk is then looked up in the chain.
+typedef struct {
+  const QCow2Chain *chain;
+  QCow2Extent *extents;
+  size_t count;
+  size_t capacity;
+  size_t maxCount;        // Number of runs allowed by the memory budget.
+  uint64_t size;          // Virtual size covered by the extents, the rest is located with the chain.
+  size_t compressedCount; // Number of compressed runs, one per compressed cluster (in the whole chain).
+} QCow2ExtentMap;
+
+// Walk the chain (from chain->image to chain->base) to build the extent map.
+// The extents use at most `memoryLimit` bytes (QCOW2_L2_CACHE_DEFAULT_SIZE if zero), at least one is stored.
+int qcow2_extent_map_build (QCow2ExtentMap *map, const QCow2Chain *chain, size_t memoryLimit, char **error);
+void qcow2_extent_map_destroy (QCow2ExtentMap *map);
+
+// Same as qcow2_chain_foreach_clusters_in_range without access to the images.
+// The given offset is the offset of the first sector of each run (the descriptor of a compressed run).
+int qcow2_extent_map_foreach_in_range (
+  const QCow2ExtentMap *map,
+  uint64_t startSector,
+  uint64_t endSector,
+  Qcow2ForeachCb cb,
+  void *userData,
+  char **error
+);
+
+// Give the start of the first compressed run (above the base) in [vaddr, endVaddr[, endVaddr if there is none.
+uint64_t qcow2_extent_map_find_compressed (const QCow2ExtentMap *map, uint64_t vaddr, uint64_t endVaddr);
+
+// Same as qcow2_image_map on chain->image, only the parents of the base are read to locate data
+// (and the images of the chain past the extents).
+int qcow2_extent_map_map (
+  const QCow2ExtentMap *map, uint64_t vaddr, size_t nBytes, Qcow2MapCb cb, void *userData, char **error
+);
+
 #endif // ifndef _XCP_NG_VDI_STREAM_QCOW2_H_
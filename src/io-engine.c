@@ -0,0 +1,435 @@
+/*
+ * xcp-ng-vdi-stream
+ * Copyright (C) 2019  Vates SAS - ronan.abhamon@vates.fr
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <inttypes.h>
+#include <linux/io_uring.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <xcp-ng/generic/file.h>
+#include <xcp-ng/generic/io.h>
+
+#include "error.h"
+#include "global.h"
+#include "io-engine.h"
+
+// =============================================================================
+
+// Max number of registered image descriptors.
+#define IO_ENGINE_MAX_FIXED_FILES 64u
+
+// Max size of one request, bigger reads are split.
+#define IO_ENGINE_MAX_REQUEST_SIZE (1u << 30)
+
+// -----------------------------------------------------------------------------
+
+typedef struct {
+  int fd;
+  char *buf;
+  size_t count;
+  uint64_t offset;
+} IoRequest;
+
+struct IoEngine {
+  int ringFd;
+
+  // Submission queue.
+  void *sqRing;
+  size_t sqRingSize;
+  unsigned *sqHead;
+  unsigned *sqTail;
+  unsigned sqMask;
+  unsigned *sqArray;
+  struct io_uring_sqe *sqes;
+  size_t sqesSize;
+
+  // Completion queue. It can share the mapping of the submission queue.
+  void *cqRing;
+  size_t cqRingSize;
+  unsigned *cqHead;
+  unsigned *cqTail;
+  unsigned cqMask;
+  struct io_uring_cqe *cqes;
+
+  // Requests in flight, user_data of entries is an index in this array.
+  IoRequest *requests;
+  unsigned *freeRequests;
+  unsigned freeCount;
+  unsigned queueDepth;
+  unsigned toSubmit; // Prepared entries not yet given to the kernel.
+
+  struct iovec *buffers; // Registered buffers, NULL if not used.
+  unsigned bufferCount;
+
+  int fixedFiles[IO_ENGINE_MAX_FIXED_FILES]; // Registered descriptors.
+  unsigned fixedFileCount;
+  bool useFixedFiles;
+
+  int error; // First errno of a failed request, or -1 for a truncated read.
+  IoRequest failedRequest;
+};
+
+// -----------------------------------------------------------------------------
+
+static inline int sys_io_uring_setup (unsigned entries, struct io_uring_params *params) {
+  return (int)syscall(__NR_io_uring_setup, entries, params);
+}
+
+static inline int sys_io_uring_enter (int fd, unsigned toSubmit, unsigned minComplete, unsigned flags) {
+  return (int)syscall(__NR_io_uring_enter, fd, toSubmit, minComplete, flags, NULL, 0);
+}
+
+static inline int sys_io_uring_register (int fd, unsigned opcode, const void *arg, unsigned nArgs) {
+  return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nArgs);
+}
+
+// -----------------------------------------------------------------------------
+
+static void set_request_error (const IoEngine *engine, char **error) {
+  const IoRequest *request = &engine->failedRequest;
+  if (engine->error > 0)
+    set_error(
+      error, "Failed to read %zuB at offset %#" PRIx64 " (%s)", request->count, request->offset, strerror(engine->error)
+    );
+  else
+    set_error(error, "Truncated read of %zuB at offset %#" PRIx64, request->count, request->offset);
+}
+
+static int submit (IoEngine *engine, char **error) {
+  while (engine->toSubmit) {
+    const int ret = sys_io_uring_enter(engine->ringFd, engine->toSubmit, 0, 0);
+    if (ret < 0) {
+      if (errno == EINTR || errno == EAGAIN || errno == EBUSY)
+        continue;
+      set_error(error, "Failed to submit reads (%s)", strerror(errno));
+      return -1;
+    }
+    engine->toSubmit -= (unsigned)ret;
+  }
+  return 0;
+}
+
+static int get_fixed_file (IoEngine *engine, int fd) {
+  for (unsigned i = 0; i < engine->fixedFileCount; ++i)
+    if (engine->fixedFiles[i] == fd)
+      return (int)i;
+
+  if (engine->fixedFileCount == IO_ENGINE_MAX_FIXED_FILES)
+    return -1;
+
+  struct io_uring_files_update update = { .offset = engine->fixedFileCount, .fds = (uintptr_t)&fd };
+  if (sys_io_uring_register(engine->ringFd, IORING_REGISTER_FILES_UPDATE, &update, 1) != 1)
+    return -1;
+
+  engine->fixedFiles[engine->fixedFileCount] = fd;
+  return (int)engine->fixedFileCount++;
+}
+
+static int get_fixed_buffer (const IoEngine *engine, const char *buf, size_t count) {
+  for (unsigned i = 0; i < engine->bufferCount; ++i) {
+    const char *base = engine->buffers[i].iov_base;
+    if (buf >= base && buf + count <= base + engine->buffers[i].iov_len)
+      return (int)i;
+  }
+  return -1;
+}
+
+// Add a request in the submission queue. The queue cannot be full: there are always
+// less requests in flight than entries.
+static void prepare_request (IoEngine *engine, unsigned index) {
+  const IoRequest *request = &engine->requests[index];
+
+  const unsigned tail = *engine->sqTail;
+  const unsigned sqIndex = tail & engine->sqMask;
+  struct io_uring_sqe *sqe = &engine->sqes[sqIndex];
+  memset(sqe, 0, sizeof *sqe);
+
+  const int fixedFile = engine->useFixedFiles ? get_fixed_file(engine, request->fd) : -1;
+  if (fixedFile >= 0) {
+    sqe->fd = fixedFile;
+    sqe->flags = IOSQE_FIXED_FILE;
+  } else
+    sqe->fd = request->fd;
+
+  const int fixedBuffer = get_fixed_buffer(engine, request->buf, request->count);
+  if (fixedBuffer >= 0) {
+    sqe->opcode = IORING_OP_READ_FIXED;
+    sqe->buf_index = (uint16_t)fixedBuffer;
+  } else
+    sqe->opcode = IORING_OP_READ;
+
+  sqe->off = request->offset;
+  sqe->addr = (uintptr_t)request->buf;
+  sqe->len = (uint32_t)request->count;
+  sqe->user_data = index;
+
+  engine->sqArray[sqIndex] = sqIndex;
+  __atomic_store_n(engine->sqTail, tail + 1, __ATOMIC_RELEASE);
+  ++engine->toSubmit;
+}
+
+static void complete_request (IoEngine *engine, unsigned index, int res) {
+  IoRequest *request = &engine->requests[index];
+
+  // Unaligned request on a O_DIRECT descriptor: use a bounce buffer.
+  if (res == -EINVAL) {
+    const XcpError ret = direct_safe_pread(request->fd, request->buf, request->count, (off_t)request->offset);
+    res = ret == XCP_ERR_ERRNO ? -errno : (int)ret;
+  }
+
+  // Short reads are possible (e.g. on network file systems): continue with the remaining bytes.
+  if (res > 0 && (size_t)res < request->count) {
+    request->buf += res;
+    request->count -= (size_t)res;
+    request->offset += (uint64_t)res;
+    prepare_request(engine, index);
+    return;
+  }
+
+  if ((res < 0 || (size_t)res != request->count) && !engine->error) {
+    engine->error = res < 0 ? -res : -1;
+    engine->failedRequest = *request;
+  }
+  engine->freeRequests[engine->freeCount++] = index;
+}
+
+// Handle the available completions. If wait is true, block until at least one is available.
+static int reap (IoEngine *engine, bool wait, char **error) {
+  for (;;) {
+    unsigned head = *engine->cqHead;
+    const unsigned tail = __atomic_load_n(engine->cqTail, __ATOMIC_ACQUIRE);
+    const bool found = head != tail;
+    for (; head != tail; ++head) {
+      const struct io_uring_cqe *cqe = &engine->cqes[head & engine->cqMask];
+      complete_request(engine, (unsigned)cqe->user_data, cqe->res);
+    }
+    __atomic_store_n(engine->cqHead, head, __ATOMIC_RELEASE);
+
+    // Resubmit the remaining bytes of short reads.
+    if (submit(engine, error) < 0)
+      return -1;
+
+    if (found || !wait)
+      return 0;
+
+    if (sys_io_uring_enter(engine->ringFd, 0, 1, IORING_ENTER_GETEVENTS) < 0 && errno != EINTR) {
+      set_error(error, "Failed to wait reads (%s)", strerror(errno));
+      return -1;
+    }
+  }
+}
+
+// -----------------------------------------------------------------------------
+
+static int map_rings (IoEngine *engine, const struct io_uring_params *params) {
+  engine->sqRingSize = params->sq_off.array + params->sq_entries * sizeof(unsigned);
+  engine->cqRingSize = params->cq_off.cqes + params->cq_entries * sizeof(struct io_uring_cqe);
+
+  const bool singleMap = params->features & IORING_FEAT_SINGLE_MMAP;
+  if (singleMap)
+    engine->sqRingSize = engine->cqRingSize = XCP_MAX(engine->sqRingSize, engine->cqRingSize);
+
+  const int prot = PROT_READ | PROT_WRITE;
+  const int flags = MAP_SHARED | MAP_POPULATE;
+
+  engine->sqRing = mmap(NULL, engine->sqRingSize, prot, flags, engine->ringFd, IORING_OFF_SQ_RING);
+  if (engine->sqRing == MAP_FAILED)
+    return -1;
+
+  engine->cqRing = singleMap
+    ? engine->sqRing
+    : mmap(NULL, engine->cqRingSize, prot, flags, engine->ringFd, IORING_OFF_CQ_RING);
+  if (engine->cqRing == MAP_FAILED)
+    return -1;
+
+  engine->sqesSize = params->sq_entries * sizeof(struct io_uring_sqe);
+  engine->sqes = mmap(NULL, engine->sqesSize, prot, flags, engine->ringFd, IORING_OFF_SQES);
+  if (engine->sqes == MAP_FAILED)
+    return -1;
+
+  char *sq = engine->sqRing;
+  engine->sqHead = (unsigned *)(sq + params->sq_off.head);
+  engine->sqTail = (unsigned *)(sq + params->sq_off.tail);
+  engine->sqMask = *(unsigned *)(sq + params->sq_off.ring_mask);
+  engine->sqArray = (unsigned *)(sq + params->sq_off.array);
+
+  char *cq = engine->cqRing;
+  engine->cqHead = (unsigned *)(cq + params->cq_off.head);
+  engine->cqTail = (unsigned *)(cq + params->cq_off.tail);
+  engine->cqMask = *(unsigned *)(cq + params->cq_off.ring_mask);
+  engine->cqes = (struct io_uring_cqe *)(cq + params->cq_off.cqes);
+
+  return 0;
+}
+
+static void unmap_rings (IoEngine *engine) {
+  if (engine->sqes && engine->sqes != MAP_FAILED)
+    munmap(engine->sqes, engine->sqesSize);
+  if (engine->cqRing && engine->cqRing != MAP_FAILED && engine->cqRing != engine->sqRing)
+    munmap(engine->cqRing, engine->cqRingSize);
+  if (engine->sqRing && engine->sqRing != MAP_FAILED)
+    munmap(engine->sqRing, engine->sqRingSize);
+}
+
+IoEngine *io_engine_create (XcpVdiStreamIoEngine type, unsigned queueDepth, unsigned flags, char **error) {
+  if (type != XCP_VDI_STREAM_IO_ENGINE_IO_URING) {
+    set_error(error, "Unsupported I/O engine: %d", (int)type);
+    return NULL;
+  }
+
+  IoEngine *engine = calloc(1, sizeof *engine);
+  if (!engine) {
+    set_error(error, "Failed to create IoEngine (%s)", strerror(errno));
+    return NULL;
+  }
+
+  queueDepth = queueDepth ? XCP_MIN(queueDepth, IO_ENGINE_MAX_QUEUE_DEPTH) : IO_ENGINE_DEFAULT_QUEUE_DEPTH;
+
+  struct io_uring_params params;
+  memset(&params, 0, sizeof params);
+  if ((engine->ringFd = sys_io_uring_setup(queueDepth, &params)) < 0) {
+    set_error(error, "Failed to setup io_uring (%s)", strerror(errno));
+    free(engine);
+    return NULL;
+  }
+
+  if (map_rings(engine, &params) < 0) {
+    set_error(error, "Failed to map io_uring queues (%s)", strerror(errno));
+    goto fail;
+  }
+
+  engine->queueDepth = queueDepth;
+  if (
+    !(engine->requests = malloc(queueDepth * sizeof *engine->requests)) ||
+    !(engine->freeRequests = malloc(queueDepth * sizeof *engine->freeRequests))
+  ) {
+    set_error(error, "Failed to allocate io_uring requests (%s)", strerror(errno));
+    goto fail;
+  }
+  for (; engine->freeCount < queueDepth; ++engine->freeCount)
+    engine->freeRequests[engine->freeCount] = queueDepth - engine->freeCount - 1;
+
+  // Sparse table of descriptors, they are registered on first use.
+  if (flags & XCP_VDI_STREAM_IO_FIXED_FILES) {
+    for (unsigned i = 0; i < IO_ENGINE_MAX_FIXED_FILES; ++i)
+      engine->fixedFiles[i] = -1;
+    engine->useFixedFiles = !sys_io_uring_register(
+      engine->ringFd, IORING_REGISTER_FILES, engine->fixedFiles, IO_ENGINE_MAX_FIXED_FILES
+    );
+  }
+
+  return engine;
+
+fail:
+  free(engine->freeRequests);
+  free(engine->requests);
+  unmap_rings(engine);
+  xcp_fd_close(engine->ringFd);
+  free(engine);
+  return NULL;
+}
+
+void io_engine_destroy (IoEngine *engine) {
+  if (!engine)
+    return;
+
+  // The buffers of the requests must not be released while the kernel uses them.
+  char *error = NULL;
+  while (engine->freeCount != engine->queueDepth && reap(engine, true, &error) == 0);
+  free(error);
+
+  unmap_rings(engine);
+  xcp_fd_close(engine->ringFd);
+
+  free(engine->buffers);
+  free(engine->freeRequests);
+  free(engine->requests);
+  free(engine);
+}
+
+int io_engine_register_buffers (IoEngine *engine, const struct iovec *buffers, unsigned count) {
+  if (!(engine->buffers = malloc(count * sizeof *engine->buffers)))
+    return -1;
+
+  // Registration can fail if the locked memory limit is too low.
+  if (sys_io_uring_register(engine->ringFd, IORING_REGISTER_BUFFERS, buffers, count) < 0) {
+    free(engine->buffers);
+    engine->buffers = NULL;
+    return -1;
+  }
+
+  memcpy(engine->buffers, buffers, count * sizeof *engine->buffers);
+  engine->bufferCount = count;
+  return 0;
+}
+
+int io_engine_read (IoEngine *engine, int fd, void *buf, size_t count, uint64_t offset, char **error) {
+  while (count) {
+    // Wait a free request if the queue is full.
+    while (!engine->freeCount)
+      if (reap(engine, true, error) < 0)
+        return -1;
+
+    const unsigned index = engine->freeRequests[--engine->freeCount];
+    const size_t nBytes = XCP_MIN(count, (size_t)IO_ENGINE_MAX_REQUEST_SIZE);
+    engine->requests[index] = (IoRequest){ .fd = fd, .buf = buf, .count = nBytes, .offset = offset };
+    prepare_request(engine, index);
+
+    buf = (char *)buf + nBytes;
+    count -= nBytes;
+    offset += nBytes;
+  }
+
+  // Reads are started immediately, so they run while the next extents are located.
+  return submit(engine, error) < 0 || reap(engine, false, error) < 0 ? -1 : 0;
+}
+
+int io_engine_wait (IoEngine *engine, char **error) {
+  while (engine->freeCount != engine->queueDepth)
+    if (reap(engine, true, error) < 0)
+      return -1;
+
+  if (engine->error) {
+    set_request_error(engine, error);
+    engine->error = 0;
+    return -1;
+  }
+
+  return 0;
+}
+
+// -----------------------------------------------------------------------------
+
+int io_engine_pread (int fd, void *buf, size_t count, uint64_t offset, char **error) {
+  const XcpError ret = direct_safe_pread(fd, buf, count, (off_t)offset);
+  if (ret == XCP_ERR_ERRNO) {
+    set_error(error, "Failed to read %zuB at offset %#" PRIx64 " (%s)", count, offset, strerror(errno));
+    return -1;
+  }
+  if ((size_t)ret != count) {
+    set_error(
+      error, "Truncated read (expected=%zu, current=%zu) at offset %#" PRIx64, count, (size_t)ret, offset
+    );
+    return -1;
+  }
+  return 0;
+}
@@ -0,0 +1,60 @@
+/*
+ * xcp-ng-vdi-stream
+ * Copyright (C) 2019  Vates SAS - ronan.abhamon@vates.fr
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef _XCP_NG_VDI_STREAM_IO_ENGINE_H_
+#define _XCP_NG_VDI_STREAM_IO_ENGINE_H_
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include "xcp-ng/vdi-stream.h"
+
+// =============================================================================
+
+// Default number of reads in flight.
+#define IO_ENGINE_DEFAULT_QUEUE_DEPTH 32u
+
+#define IO_ENGINE_MAX_QUEUE_DEPTH 4096u
+
+// -----------------------------------------------------------------------------
+
+typedef struct IoEngine IoEngine;
+
+// Create an engine which queues the reads (see XcpVdiStreamIoEngine).
+// Returns NULL if the engine is not supported, io_engine_pread must be used in this case.
+IoEngine *io_engine_create (XcpVdiStreamIoEngine type, unsigned queueDepth, unsigned flags, char **error);
+
+// Wait the reads in flight and release the engine.
+void io_engine_destroy (IoEngine *engine);
+
+// Register the buffers used as read destination (see XCP_VDI_STREAM_IO_FIXED_BUFFERS).
+// Optional: on failure, the reads use the buffers without registration.
+int io_engine_register_buffers (IoEngine *engine, const struct iovec *buffers, unsigned count);
+
+// Queue a read of N bytes. The buffer must not be used before a call to io_engine_wait.
+int io_engine_read (IoEngine *engine, int fd, void *buf, size_t count, uint64_t offset, char **error);
+
+// Wait the end of all queued reads. Returns -1 if one of them has failed.
+int io_engine_wait (IoEngine *engine, char **error);
+
+// -----------------------------------------------------------------------------
+
+// Blocking read of N bytes, a short read is an error.
+int io_engine_pread (int fd, void *buf, size_t count, uint64_t offset, char **error);
+
+#endif // ifndef _XCP_NG_VDI_STREAM_IO_ENGINE_H_
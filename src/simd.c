@@ -0,0 +1,56 @@
+/*
+ * xcp-ng-vdi-stream
+ * Copyright (C) 2019  Vates SAS - ronan.abhamon@vates.fr
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "simd.h"
+
+// =============================================================================
+
+static const char *SimdLevelNames[] = {
+  [SimdLevelScalar] = "scalar",
+  [SimdLevelSse2] = "sse2",
+  [SimdLevelSse41] = "sse4.1",
+  [SimdLevelAvx2] = "avx2"
+};
+
+static SimdLevel simd_get_cpu_level () {
+  #if defined(__x86_64__) && defined(__GNUC__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+      return SimdLevelAvx2;
+    if (__builtin_cpu_supports("sse4.1"))
+      return SimdLevelSse41;
+    return SimdLevelSse2; // Always available on x86-64.
+  #else
+    return SimdLevelScalar;
+  #endif
+}
+
+SimdLevel simd_get_level (const char *envName) {
+  SimdLevel level = simd_get_cpu_level();
+
+  const char *name = getenv(envName);
+  if (name) {
+    for (SimdLevel forced = SimdLevelScalar; forced < level; ++forced)
+      if (!strcmp(name, SimdLevelNames[forced]))
+        return forced;
+  }
+
+  return level;
+}
@@ -0,0 +1,38 @@
+/*
+ * xcp-ng-vdi-stream
+ * Copyright (C) 2019  Vates SAS - ronan.abhamon@vates.fr
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef _XCP_NG_VDI_STREAM_SIMD_H_
+#define _XCP_NG_VDI_STREAM_SIMD_H_
+
+// =============================================================================
+// Runtime selection of the vectorized kernels (see zero-scan.c and qcow2-l2-scan.c).
+// =============================================================================
+
+// Instruction sets of the kernels, from the slowest to the fastest.
+typedef enum {
+  SimdLevelScalar,
+  SimdLevelSse2,
+  SimdLevelSse41,
+  SimdLevelAvx2
+} SimdLevel;
+
+// Give the best level supported by the CPU. If the environment variable is set (scalar, sse2, sse4.1 or avx2),
+// the level is not higher than the given one: a module without kernel for this level uses the next slower one.
+// Called by the constructors of the modules.
+SimdLevel simd_get_level (const char *envName);
+
+#endif // ifndef _XCP_NG_VDI_STREAM_SIMD_H_
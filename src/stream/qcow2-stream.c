@@ -15,17 +15,28 @@
  * along with this program.  If not, see <https://www.gnu.org/licenses/>.
  */
 
+#define _GNU_SOURCE
 #include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <inttypes.h>
+#include <pthread.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
 #include <xcp-ng/generic/endian.h>
 
+#include "compression.h"
 #include "global.h"
 #include "image-format/qcow2.h"
+#include "image-format/qcow2-bitmap.h"
+#include "image-format/qcow2-index.h"
+#include "io-engine.h"
 #include "vdi-driver.h"
 #include "vdi-stream-p.h"
+#include "zero-scan.h"
 
 // =============================================================================
 
@@ -35,77 +46,1470 @@
 
 #define qcow2_debug_log(FMT, ...) debug_log("[qcow2-stream] " FMT, ##__VA_ARGS__)
 
+// Number of table entries buffered before a write.
+#define ENTRY_WRITER_SIZE 128
+
+// No L2 table is written for this L1 entry.
+#define NO_L2_TABLE UINT32_MAX
+
+// No host cluster is used by this cluster (extended L2 entries).
+#define NO_HOST_CLUSTER UINT64_MAX
+
+// Host clusters which can still receive the subclusters of the next clusters.
+#define SUBCLUSTER_PACKER_WINDOW 32u
+
+// Size of the buffer of refcounts written at once in the refcount blocks.
+#define REFCOUNT_PATTERN_SIZE 4096
+
+// Clusters which do not save at least 1/8 of their size are stored uncompressed.
+#define COMPRESSED_CLUSTER_MAX_SIZE(CLUSTER_SIZE) ((CLUSTER_SIZE) - (CLUSTER_SIZE) / 8)
+
+// Compression jobs in flight per worker: only sizes when the layout is computed, data when it is streamed.
+#define COMPRESSION_LAYOUT_JOBS_PER_WORKER 8u
+#define COMPRESSION_WRITE_JOBS_PER_WORKER 2u
+
+// Memory of the job buffers of a pipeline, at least one job per worker.
+#define COMPRESSION_PIPELINE_MAX_MEMORY (64u << 20)
+
+// Bounds of the prefetch window (allocated bytes hinted ahead of the stream).
+#define PREFETCH_MIN_WINDOW XCP_VDI_STREAM_CHUNK_SIZE
+#define PREFETCH_MAX_WINDOW (XCP_VDI_STREAM_CHUNK_SIZE << 5)
+
+// The prefetch window contains the data consumed during this delay.
+#define PREFETCH_HORIZON_US 250000u
+
+// -----------------------------------------------------------------------------
+
+// Type of a cluster in the generated image.
+typedef enum {
+  OutputClusterUnallocated,
+  OutputClusterZero,
+  OutputClusterAllocated
+} OutputClusterType;
+
+typedef struct {
+  uint64_t dataClusterIndex; // Number of allocated clusters before this L1 entry.
+  uint64_t dataOffset;       // Offset of the data of the L1 entry, before the alignment of its first cluster.
+  uint32_t l2TableIndex;     // Index of the L2 table in the generated image or NO_L2_TABLE.
+} L1EntryLayout;
+
+// Layout of the generated image. It is computed using only the metadata of the chain,
+// so any region can be generated without the previous ones (see xcp_vdi_stream_seek).
+typedef struct {
+  QCow2Header header; // CPU endianness.
+
+  uint32_t clusterSize;
+  uint32_t l2Bits;
+  uint32_t l2Size;
+
+  uint64_t refcountBlocksOffset;
+  uint64_t l2TablesOffset;
+  uint64_t dataOffset;
+  uint64_t endOffset;
+
+  uint32_t refcountBlockCount;
+  uint32_t l2TableCount;
+  uint64_t dataClusterCount;
+  uint64_t zeroClusterCount;
+  uint64_t dataSize; // Size of the data, the last cluster is padded.
+
+  L1EntryLayout *l1Entries; // One entry per L1 entry of the header.
+
+  // See xcp_vdi_stream_set_compression, NULL without compression.
+  uint32_t *compressedSizes; // One per allocated cluster, 0 if the cluster is stored uncompressed.
+  uint16_t *dataRefcounts;   // One per cluster of the data, shared by the compressed clusters.
+} StreamLayout;
+
+typedef struct {
+  uint64_t cluster;
+  uint64_t count;
+} ClusterRun;
+
+// Allocated clusters of the generated image which contain only zeros (see xcp_vdi_stream_set_zero_detection).
+typedef struct {
+  ClusterRun *runs; // Sorted and disjoint.
+  size_t count;
+  size_t capacity;
+} ZeroClusters;
+
+typedef struct {
+  QCow2Chain chain;
+  QCow2ExtentMap extentMap; // Built with the layout, then shared by all the phases.
+  QCow2DirtyBitmap dirtyBitmap; // Incremental export if bits is not NULL, see xcp_vdi_stream_set_dirty_bitmap.
+  ZeroClusters zeroClusters; // Detected with the layout.
+
+  // Options of the stream. They are copied because the pread streams only share this data.
+  bool zeroDetection;
+  XcpVdiStreamCompression compression;
+  unsigned compressionWorkerCount;
+  CompressionPool *compressionPool; // Created with the layout, also decompresses the clusters of the chain.
+  bool extendedL2;
+  uint32_t clusterBits; // Of the generated image, the chain clusters are split or merged.
+
+  pthread_mutex_t layoutMutex; // The layout can be computed by the producer thread (see read-ahead).
+  StreamLayout layout;
+  bool hasLayout;
+} QCow2StreamData;
+
 // -----------------------------------------------------------------------------
 
+typedef int (*OutputClustersCb)(uint64_t cluster, uint64_t count, OutputClusterType type, void *userData);
+
+// Compute the type of the generated clusters using the clusters of the chain.
+// The chain can use smaller or greater clusters, so a generated cluster can be composed of several types.
+typedef struct {
+  uint32_t clusterBits;
+  uint32_t l2Size;
+
+  uint64_t accCluster; // Cluster partially covered by the previous chain clusters.
+  uint64_t accBytes;   // Covered bytes of this cluster, 0 if there is no partial cluster.
+  uint32_t accParts;   // ClusterPart mask of this cluster.
+
+  const QCow2DirtyBitmap *dirtyBitmap; // Only the dirty clusters are written if not NULL.
+  const ZeroClusters *zeroClusters; // These allocated clusters are written as zero clusters if not NULL.
+
+  OutputClustersCb cb;
+  void *userData;
+} ClusterClassifier;
+
+// Parts which compose a generated cluster.
+typedef enum {
+  ClusterPartData = 1,
+  ClusterPartZero = 2,
+  ClusterPartUnallocated = 4
+} ClusterPart;
+
+static inline uint32_t to_cluster_part (uint32_t typeMask) {
+  if (typeMask & ClusterTypeZero)
+    return ClusterPartZero;
+  if (typeMask & (ClusterTypeAllocated | ClusterTypeCompressed))
+    return ClusterPartData;
+  return ClusterPartUnallocated;
+}
+
+static inline OutputClusterType to_output_cluster_type (uint32_t parts) {
+  // Data must be copied if one part contains data or if the parts can't be described by one L2 entry.
+  // Note: Zero parts cannot overwrite data, otherwise the data of the smaller clusters of the chain are lost.
+  if ((parts & ClusterPartData) || parts == (ClusterPartZero | ClusterPartUnallocated))
+    return OutputClusterAllocated;
+  if (parts & ClusterPartZero)
+    return OutputClusterZero;
+  return OutputClusterUnallocated;
+}
+
+// Give the index of the first run which ends after the cluster.
+static size_t zero_clusters_find (const ZeroClusters *zeroClusters, uint64_t cluster) {
+  size_t left = 0;
+  size_t right = zeroClusters->count;
+  while (left < right) {
+    const size_t mid = left + (right - left) / 2;
+    const ClusterRun *run = &zeroClusters->runs[mid];
+    if (run->cluster + run->count <= cluster)
+      left = mid + 1;
+    else
+      right = mid;
+  }
+  return left;
+}
+
+static int zero_clusters_add (ZeroClusters *zeroClusters, uint64_t cluster) {
+  if (zeroClusters->count) {
+    ClusterRun *last = &zeroClusters->runs[zeroClusters->count - 1];
+    if (last->cluster + last->count == cluster) {
+      ++last->count;
+      return 0;
+    }
+  }
+
+  if (zeroClusters->count == zeroClusters->capacity) {
+    const size_t capacity = XCP_MAX(zeroClusters->capacity * 2, (size_t)64);
+    ClusterRun *runs = realloc(zeroClusters->runs, capacity * sizeof *runs);
+    if (!runs)
+      return -1;
+    zeroClusters->runs = runs;
+    zeroClusters->capacity = capacity;
+  }
+
+  zeroClusters->runs[zeroClusters->count++] = (ClusterRun){ .cluster = cluster, .count = 1 };
+  return 0;
+}
+
+static void zero_clusters_destroy (ZeroClusters *zeroClusters) {
+  free(zeroClusters->runs);
+  *zeroClusters = (ZeroClusters){ 0 };
+}
+
+// -----------------------------------------------------------------------------
+
+static int classifier_emit_l2_ranges (
+  ClusterClassifier *classifier, uint64_t cluster, uint64_t count, OutputClusterType type
+) {
+  // Never give clusters of several L2 tables in one call.
+  while (count) {
+    const uint64_t n = XCP_MIN(count, classifier->l2Size - (cluster & (classifier->l2Size - 1)));
+    if ((*classifier->cb)(cluster, n, type, classifier->userData) < 0)
+      return -1;
+    cluster += n;
+    count -= n;
+  }
+
+  return 0;
+}
+
+static int classifier_emit_type (
+  ClusterClassifier *classifier, uint64_t cluster, uint64_t count, OutputClusterType type
+) {
+  const ZeroClusters *zeroClusters = classifier->zeroClusters;
+  if (type != OutputClusterAllocated || !zeroClusters)
+    return classifier_emit_l2_ranges(classifier, cluster, count, type);
+
+  // The allocated clusters which contain only zeros do not need data.
+  for (size_t i = zero_clusters_find(zeroClusters, cluster); count; ) {
+    const ClusterRun *run = i < zeroClusters->count ? &zeroClusters->runs[i] : NULL;
+
+    uint64_t n = count;
+    OutputClusterType runType = OutputClusterAllocated;
+    if (run && run->cluster <= cluster) {
+      n = XCP_MIN(count, run->cluster + run->count - cluster);
+      runType = OutputClusterZero;
+      ++i;
+    } else if (run)
+      n = XCP_MIN(count, run->cluster - cluster);
+
+    if (classifier_emit_l2_ranges(classifier, cluster, n, runType) < 0)
+      return -1;
+    cluster += n;
+    count -= n;
+  }
+
+  return 0;
+}
+
+static int classifier_emit (ClusterClassifier *classifier, uint64_t cluster, uint64_t count, uint32_t parts) {
+  const QCow2DirtyBitmap *dirtyBitmap = classifier->dirtyBitmap;
+  if (!dirtyBitmap)
+    return classifier_emit_type(classifier, cluster, count, to_output_cluster_type(parts));
+
+  // Incremental export: the clean clusters are not written, they are given by the previous export.
+  // The dirty clusters are applied on top of it, so their unallocated parts (zeros in the full chain)
+  // must be written as zeros.
+  if (parts & ClusterPartUnallocated)
+    parts = (parts & ~(uint32_t)ClusterPartUnallocated) | ClusterPartZero;
+  const OutputClusterType dirtyType = to_output_cluster_type(parts);
+
+  const uint32_t clusterBits = classifier->clusterBits;
+  const uint64_t clusterSize = 1ULL << clusterBits;
+  while (count) {
+    const uint64_t vaddr = cluster << clusterBits;
+    const uint64_t dirtyVaddr = qcow2_dirty_bitmap_find_dirty(dirtyBitmap, vaddr);
+
+    // A cluster is dirty if one of its granules is dirty: the dirty run ends with the cluster
+    // which contains the last dirty granule.
+    uint64_t n = XCP_MIN(count, (dirtyVaddr - vaddr) >> clusterBits);
+    OutputClusterType type = OutputClusterUnallocated;
+    if (!n) {
+      type = dirtyType;
+      const uint64_t cleanVaddr = qcow2_dirty_bitmap_find_clean(dirtyBitmap, dirtyVaddr);
+      n = XCP_MIN(count, (cleanVaddr - vaddr + clusterSize - 1) >> clusterBits);
+    }
+
+    if (classifier_emit_type(classifier, cluster, n, type) < 0)
+      return -1;
+    cluster += n;
+    count -= n;
+  }
+
+  return 0;
+}
+
+static int classifier_push (ClusterClassifier *classifier, uint64_t vaddr, uint64_t nBytes, uint32_t typeMask) {
+  const uint32_t clusterBits = classifier->clusterBits;
+  const uint64_t clusterSize = 1ULL << clusterBits;
+  const uint32_t part = to_cluster_part(typeMask);
+
+  // 1. Complete the partial cluster.
+  if (classifier->accBytes) {
+    assert(vaddr == (classifier->accCluster << clusterBits) + classifier->accBytes);
+
+    const uint64_t n = XCP_MIN(nBytes, clusterSize - classifier->accBytes);
+    classifier->accParts |= part;
+    classifier->accBytes += n;
+    if (classifier->accBytes < clusterSize)
+      return 0;
+
+    classifier->accBytes = 0;
+    if (classifier_emit(classifier, classifier->accCluster, 1, classifier->accParts) < 0)
+      return -1;
+    vaddr += n;
+    nBytes -= n;
+  }
+
+  // 2. Full clusters.
+  const uint64_t count = nBytes >> clusterBits;
+  if (count && classifier_emit(classifier, vaddr >> clusterBits, count, part) < 0)
+    return -1;
+
+  // 3. Start a new partial cluster.
+  nBytes -= count << clusterBits;
+  if (nBytes) {
+    classifier->accCluster = (vaddr >> clusterBits) + count;
+    classifier->accBytes = nBytes;
+    classifier->accParts = part;
+  }
+
+  return 0;
+}
+
+static int classifier_finish (ClusterClassifier *classifier) {
+  // The disk size is not always a multiple of the cluster size.
+  if (!classifier->accBytes)
+    return 0;
+
+  classifier->accBytes = 0;
+  return classifier_emit(classifier, classifier->accCluster, 1, classifier->accParts);
+}
+
+static int clusters_cb_classify (
+  uint64_t sector,
+  uint64_t nAvailableBytes,
+  uint32_t typeMask,
+  const QCow2Image *image,
+  uint64_t clustersOffset,
+  void *userData,
+  char **error
+) {
+  XCP_UNUSED(clustersOffset);
+  XCP_UNUSED(error);
+  XCP_UNUSED(image);
+
+  const uint64_t vaddr = sector << N_BITS_PER_SECTOR;
+  qcow2_debug_log(
+    "Src at vaddr %#0*" PRIx64 ": %zuB of %s at offset %#0*" PRIx64 " in %s.", HEX_LENGTH(vaddr),
+    vaddr, nAvailableBytes, qcow2_cluster_type_mask_to_string(typeMask), HEX_LENGTH(clustersOffset),
+    clustersOffset, image->filename
+  );
+
+  return classifier_push(userData, vaddr, nAvailableBytes, typeMask);
+}
+
+static int classifier_run (XcpVdiStream *stream, ClusterClassifier *classifier, uint64_t cluster, uint64_t endCluster) {
+  const QCow2StreamData *data = stream->streamData;
+
+  const uint32_t shift = classifier->clusterBits - N_BITS_PER_SECTOR;
+  if (qcow2_extent_map_foreach_in_range(
+    &data->extentMap, cluster << shift, endCluster << shift, clusters_cb_classify, classifier, &stream->errorString
+  ) < 0)
+    return -1;
+
+  return classifier_finish(classifier);
+}
+
+// Give the type of the generated clusters [cluster, endCluster[.
+static int classify_cluster_range (
+  XcpVdiStream *stream, uint64_t cluster, uint64_t endCluster, OutputClustersCb cb, void *userData
+) {
+  const QCow2StreamData *data = stream->streamData;
+  const StreamLayout *layout = &data->layout;
+
+  ClusterClassifier classifier = {
+    .clusterBits = layout->header.clusterBits,
+    .l2Size = layout->l2Size,
+    .dirtyBitmap = data->dirtyBitmap.bits ? &data->dirtyBitmap : NULL,
+    .zeroClusters = data->zeroClusters.count ? &data->zeroClusters : NULL,
+    .cb = cb,
+    .userData = userData
+  };
+  return classifier_run(stream, &classifier, cluster, endCluster);
+}
+
+// Give the type of the generated clusters addressed by the L1 entries [l1Index, endL1Index[.
+static inline int classify_clusters (
+  XcpVdiStream *stream, uint32_t l1Index, uint32_t endL1Index, OutputClustersCb cb, void *userData
+) {
+  const uint32_t l2Bits = ((QCow2StreamData *)stream->streamData)->layout.l2Bits;
+  return classify_cluster_range(stream, (uint64_t)l1Index << l2Bits, (uint64_t)endL1Index << l2Bits, cb, userData);
+}
+
+// -----------------------------------------------------------------------------
+
+static int output_subclusters_cb_fill_bitmap (
+  uint64_t subcluster, uint64_t count, OutputClusterType type, void *userData
+) {
+  // The subclusters are given by the classifier like the clusters of a L2 table: never more than one cluster.
+  uint64_t *bitmap = userData;
+  const uint64_t mask = ((1ULL << count) - 1) << (subcluster & (QCOW2_SUBCLUSTER_COUNT - 1));
+  if (type == OutputClusterAllocated)
+    *bitmap |= mask;
+  else if (type == OutputClusterZero)
+    *bitmap |= mask << QCOW2_SUBCLUSTER_BITMAP_ZERO_SHIFT;
+  return 0;
+}
+
+// Give the subclusters bitmap of an allocated cluster (extended L2 entries): the subclusters are classified
+// with the same rules as the clusters.
+static int classify_subclusters (XcpVdiStream *stream, uint64_t cluster, uint64_t *bitmap) {
+  const QCow2StreamData *data = stream->streamData;
+
+  *bitmap = 0;
+  ClusterClassifier classifier = {
+    .clusterBits = data->layout.header.clusterBits - QCOW2_SUBCLUSTER_BITS,
+    .l2Size = QCOW2_SUBCLUSTER_COUNT,
+    .dirtyBitmap = data->dirtyBitmap.bits ? &data->dirtyBitmap : NULL,
+    .zeroClusters = NULL,
+    .cb = output_subclusters_cb_fill_bitmap,
+    .userData = bitmap
+  };
+  return classifier_run(
+    stream, &classifier, cluster << QCOW2_SUBCLUSTER_BITS, (cluster + 1) << QCOW2_SUBCLUSTER_BITS
+  );
+}
+
+// Host cluster of the generated image with extended L2 entries. It is shared by the clusters
+// which use different subclusters, a subcluster is stored at the same offset in all of them.
+typedef struct {
+  uint32_t usedMask;   // Allocated subclusters stored in the host cluster.
+  uint16_t userCount;  // Number of L2 entries which use it (its refcount).
+  uint64_t firstCluster; // First cluster which uses it.
+  uint64_t owners[QCOW2_SUBCLUSTER_COUNT]; // Cluster of each used subcluster.
+} HostCluster;
+
+// The host clusters are given in order when no other cluster can use them.
+typedef int (*HostClusterCb)(uint64_t index, const HostCluster *host, void *userData);
+
+// The clusters are given in order with their subclusters bitmap and the index of their host cluster.
+typedef int (*PackedClusterCb)(uint64_t cluster, uint64_t bitmap, uint64_t hostIndex, void *userData);
+
+// Place the allocated subclusters of the clusters of one L1 entry in host clusters: a cluster uses the first
+// open host cluster where its subclusters are free. The host clusters only depend on the clusters of the L1 entry,
+// so they are computed again by each phase and the indexes are relative to the L1 entry.
+typedef struct {
+  XcpVdiStream *stream;
+
+  HostCluster hosts[SUBCLUSTER_PACKER_WINDOW]; // Ring of the open host clusters.
+  uint64_t firstHost; // Index of the oldest open host cluster.
+  uint64_t hostCount; // Number of host clusters of the L1 entry.
+
+  HostClusterCb hostCb;      // Can be NULL.
+  PackedClusterCb clusterCb; // Can be NULL.
+  void *userData;
+} SubclusterPacker;
+
+static int subcluster_packer_close_host (SubclusterPacker *packer) {
+  const uint64_t index = packer->firstHost++;
+  if (!packer->hostCb)
+    return 0;
+  return (*packer->hostCb)(index, &packer->hosts[index % SUBCLUSTER_PACKER_WINDOW], packer->userData);
+}
+
+static int subcluster_packer_place (SubclusterPacker *packer, uint64_t cluster, uint32_t mask, uint64_t *hostIndex) {
+  uint64_t index = packer->firstHost;
+  while (index < packer->hostCount && (packer->hosts[index % SUBCLUSTER_PACKER_WINDOW].usedMask & mask))
+    ++index;
+
+  HostCluster *host = &packer->hosts[index % SUBCLUSTER_PACKER_WINDOW];
+  if (index == packer->hostCount) {
+    // New host cluster, the oldest one is closed if the window is full.
+    if (packer->hostCount - packer->firstHost == SUBCLUSTER_PACKER_WINDOW && subcluster_packer_close_host(packer) < 0)
+      return -1;
+    ++packer->hostCount;
+    host->usedMask = 0;
+    host->userCount = 0;
+    host->firstCluster = cluster;
+  }
+
+  host->usedMask |= mask;
+  ++host->userCount;
+  for (uint32_t i = 0; i < QCOW2_SUBCLUSTER_COUNT; ++i)
+    if (mask & (1u << i))
+      host->owners[i] = cluster;
+
+  *hostIndex = index;
+  return 0;
+}
+
+static int output_clusters_cb_pack (uint64_t cluster, uint64_t count, OutputClusterType type, void *userData) {
+  SubclusterPacker *packer = userData;
+  if (type != OutputClusterAllocated && !packer->clusterCb)
+    return 0;
+
+  for (; count; ++cluster, --count) {
+    uint64_t bitmap = 0;
+    uint64_t hostIndex = NO_HOST_CLUSTER;
+    if (type != OutputClusterUnallocated && classify_subclusters(packer->stream, cluster, &bitmap) < 0)
+      return -1;
+
+    // The subclusters of a zero cluster (e.g. detected by xcp_vdi_stream_set_zero_detection) do not need data,
+    // like a cluster made of zero and unallocated subclusters.
+    if (type == OutputClusterZero)
+      bitmap = (bitmap & ~(uint64_t)UINT32_MAX) | (bitmap << QCOW2_SUBCLUSTER_BITMAP_ZERO_SHIFT);
+    else if ((uint32_t)bitmap && subcluster_packer_place(packer, cluster, (uint32_t)bitmap, &hostIndex) < 0)
+      return -1;
+
+    if (packer->clusterCb && (*packer->clusterCb)(cluster, bitmap, hostIndex, packer->userData) < 0)
+      return -1;
+  }
+
+  return 0;
+}
+
+// Give the host clusters of the L1 entry (extended L2 entries).
+static int pack_subclusters (SubclusterPacker *packer, uint32_t l1Index) {
+  packer->firstHost = 0;
+  packer->hostCount = 0;
+  if (classify_clusters(packer->stream, l1Index, l1Index + 1, output_clusters_cb_pack, packer) < 0)
+    return -1;
+
+  while (packer->firstHost < packer->hostCount)
+    if (subcluster_packer_close_host(packer) < 0)
+      return -1;
+  return 0;
+}
+
+// -----------------------------------------------------------------------------
+
+typedef struct {
+  XcpVdiStream *stream;
+
+  uint64_t entries[ENTRY_WRITER_SIZE]; // Big endian.
+  size_t count;
+} EntryWriter;
+
+static int entry_writer_flush (EntryWriter *writer) {
+  const size_t count = writer->count;
+  writer->count = 0;
+  return xcp_vdi_stream_co_write(writer->stream, writer->entries, count * sizeof *writer->entries);
+}
+
+static inline int entry_writer_push (EntryWriter *writer, uint64_t entry) {
+  writer->entries[writer->count++] = xcp_to_be_u64(entry);
+  return writer->count < XCP_ARRAY_LEN(writer->entries) ? 0 : entry_writer_flush(writer);
+}
+
+// -----------------------------------------------------------------------------
+
+// Entries of 64 bits, 128 bits with extended L2 entries: a L2 table occupies one cluster.
+static inline uint32_t get_l2_bits (const QCow2StreamData *data, uint32_t clusterBits) {
+  return clusterBits - (data->extendedL2 ? 4 : 3);
+}
+
+static int output_clusters_cb_compute_layout (
+  uint64_t cluster, uint64_t count, OutputClusterType type, void *userData
+) {
+  StreamLayout *layout = userData;
+  if (type == OutputClusterUnallocated)
+    return 0;
+
+  if (type == OutputClusterZero)
+    layout->zeroClusterCount += count;
+
+  // The L2 table indexes and the data cluster indexes are computed when the walk is done.
+  // For the moment, only the allocated clusters are counted.
+  L1EntryLayout *entry = &layout->l1Entries[cluster >> layout->l2Bits];
+  entry->l2TableIndex = 0;
+  if (type == OutputClusterAllocated)
+    entry->dataClusterIndex += count;
+
+  return 0;
+}
+
+static int map_cb_read_data (
+  const QCow2Image *image,
+  uint64_t offset,
+  size_t nBytes,
+  const QCow2CompressedRange *compressed,
+  void *userData,
+  char **error
+) {
+  unsigned char **cursor = userData;
+  if (!image)
+    memset(*cursor, 0, nBytes);
+  else if (compressed) {
+    if (qcow2_image_read_compressed(image, compressed, *cursor, nBytes, error) < 0)
+      return -1;
+  } else if (io_engine_pread(image->fd, *cursor, nBytes, offset, error) < 0)
+    return -1;
+
+  *cursor += nBytes;
+  return 0;
+}
+
+// Read the data of generated clusters. Can be called by several threads.
+static int read_clusters (
+  const QCow2StreamData *data, uint64_t cluster, uint64_t count, unsigned char *buf, char **error
+) {
+  const QCow2Chain *chain = &data->chain;
+  const uint32_t clusterBits = data->layout.header.clusterBits;
+
+  const uint64_t vaddr = cluster << clusterBits;
+  const uint64_t nBytes = count << clusterBits;
+  const uint64_t nAvailableBytes = XCP_MIN(nBytes, (chain->image.nbSectors << N_BITS_PER_SECTOR) - vaddr);
+
+  unsigned char *cursor = buf;
+  if (qcow2_extent_map_map(
+    &data->extentMap, vaddr, (size_t)nAvailableBytes, map_cb_read_data, &cursor, error
+  ) < 0)
+    return -1;
+  memset(buf + nAvailableBytes, 0, nBytes - nAvailableBytes);
+
+  return 0;
+}
+
+// -----------------------------------------------------------------------------
+
+typedef struct {
+  XcpVdiStream *stream;
+  ZeroClusters zeroClusters;
+
+  unsigned char *buf; // Data of several clusters.
+  size_t bufSize;
+} ZeroDetectionState;
+
+static int output_clusters_cb_detect_zeros (
+  uint64_t cluster, uint64_t count, OutputClusterType type, void *userData
+) {
+  if (type != OutputClusterAllocated)
+    return 0;
+
+  ZeroDetectionState *state = userData;
+  XcpVdiStream *stream = state->stream;
+  const QCow2StreamData *data = stream->streamData;
+  const uint32_t clusterBits = data->layout.header.clusterBits;
+  const uint64_t clusterSize = 1ULL << clusterBits;
+
+  while (count) {
+    const uint64_t n = XCP_MIN(count, (uint64_t)(state->bufSize >> clusterBits));
+    if (read_clusters(data, cluster, n, state->buf, &stream->errorString) < 0)
+      return -1;
+
+    for (uint64_t i = 0; i < n; ++i) {
+      if (!zero_scan_is_zero(state->buf + (i << clusterBits), clusterSize))
+        continue;
+      if (zero_clusters_add(&state->zeroClusters, cluster + i) < 0) {
+        xcp_vdi_stream_set_error_string(stream, "Failed to allocate zero cluster runs (%s)", strerror(errno));
+        return -1;
+      }
+    }
+
+    cluster += n;
+    count -= n;
+  }
+
+  return 0;
+}
+
+// Read the allocated clusters: the ones which contain only zeros are not allocated in the layout.
+static int detect_zero_clusters (XcpVdiStream *stream) {
+  QCow2StreamData *data = stream->streamData;
+  const StreamLayout *layout = &data->layout;
+
+  zero_clusters_destroy(&data->zeroClusters);
+  if (layout->header.version < 3) {
+    qcow2_debug_log("Zero detection is ignored: no zero clusters in QCOW2 v2 images.");
+    return 0;
+  }
+
+  ZeroDetectionState state = {
+    .stream = stream,
+    .zeroClusters = { 0 },
+    .bufSize = XCP_MAX((size_t)XCP_VDI_STREAM_CHUNK_SIZE, (size_t)layout->clusterSize)
+  };
+  if (!(state.buf = aligned_block_alloc(state.bufSize))) {
+    xcp_vdi_stream_set_error_string(stream, "Failed to allocate zero detection buffer (%s)", strerror(errno));
+    return -1;
+  }
+
+  const int ret = classify_clusters(stream, 0, layout->header.l1Size, output_clusters_cb_detect_zeros, &state);
+  free(state.buf);
+  if (ret < 0) {
+    zero_clusters_destroy(&state.zeroClusters);
+    return -1;
+  }
+
+  data->zeroClusters = state.zeroClusters;
+  qcow2_debug_log("Zero cluster runs: %zu.", data->zeroClusters.count);
+  return 0;
+}
+
+// -----------------------------------------------------------------------------
+
+// Window of compression jobs consumed in the cluster order: the pool compresses the next clusters
+// while the first ones are consumed. Without compression, the jobs read the clusters which contain
+// compressed clusters of the chain.
+typedef struct {
+  CompressionJob job;
+  uint64_t index;  // Index of the allocated cluster.
+  uint64_t offset; // Offset of the cluster in the generated image.
+  bool hasJob;     // No job is submitted for the clusters copied as they are.
+} CompressionSlot;
+
+typedef int (*CompressionSlotCb)(CompressionSlot *slot, void *userData);
+
+typedef struct {
+  CompressionPool *pool;
+
+  CompressionSlot *slots;
+  size_t slotCount;
+  size_t head;
+  size_t count; // Pushed slots not yet consumed.
+
+  CompressionSlotCb cb;
+  void *userData;
+  char **error;
+} CompressionPipeline;
+
+static void compression_pipeline_destroy (CompressionPipeline *pipeline) {
+  // The jobs in flight are dropped on error.
+  for (; pipeline->count; --pipeline->count) {
+    CompressionSlot *slot = &pipeline->slots[pipeline->head];
+    if (slot->hasJob)
+      compression_pool_cancel(pipeline->pool, &slot->job);
+    pipeline->head = (pipeline->head + 1) % pipeline->slotCount;
+  }
+
+  for (size_t i = 0; i < pipeline->slotCount; ++i)
+    free(pipeline->slots[i].job.output);
+  free(pipeline->slots);
+  pipeline->slots = NULL;
+}
+
+// If outputSize is 0, only the compressed sizes are computed.
+// The output buffers are aligned: the jobs which only read clusters can use O_DIRECT.
+static int compression_pipeline_init (
+  CompressionPipeline *pipeline,
+  CompressionPool *pool,
+  size_t outputSize,
+  size_t jobsPerWorker,
+  CompressionSlotCb cb,
+  void *userData,
+  char **error
+) {
+  const size_t workerCount = compression_pool_get_worker_count(pool);
+  size_t slotCount = workerCount * jobsPerWorker;
+  if (outputSize)
+    slotCount = XCP_MIN(slotCount, XCP_MAX(workerCount, COMPRESSION_PIPELINE_MAX_MEMORY / outputSize));
+
+  *pipeline = (CompressionPipeline){
+    .pool = pool,
+    .slotCount = slotCount,
+    .cb = cb,
+    .userData = userData,
+    .error = error
+  };
+
+  if (!(pipeline->slots = calloc(pipeline->slotCount, sizeof *pipeline->slots))) {
+    set_error(error, "Failed to allocate compression slots (%s)", strerror(errno));
+    return -1;
+  }
+
+  for (size_t i = 0; outputSize && i < pipeline->slotCount; ++i)
+    if (!(pipeline->slots[i].job.output = aligned_block_alloc(outputSize))) {
+      set_error(error, "Failed to allocate compression buffers (%s)", strerror(errno));
+      compression_pipeline_destroy(pipeline);
+      return -1;
+    }
+
+  return 0;
+}
+
+static int compression_pipeline_pop (CompressionPipeline *pipeline) {
+  CompressionSlot *slot = &pipeline->slots[pipeline->head];
+  pipeline->head = (pipeline->head + 1) % pipeline->slotCount;
+  --pipeline->count;
+
+  if (slot->hasJob && compression_pool_wait(pipeline->pool, &slot->job, pipeline->error) < 0)
+    return -1;
+  return (*pipeline->cb)(slot, pipeline->userData);
+}
+
+static int compression_pipeline_push (
+  CompressionPipeline *pipeline, uint64_t index, uint64_t cluster, uint64_t offset, bool hasJob
+) {
+  if (pipeline->count == pipeline->slotCount && compression_pipeline_pop(pipeline) < 0)
+    return -1;
+
+  CompressionSlot *slot = &pipeline->slots[(pipeline->head + pipeline->count++) % pipeline->slotCount];
+  slot->index = index;
+  slot->offset = offset;
+  slot->hasJob = hasJob;
+  slot->job.cluster = cluster;
+  if (hasJob)
+    compression_pool_submit(pipeline->pool, &slot->job);
+
+  return 0;
+}
+
+static int compression_pipeline_flush (CompressionPipeline *pipeline) {
+  while (pipeline->count)
+    if (compression_pipeline_pop(pipeline) < 0)
+      return -1;
+  return 0;
+}
+
+// -----------------------------------------------------------------------------
+
+static int compression_cb_read_cluster (uint64_t cluster, void *buf, void *userData, char **error) {
+  return read_clusters(userData, cluster, 1, buf, error);
+}
+
+typedef struct {
+  CompressionPipeline pipeline;
+  uint64_t nextIndex;
+} CompressedSizeState;
+
+static int compression_slot_cb_store_size (CompressionSlot *slot, void *userData) {
+  StreamLayout *layout = userData;
+  layout->compressedSizes[slot->index] = (uint32_t)slot->job.size;
+  return 0;
+}
+
+static int output_clusters_cb_compress (uint64_t cluster, uint64_t count, OutputClusterType type, void *userData) {
+  if (type != OutputClusterAllocated)
+    return 0;
+
+  CompressedSizeState *state = userData;
+  for (; count; ++cluster, --count)
+    if (compression_pipeline_push(&state->pipeline, state->nextIndex++, cluster, 0, true) < 0)
+      return -1;
+
+  return 0;
+}
+
+// Compress the allocated clusters to get their sizes. The data are dropped: the clusters are compressed again
+// when they are streamed, so any region of the generated image can still be produced alone.
+static int compute_compressed_sizes (XcpVdiStream *stream) {
+  QCow2StreamData *data = stream->streamData;
+  StreamLayout *layout = &data->layout;
+
+  free(layout->compressedSizes);
+  if (!(layout->compressedSizes = calloc(XCP_MAX(layout->dataClusterCount, 1ULL), sizeof *layout->compressedSizes))) {
+    xcp_vdi_stream_set_error_string(stream, "Failed to allocate compressed sizes (%s)", strerror(errno));
+    return -1;
+  }
+
+  CompressedSizeState state = { .nextIndex = 0 };
+  if (compression_pipeline_init(
+    &state.pipeline, data->compressionPool, 0, COMPRESSION_LAYOUT_JOBS_PER_WORKER,
+    compression_slot_cb_store_size, layout, &stream->errorString
+  ) < 0)
+    return -1;
+
+  int ret = classify_clusters(stream, 0, layout->header.l1Size, output_clusters_cb_compress, &state);
+  if (!ret)
+    ret = compression_pipeline_flush(&state.pipeline);
+  compression_pipeline_destroy(&state.pipeline);
+
+  assert(ret < 0 || state.nextIndex == layout->dataClusterCount);
+  return ret;
+}
+
+static inline uint64_t align_on_cluster (uint64_t offset, uint32_t clusterBits) {
+  const uint64_t mask = (1ULL << clusterBits) - 1;
+  return (offset + mask) & ~mask;
+}
+
+// Place an allocated cluster at the given offset of the data and return the end of its data.
+static uint64_t place_data_cluster (StreamLayout *layout, uint64_t index, uint64_t offset) {
+  const uint32_t clusterBits = layout->header.clusterBits;
+
+  uint32_t size = layout->compressedSizes[index];
+  if (size) {
+    // The sectors of a compressed cluster can be shared with its neighbors, the refcounts must not overflow.
+    const uint64_t first = offset >> clusterBits;
+    const uint64_t last = (offset + size - 1) >> clusterBits;
+    for (uint64_t i = first; i <= last && size; ++i)
+      if (layout->dataRefcounts[i] == UINT16_MAX)
+        size = 0;
+
+    if (size) {
+      for (uint64_t i = first; i <= last; ++i)
+        ++layout->dataRefcounts[i];
+      return offset + size;
+    }
+    layout->compressedSizes[index] = 0;
+  }
+
+  offset = align_on_cluster(offset, clusterBits);
+  layout->dataRefcounts[offset >> clusterBits] = 1;
+  return offset + (1ULL << clusterBits);
+}
+
+// Give the offset of the data of each L1 entry, relative to the data offset. Without compression,
+// the allocated clusters follow each other. Otherwise the compressed clusters are packed and the other ones
+// are aligned on a cluster.
+static int compute_data_layout (XcpVdiStream *stream) {
+  StreamLayout *layout = &((QCow2StreamData *)stream->streamData)->layout;
+  const uint32_t l1Size = layout->header.l1Size;
+  const uint32_t clusterBits = layout->header.clusterBits;
+
+  if (!layout->compressedSizes) {
+    for (uint32_t i = 0; i < l1Size; ++i)
+      layout->l1Entries[i].dataOffset = layout->l1Entries[i].dataClusterIndex << clusterBits;
+    layout->dataSize = layout->dataClusterCount << clusterBits;
+    return 0;
+  }
+
+  // A compressed cluster is smaller than a cluster, so the data do not use more clusters than without compression.
+  free(layout->dataRefcounts);
+  if (!(layout->dataRefcounts = calloc(XCP_MAX(layout->dataClusterCount, 1ULL), sizeof *layout->dataRefcounts))) {
+    xcp_vdi_stream_set_error_string(stream, "Failed to allocate data refcounts (%s)", strerror(errno));
+    return -1;
+  }
+
+  uint64_t offset = 0;
+  uint64_t index = 0;
+  for (uint32_t i = 0; i < l1Size; ++i) {
+    layout->l1Entries[i].dataOffset = offset;
+
+    const uint64_t endIndex = i + 1 < l1Size ? layout->l1Entries[i + 1].dataClusterIndex : layout->dataClusterCount;
+    for (; index < endIndex; ++index)
+      offset = place_data_cluster(layout, index, offset);
+  }
+  layout->dataSize = offset;
+
+  return 0;
+}
+
+typedef struct {
+  XcpVdiStream *stream;
+  uint16_t *refcounts;
+  uint64_t count;
+  uint64_t capacity;
+} HostRefcounts;
+
+static int host_cluster_cb_store_refcount (uint64_t index, const HostCluster *host, void *userData) {
+  XCP_UNUSED(index);
+
+  HostRefcounts *refcounts = userData;
+  if (refcounts->count == refcounts->capacity) {
+    const uint64_t capacity = XCP_MAX(refcounts->capacity * 2, 64ULL);
+    uint16_t *values = realloc(refcounts->refcounts, (size_t)capacity * sizeof *values);
+    if (!values) {
+      xcp_vdi_stream_set_error_string(refcounts->stream, "Failed to allocate host cluster refcounts (%s)", strerror(errno));
+      return -1;
+    }
+    refcounts->refcounts = values;
+    refcounts->capacity = capacity;
+  }
+
+  refcounts->refcounts[refcounts->count++] = host->userCount;
+  return 0;
+}
+
+// With extended L2 entries, the data of a L1 entry is made of its host clusters instead of its allocated clusters.
+// The refcount of a host cluster is its number of users.
+static int compute_subcluster_layout (XcpVdiStream *stream) {
+  StreamLayout *layout = &((QCow2StreamData *)stream->streamData)->layout;
+
+  HostRefcounts refcounts = { .stream = stream, .refcounts = NULL, .count = 0, .capacity = 0 };
+  SubclusterPacker packer = {
+    .stream = stream,
+    .hostCb = host_cluster_cb_store_refcount,
+    .clusterCb = NULL,
+    .userData = &refcounts
+  };
+  for (uint32_t i = 0; i < layout->header.l1Size; ++i) {
+    L1EntryLayout *entry = &layout->l1Entries[i];
+    if (!entry->dataClusterIndex)
+      continue;
+
+    if (pack_subclusters(&packer, i) < 0) {
+      free(refcounts.refcounts);
+      return -1;
+    }
+    entry->dataClusterIndex = packer.hostCount;
+  }
+
+  free(layout->dataRefcounts);
+  layout->dataRefcounts = refcounts.refcounts;
+  return 0;
+}
+
+// -----------------------------------------------------------------------------
+
+static int qcow2_stream_init_header (XcpVdiStream *stream, QCow2Header *header);
+
+// Each cluster of the generated image is used once, except the data clusters shared by compressed clusters.
+// The refcount blocks are written after the refcount table but their count depends on the cluster count of the image,
+// so the sizes are increased until they cover all the clusters, including their own ones.
+static void compute_refcount_layout (StreamLayout *layout) {
+  QCow2Header *header = &layout->header;
+  const uint32_t clusterBits = header->clusterBits;
+
+  const uint64_t otherClusterCount = 1 + qcow2_cluster_count_from_l1_size(header->l1Size, clusterBits) +
+    layout->l2TableCount + XCP_DIV_ROUND_UP(layout->dataSize, 1ULL << clusterBits);
+  const uint32_t refcountBlockBits = clusterBits + 3 - header->refcountOrder;
+  const uint32_t refcountTableBits = clusterBits - 3;
+
+  uint64_t tableClusterCount = 1;
+  uint64_t blockCount = 0;
+  for (;;) {
+    const uint64_t clusterCount = otherClusterCount + tableClusterCount + blockCount;
+    const uint64_t newBlockCount = XCP_DIV_ROUND_UP(clusterCount, 1ULL << refcountBlockBits);
+    const uint64_t newTableClusterCount = XCP_MAX(XCP_DIV_ROUND_UP(newBlockCount, 1ULL << refcountTableBits), 1ULL);
+    if (newBlockCount == blockCount && newTableClusterCount == tableClusterCount)
+      break;
+    blockCount = newBlockCount;
+    tableClusterCount = newTableClusterCount;
+  }
+
+  header->refcountTableOffset = 1ULL << clusterBits;
+  header->refcountTableClusters = (uint32_t)tableClusterCount;
+  layout->refcountBlockCount = (uint32_t)blockCount;
+  layout->refcountBlocksOffset = header->refcountTableOffset + (tableClusterCount << clusterBits);
+  header->l1TableOffset = layout->refcountBlocksOffset + (blockCount << clusterBits);
+}
+
+static int compute_layout_unlocked (XcpVdiStream *stream) {
+  QCow2StreamData *data = stream->streamData;
+  StreamLayout *layout = &data->layout;
+
+  QCow2Header *header = &layout->header;
+  if (qcow2_stream_init_header(stream, header) < 0)
+    return -1;
+
+  layout->clusterSize = 1u << header->clusterBits;
+  layout->l2Bits = get_l2_bits(data, header->clusterBits);
+  layout->l2Size = 1u << layout->l2Bits;
+
+  free(layout->l1Entries);
+  if (!(layout->l1Entries = malloc(XCP_MAX(header->l1Size, 1u) * sizeof *layout->l1Entries))) {
+    xcp_vdi_stream_set_error_string(stream, "Failed to allocate L1 entries layout (%s)", strerror(errno));
+    return -1;
+  }
+  for (uint32_t i = 0; i < header->l1Size; ++i)
+    layout->l1Entries[i] = (L1EntryLayout){ .dataClusterIndex = 0, .dataOffset = 0, .l2TableIndex = NO_L2_TABLE };
+
+  qcow2_debug_log("Computing layout of `%s` (base=`%s`).", data->chain.image.filename, stream->base);
+
+  // The chain is walked only once. The map has the memory budget of the L2 cache: on a fragmented disk,
+  // the runs past it are looked up in the L2 tables at each phase.
+  qcow2_extent_map_destroy(&data->extentMap);
+  if (qcow2_extent_map_build(&data->extentMap, &data->chain, stream->cacheSize, &stream->errorString) < 0)
+    return -1;
+  qcow2_debug_log(
+    "Extent count: %zu (%" PRIu64 "B of %" PRIu64 "B).", data->extentMap.count, data->extentMap.size,
+    data->chain.image.nbSectors << N_BITS_PER_SECTOR
+  );
+
+  if (data->zeroDetection && detect_zero_clusters(stream) < 0)
+    return -1;
+
+  layout->l2TableCount = 0;
+  layout->dataClusterCount = 0;
+  layout->zeroClusterCount = 0;
+  if (classify_clusters(stream, 0, header->l1Size, output_clusters_cb_compute_layout, layout) < 0)
+    return -1;
+  if (data->extendedL2 && compute_subcluster_layout(stream) < 0)
+    return -1;
+
+  for (uint32_t i = 0; i < header->l1Size; ++i) {
+    L1EntryLayout *entry = &layout->l1Entries[i];
+    if (entry->l2TableIndex != NO_L2_TABLE)
+      entry->l2TableIndex = layout->l2TableCount++;
+
+    const uint64_t count = entry->dataClusterIndex;
+    entry->dataClusterIndex = layout->dataClusterCount;
+    layout->dataClusterCount += count;
+  }
+
+  // Workers of the compression, or of the decompression of the compressed clusters of the chain.
+  if (
+    !data->compressionPool &&
+    (data->compression != XCP_VDI_STREAM_COMPRESSION_NONE || data->extentMap.compressedCount) &&
+    !(data->compressionPool = compression_pool_create(
+      data->compression, data->compressionWorkerCount, layout->clusterSize,
+      COMPRESSED_CLUSTER_MAX_SIZE(layout->clusterSize), compression_cb_read_cluster, data, &stream->errorString
+    ))
+  )
+    return -1;
+
+  if (data->compression != XCP_VDI_STREAM_COMPRESSION_NONE && compute_compressed_sizes(stream) < 0)
+    return -1;
+  if (compute_data_layout(stream) < 0)
+    return -1;
+
+  compute_refcount_layout(layout);
+
+  layout->l2TablesOffset =
+    header->l1TableOffset + ((uint64_t)qcow2_cluster_count_from_l1_size(header->l1Size, header->clusterBits) << header->clusterBits);
+  layout->dataOffset = layout->l2TablesOffset + ((uint64_t)layout->l2TableCount << header->clusterBits);
+  layout->endOffset = layout->dataOffset + align_on_cluster(layout->dataSize, header->clusterBits);
+
+  for (uint32_t i = 0; i < header->l1Size; ++i)
+    layout->l1Entries[i].dataOffset += layout->dataOffset;
+
+  qcow2_debug_log("Cluster bits: %" PRIu32 ".", header->clusterBits);
+  qcow2_debug_log("Refcount table clusters: %" PRIu32 ".", header->refcountTableClusters);
+  qcow2_debug_log("Refcount block count: %" PRIu32 ".", layout->refcountBlockCount);
+  qcow2_debug_log("L1 size: %" PRIu32 ".", header->l1Size);
+  qcow2_debug_log("L1 table offset: %#" PRIx64 ".", header->l1TableOffset);
+  qcow2_debug_log("L2 tables offset: %#" PRIx64 ".", layout->l2TablesOffset);
+  qcow2_debug_log("L2 table count: %" PRIu32 ".", layout->l2TableCount);
+  qcow2_debug_log("Data offset: %#" PRIx64 ".", layout->dataOffset);
+  qcow2_debug_log("Data cluster count: %" PRIu64 ".", layout->dataClusterCount);
+  qcow2_debug_log("Data size: %" PRIu64 ".", layout->dataSize);
+  qcow2_debug_log("Zero cluster count: %" PRIu64 ".", layout->zeroClusterCount);
+
+  data->hasLayout = true;
+  return 0;
+}
+
+static int compute_layout (XcpVdiStream *stream) {
+  QCow2StreamData *data = stream->streamData;
+
+  pthread_mutex_lock(&data->layoutMutex);
+  const int ret = data->hasLayout ? 0 : compute_layout_unlocked(stream);
+  pthread_mutex_unlock(&data->layoutMutex);
+
+  return ret;
+}
+
+// -----------------------------------------------------------------------------
+
+// Jump over a region if it is entirely before the start offset.
+static bool skip_region (XcpVdiStream *stream, uint64_t size) {
+  if (xcp_vdi_stream_get_skip_size(stream) < size)
+    return false;
+
+  xcp_vdi_stream_co_skip(stream, size);
+  return true;
+}
+
+static int write_header (XcpVdiStream *stream) {
+  const QCow2StreamData *data = stream->streamData;
+  const StreamLayout *layout = &data->layout;
+  const QCow2Header *header = &layout->header;
+
+  {
+    QCow2Header copy = *header;
+    qcow2_header_to_be(&copy);
+    if (xcp_vdi_stream_co_write(stream, &copy, sizeof copy) < 0)
+      return -1;
+  }
+
+  // Compression type field, see qcow2_stream_init_header.
+  if (header->headerLength > sizeof *header) {
+    const uint8_t compressionType[QCOW2_COMPRESSION_TYPE_FIELD_LENGTH] = {
+      data->compression == XCP_VDI_STREAM_COMPRESSION_ZSTD ? QCOW2_COMPRESSION_TYPE_ZSTD : QCOW2_COMPRESSION_TYPE_DEFLATE
+    };
+    if (xcp_vdi_stream_co_write(stream, compressionType, sizeof compressionType) < 0)
+      return -1;
+  }
+
+  // TODO: Write extensions in the future + other data after header.
+
+  // Write backing filename.
+  if (stream->base) {
+    if (
+      xcp_vdi_stream_co_write_zeros(stream, header->backingFileOffset - header->headerLength) < 0 ||
+      xcp_vdi_stream_co_write(stream, stream->base, header->backingFileSize) < 0
+    )
+      return -1;
+  } else if (xcp_vdi_stream_co_write_zeros(stream, QCOW2_END_OF_HEADER_EXTENSION_LENGTH) < 0)
+    return -1;
+
+  // Write bytes padding.
+  const size_t offset = header->headerLength + QCOW2_END_OF_HEADER_EXTENSION_LENGTH + header->backingFileSize;
+  return xcp_vdi_stream_co_write_zeros(stream, layout->clusterSize - offset);
+}
+
+static int write_refcount_table (XcpVdiStream *stream) {
+  const StreamLayout *layout = &((QCow2StreamData *)stream->streamData)->layout;
+  const QCow2Header *header = &layout->header;
+
+  EntryWriter writer = { .stream = stream, .count = 0 };
+  for (uint32_t i = 0; i < layout->refcountBlockCount; ++i)
+    if (entry_writer_push(&writer, layout->refcountBlocksOffset + ((uint64_t)i << header->clusterBits)) < 0)
+      return -1;
+  if (entry_writer_flush(&writer) < 0)
+    return -1;
+
+  return xcp_vdi_stream_co_write_zeros(
+    stream, layout->refcountBlocksOffset - (header->refcountTableOffset + layout->refcountBlockCount * sizeof(uint64_t))
+  );
+}
+
+// Fill a buffer with refcounts equal to 1.
+static void init_refcount_pattern (uint8_t *pattern, uint32_t refcountOrder) {
+  if (refcountOrder < 3) {
+    // Several refcounts per byte, the first one uses the least significant bits.
+    uint8_t byte = 0;
+    for (uint32_t bit = 0; bit < 8; bit += 1u << refcountOrder)
+      byte |= (uint8_t)(1u << bit);
+    memset(pattern, byte, REFCOUNT_PATTERN_SIZE);
+    return;
+  }
+
+  // Big endian refcounts.
+  const uint32_t refcountSize = 1u << (refcountOrder - 3);
+  memset(pattern, 0, REFCOUNT_PATTERN_SIZE);
+  for (uint32_t i = refcountSize - 1; i < REFCOUNT_PATTERN_SIZE; i += refcountSize)
+    pattern[i] = 1;
+}
+
+// With compression, the refcounts of the data clusters are given by the layout.
+// The refcount order is at least 4 (see qcow2_stream_init_header): the refcounts are big endian integers.
+static int write_data_refcount_blocks (XcpVdiStream *stream) {
+  const StreamLayout *layout = &((QCow2StreamData *)stream->streamData)->layout;
+  const QCow2Header *header = &layout->header;
+  assert(header->refcountOrder >= 4);
+
+  const uint32_t refcountSize = 1u << (header->refcountOrder - 3);
+  const uint32_t refcountBlockBits = header->clusterBits + 3 - header->refcountOrder;
+  const uint64_t dataCluster = layout->dataOffset >> header->clusterBits;
+  const uint64_t clusterCount = layout->endOffset >> header->clusterBits;
+
+  uint8_t refcounts[REFCOUNT_PATTERN_SIZE];
+  for (uint32_t i = 0; i < layout->refcountBlockCount; ++i) {
+    if (skip_region(stream, layout->clusterSize))
+      continue;
+
+    size_t size = 0;
+    const uint64_t firstCluster = (uint64_t)i << refcountBlockBits;
+    for (uint64_t cluster = firstCluster; cluster < firstCluster + (1ULL << refcountBlockBits); ++cluster) {
+      uint16_t refcount = 0;
+      if (cluster < dataCluster)
+        refcount = 1;
+      else if (cluster < clusterCount)
+        refcount = layout->dataRefcounts[cluster - dataCluster];
+
+      memset(refcounts + size, 0, refcountSize - 2);
+      refcounts[size + refcountSize - 2] = (uint8_t)(refcount >> 8);
+      refcounts[size + refcountSize - 1] = (uint8_t)refcount;
+      size += refcountSize;
+
+      if (size == sizeof refcounts) {
+        if (xcp_vdi_stream_co_write(stream, refcounts, size) < 0)
+          return -1;
+        size = 0;
+      }
+    }
+
+    if (size && xcp_vdi_stream_co_write(stream, refcounts, size) < 0)
+      return -1;
+  }
+
+  return 0;
+}
+
+static int write_refcount_blocks (XcpVdiStream *stream) {
+  const StreamLayout *layout = &((QCow2StreamData *)stream->streamData)->layout;
+  const QCow2Header *header = &layout->header;
+
+  if (layout->dataRefcounts)
+    return write_data_refcount_blocks(stream);
+
+  uint8_t pattern[REFCOUNT_PATTERN_SIZE];
+  init_refcount_pattern(pattern, header->refcountOrder);
+
+  const uint32_t refcountBlockBits = header->clusterBits + 3 - header->refcountOrder;
+  const uint64_t clusterCount = layout->endOffset >> header->clusterBits;
+  for (uint32_t i = 0; i < layout->refcountBlockCount; ++i) {
+    if (skip_region(stream, layout->clusterSize))
+      continue;
+
+    const uint64_t refcountCount = XCP_MIN(clusterCount - ((uint64_t)i << refcountBlockBits), 1ULL << refcountBlockBits);
+    const uint64_t bitCount = refcountCount << header->refcountOrder;
+
+    size_t size = 0;
+    while (size < bitCount >> 3) {
+      const size_t count = XCP_MIN(REFCOUNT_PATTERN_SIZE, (bitCount >> 3) - size);
+      if (xcp_vdi_stream_co_write(stream, pattern, count) < 0)
+        return -1;
+      size += count;
+    }
+
+    // Last refcounts of a byte shared with unused entries.
+    if (bitCount & 7) {
+      const uint8_t byte = pattern[0] & (uint8_t)((1u << (bitCount & 7)) - 1);
+      if (xcp_vdi_stream_co_write(stream, &byte, 1) < 0)
+        return -1;
+      ++size;
+    }
+
+    if (xcp_vdi_stream_co_write_zeros(stream, layout->clusterSize - size) < 0)
+      return -1;
+  }
+
+  return 0;
+}
+
+static int write_l1_table (XcpVdiStream *stream) {
+  const StreamLayout *layout = &((QCow2StreamData *)stream->streamData)->layout;
+  const QCow2Header *header = &layout->header;
+
+  EntryWriter writer = { .stream = stream, .count = 0 };
+  for (uint32_t i = 0; i < header->l1Size; ++i) {
+    const uint32_t l2TableIndex = layout->l1Entries[i].l2TableIndex;
+    uint64_t l1Entry = QCOW2_L1_ENTRY_FLAG_COPIED;
+    if (l2TableIndex != NO_L2_TABLE)
+      l1Entry |= layout->l2TablesOffset + ((uint64_t)l2TableIndex << header->clusterBits);
+    if (entry_writer_push(&writer, l1Entry) < 0)
+      return -1;
+  }
+  if (entry_writer_flush(&writer) < 0)
+    return -1;
+
+  return xcp_vdi_stream_co_write_zeros(
+    stream, layout->l2TablesOffset - (header->l1TableOffset + header->l1Size * sizeof(uint64_t))
+  );
+}
+
+// -----------------------------------------------------------------------------
+
+typedef struct {
+  EntryWriter writer;
+
+  uint32_t clusterBits;
+  uint64_t dataOffset; // Offset of the data of the next allocated cluster.
+  uint64_t dataIndex;  // Index of the next allocated cluster.
+  uint32_t entryCount;
+
+  const uint32_t *compressedSizes; // NULL without compression.
+} L2TableWriteState;
+
+static int output_clusters_cb_write_l2_entries (
+  uint64_t cluster, uint64_t count, OutputClusterType type, void *userData
+) {
+  L2TableWriteState *state = userData;
+
+  qcow2_debug_log(
+    "Write L2 entries of type %d for cluster at %#0*" PRIx64 ": %" PRIu64 "B (%" PRIu64 " clusters).",
+    type, HEX_LENGTH(state->dataOffset), type == OutputClusterAllocated ? state->dataOffset : 0,
+    count << state->clusterBits, count
+  );
+  XCP_UNUSED(cluster);
+
+  state->entryCount += (uint32_t)count;
+
+  // Write Allocated L2 table entry.
+  if (type == OutputClusterAllocated) {
+    for (; count; --count) {
+      const uint32_t size = state->compressedSizes ? state->compressedSizes[state->dataIndex] : 0;
+      ++state->dataIndex;
+
+      // A compressed cluster is shared with its neighbors: the COPIED flag must not be set.
+      uint64_t l2Entry;
+      if (size) {
+        const uint64_t sectorCount = ((state->dataOffset + size - 1) >> N_BITS_PER_SECTOR) -
+          (state->dataOffset >> N_BITS_PER_SECTOR);
+        l2Entry = QCOW2_L2_ENTRY_FLAG_COMPRESSED |
+          (sectorCount << QCOW2_COMPRESSED_OFFSET_BITS(state->clusterBits)) | state->dataOffset;
+        state->dataOffset += size;
+      } else {
+        state->dataOffset = align_on_cluster(state->dataOffset, state->clusterBits);
+        l2Entry = state->dataOffset | QCOW2_L2_ENTRY_FLAG_COPIED;
+        state->dataOffset += 1ULL << state->clusterBits;
+      }
+
+      if (entry_writer_push(&state->writer, l2Entry) < 0)
+        return -1;
+    }
+    return 0;
+  }
+
+  // Write Unallocated or Zeroed L2 table entry.
+  uint64_t l2Entry = QCOW2_L2_ENTRY_FLAG_COPIED;
+  if (type == OutputClusterZero)
+    l2Entry |= QCOW2_L2_ENTRY_FLAG_ZERO;
+  for (; count; --count)
+    if (entry_writer_push(&state->writer, l2Entry) < 0)
+      return -1;
+
+  return 0;
+}
+
 typedef struct {
-  XcpVdiStream *stream;
+  EntryWriter writer;
 
-  uint64_t currentL2TableOffset;
-  uint32_t currentL1Index;
-} L1TableWriteState;
+  const StreamLayout *layout;
+  const L1EntryLayout *entry;
+  uint32_t entryCount;
+} ExtendedL2TableWriteState;
 
-static int clusters_cb_write_l1_table (
-  uint64_t sector,
-  uint64_t nAvailableBytes,
-  uint32_t typeMask,
-  const QCow2Image *image,
-  uint64_t clustersOffset,
-  void *userData,
-  char **error
-) {
-  XCP_UNUSED(clustersOffset);
-  XCP_UNUSED(error);
-  XCP_UNUSED(image);
+static int packed_cluster_cb_write_l2_entry (uint64_t cluster, uint64_t bitmap, uint64_t hostIndex, void *userData) {
+  XCP_UNUSED(cluster);
 
-  L1TableWriteState *state = userData;
-  XcpVdiStream *stream = state->stream;
+  ExtendedL2TableWriteState *state = userData;
+  const StreamLayout *layout = state->layout;
 
-  const uint64_t startVaddr = sector << N_BITS_PER_SECTOR;
+  // A shared host cluster must not have the COPIED flag.
+  uint64_t l2Entry = QCOW2_L2_ENTRY_FLAG_COPIED;
+  if (hostIndex != NO_HOST_CLUSTER) {
+    l2Entry = state->entry->dataOffset + (hostIndex << layout->header.clusterBits);
+    if (layout->dataRefcounts[state->entry->dataClusterIndex + hostIndex] == 1)
+      l2Entry |= QCOW2_L2_ENTRY_FLAG_COPIED;
+  }
 
-  qcow2_debug_log(
-    "Src at vaddr %#0*" PRIx64 ": %zuB of %s at offset %#0*" PRIx64 " in %s.", HEX_LENGTH(startVaddr),
-    startVaddr, nAvailableBytes, qcow2_cluster_type_mask_to_string(typeMask), HEX_LENGTH(clustersOffset),
-    clustersOffset, image->filename
-  );
+  ++state->entryCount;
+  if (entry_writer_push(&state->writer, l2Entry) < 0)
+    return -1;
+  return entry_writer_push(&state->writer, bitmap);
+}
 
-  // Compute the current l1 index using the first opened image
-  // (because cluster bits can be lower/greater in the cb image param).
-  const QCow2Image *rootImage = &((QCow2Chain *)stream->streamData)->image;
+// The clusters of the L1 entry are packed again to give the host cluster of each entry.
+static int write_extended_l2_table (XcpVdiStream *stream, uint32_t l1Index) {
+  const StreamLayout *layout = &((QCow2StreamData *)stream->streamData)->layout;
+
+  ExtendedL2TableWriteState state = {
+    .writer = { .stream = stream, .count = 0 },
+    .layout = layout,
+    .entry = &layout->l1Entries[l1Index],
+    .entryCount = 0
+  };
+  SubclusterPacker packer = {
+    .stream = stream,
+    .hostCb = NULL,
+    .clusterCb = packed_cluster_cb_write_l2_entry,
+    .userData = &state
+  };
+  if (pack_subclusters(&packer, l1Index) < 0)
+    return -1;
 
-  const uint64_t endVaddr = startVaddr + nAvailableBytes;
-  uint64_t lastL1Index;
-  if (typeMask & (ClusterTypeAllocated | ClusterTypeZero))
-    lastL1Index = qcow2_image_vaddr_to_l1_index(
-      rootImage,
-      XCP_ROUND_UP(endVaddr, 1ULL << (rootImage->header.clusterBits + rootImage->l2Bits))
-    );
-  else
-    lastL1Index = qcow2_image_vaddr_to_l1_index(rootImage, endVaddr);
-  assert(lastL1Index <= rootImage->header.l1Size);
-
-  assert(state->currentL1Index <= lastL1Index + 1);
-  if (state->currentL1Index >= lastL1Index)
-    return 0; // Nothing to do: Entry already written.
-
-  if (typeMask & (ClusterTypeAllocated | ClusterTypeZero)) {
-    qcow2_debug_log(
-      "Write allocated L1 entrie(s) for L2 table at %#0*" PRIx64 " (count=%" PRIu64 ").",
-      HEX_LENGTH(state->currentL2TableOffset), state->currentL2TableOffset, lastL1Index - state->currentL1Index
-    );
+  // Write unused entries of the last table.
+  for (; state.entryCount < layout->l2Size; ++state.entryCount)
+    if (
+      entry_writer_push(&state.writer, QCOW2_L2_ENTRY_FLAG_COPIED) < 0 ||
+      entry_writer_push(&state.writer, 0) < 0
+    )
+      return -1;
 
-    for (; state->currentL1Index < lastL1Index; ++state->currentL1Index) {
-      const uint64_t l1Entry = xcp_to_be_u64(state->currentL2TableOffset | QCOW2_L1_ENTRY_FLAG_COPIED);
-      if (xcp_vdi_stream_co_write(stream, &l1Entry, sizeof l1Entry) < 0)
-        return -1;
+  return entry_writer_flush(&state.writer);
+}
+
+static int write_l2_tables (XcpVdiStream *stream) {
+  const QCow2StreamData *data = stream->streamData;
+  const StreamLayout *layout = &data->layout;
+
+  for (uint32_t i = 0; i < layout->header.l1Size; ++i) {
+    const L1EntryLayout *entry = &layout->l1Entries[i];
+    if (entry->l2TableIndex == NO_L2_TABLE || skip_region(stream, layout->clusterSize))
+      continue;
 
-      // Create a new L2 table (i.e. a new allocated L1 entry).
-      state->currentL2TableOffset += rootImage->clusterSize;
+    if (data->extendedL2) {
+      if (write_extended_l2_table(stream, i) < 0)
+        return -1;
+      continue;
     }
-  } else {
-    const uint64_t l1Entry = xcp_to_be_u64(QCOW2_L1_ENTRY_FLAG_COPIED);
-    for (; state->currentL1Index < lastL1Index; ++state->currentL1Index)
-      if (xcp_vdi_stream_co_write(stream, &l1Entry, sizeof l1Entry) < 0)
+
+    L2TableWriteState state = {
+      .writer = { .stream = stream, .count = 0 },
+      .clusterBits = layout->header.clusterBits,
+      .dataOffset = entry->dataOffset,
+      .dataIndex = entry->dataClusterIndex,
+      .entryCount = 0,
+      .compressedSizes = layout->compressedSizes
+    };
+    if (classify_clusters(stream, i, i + 1, output_clusters_cb_write_l2_entries, &state) < 0)
+      return -1;
+
+    // Write unused entries of the last table.
+    for (; state.entryCount < layout->l2Size; ++state.entryCount)
+      if (entry_writer_push(&state.writer, QCOW2_L2_ENTRY_FLAG_COPIED) < 0)
         return -1;
+
+    if (entry_writer_flush(&state.writer) < 0)
+      return -1;
   }
 
   return 0;
@@ -113,123 +1517,291 @@ static int clusters_cb_write_l1_table (
 
 // -----------------------------------------------------------------------------
 
+// A hint given to the kernel for a file range. Contiguous ranges are merged in one call.
+typedef struct {
+  int fd;
+  uint64_t offset;
+  uint64_t size;
+  int advice;
+} FileHint;
+
+static void file_hint_flush (FileHint *hint) {
+  if (hint->size)
+    posix_fadvise(hint->fd, (off_t)hint->offset, (off_t)hint->size, hint->advice);
+  hint->size = 0;
+}
+
+static void file_hint_push (FileHint *hint, int fd, uint64_t offset, uint64_t size) {
+  if (hint->size && (hint->fd != fd || hint->offset + hint->size != offset))
+    file_hint_flush(hint);
+
+  if (!hint->size) {
+    hint->fd = fd;
+    hint->offset = offset;
+  }
+  hint->size += size;
+}
+
+// Give the data of the next allocated clusters to the kernel (WILLNEED) and drop the streamed data
+// of the page cache (DONTNEED). The prefetch window follows the rate of the consumer.
 typedef struct {
   XcpVdiStream *stream;
 
-  uint64_t dataOffset; // Offset to write data referenced by L2 tables entries.
+  uint64_t nextCluster;  // First cluster not yet hinted.
+  uint64_t endCluster;
+  uint64_t hintedBytes;  // Allocated bytes given to the kernel.
+  uint64_t writtenBytes; // Allocated bytes written in the stream.
+  uint64_t window;       // Allocated bytes to hint ahead of the written ones.
+
+  uint64_t rateBytes;        // Written bytes at the last window update.
+  struct timespec rateTime;
+
+  FileHint willNeed;
+} Prefetcher;
+
+static void prefetcher_init (Prefetcher *prefetcher, XcpVdiStream *stream) {
+  const StreamLayout *layout = &((QCow2StreamData *)stream->streamData)->layout;
+
+  *prefetcher = (Prefetcher){
+    .stream = stream,
+    .nextCluster = 0,
+    .endCluster = (uint64_t)layout->header.l1Size << layout->l2Bits,
+    .window = PREFETCH_MIN_WINDOW,
+    .willNeed = { .advice = POSIX_FADV_WILLNEED }
+  };
+  clock_gettime(CLOCK_MONOTONIC, &prefetcher->rateTime);
+}
+
+static void prefetcher_finish (Prefetcher *prefetcher) {
+  file_hint_flush(&prefetcher->willNeed);
+}
+
+// Use the bytes consumed during the last period to size the window.
+static void prefetcher_update_window (Prefetcher *prefetcher) {
+  const uint64_t bytes = prefetcher->writtenBytes - prefetcher->rateBytes;
+  if (bytes < XCP_VDI_STREAM_CHUNK_SIZE)
+    return;
+
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  const int64_t elapsedUs = (now.tv_sec - prefetcher->rateTime.tv_sec) * 1000000 +
+    (now.tv_nsec - prefetcher->rateTime.tv_nsec) / 1000;
+  if (elapsedUs <= 0)
+    return;
+
+  const uint64_t window = bytes * PREFETCH_HORIZON_US / (uint64_t)elapsedUs;
+  prefetcher->window = XCP_MIN(XCP_MAX(window, (uint64_t)PREFETCH_MIN_WINDOW), (uint64_t)PREFETCH_MAX_WINDOW);
+  prefetcher->rateBytes = prefetcher->writtenBytes;
+  prefetcher->rateTime = now;
+}
 
-  size_t accSectorCount;
-  ClusterType accType;
+static int map_cb_prefetch (
+  const QCow2Image *image,
+  uint64_t offset,
+  size_t nBytes,
+  const QCow2CompressedRange *compressed,
+  void *userData,
+  char **error
+) {
+  XCP_UNUSED(error);
 
-  uint32_t currentL1Index;
-  bool currentL1EntryWritten;
-} L2TablesWriteState;
+  if (compressed)
+    nBytes = qcow2_compressed_size(compressed->descriptor, image->header.clusterBits);
+  if (image)
+    file_hint_push(&((Prefetcher *)userData)->willNeed, image->fd, offset, nBytes);
+  return 0;
+}
 
-static int write_l2_entries (XcpVdiStream *stream, uint64_t *dataOffset, uint32_t typeMask, size_t clusterCount) {
-  if (!clusterCount)
+static int output_clusters_cb_prefetch (uint64_t cluster, uint64_t count, OutputClusterType type, void *userData) {
+  if (type != OutputClusterAllocated)
     return 0;
 
-  const QCow2Image *image = &((QCow2Chain *)stream->streamData)->image;
+  Prefetcher *prefetcher = userData;
+  XcpVdiStream *stream = prefetcher->stream;
+  const QCow2StreamData *data = stream->streamData;
+  const QCow2Image *image = &data->chain.image;
+  const uint32_t clusterBits = data->layout.header.clusterBits;
 
-  qcow2_debug_log(
-    "Write L2 entries of %s for cluster at %#0*" PRIx64 ": %zuB (%zu clusters).",
-    qcow2_cluster_type_mask_to_string(typeMask), HEX_LENGTH(*dataOffset),
-    typeMask & (ClusterTypeUnallocated | ClusterTypeZero) ? 0 : *dataOffset,
-    clusterCount << image->header.clusterBits, clusterCount
+  const uint64_t vaddr = cluster << clusterBits;
+  const uint64_t nBytes = count << clusterBits;
+  const uint64_t nAvailableBytes = XCP_MIN(nBytes, (image->nbSectors << N_BITS_PER_SECTOR) - vaddr);
+
+  prefetcher->hintedBytes += nBytes;
+  return qcow2_extent_map_map(
+    &data->extentMap, vaddr, (size_t)nAvailableBytes, map_cb_prefetch, prefetcher, &stream->errorString
   );
+}
 
-  // Write Unallocated or Zeroed L2 table entry.
-  if (typeMask & (ClusterTypeUnallocated | ClusterTypeZero)) {
-    uint64_t l2Entry = QCOW2_L2_ENTRY_FLAG_COPIED;
-    if (typeMask & ClusterTypeZero)
-      l2Entry |= QCOW2_L2_ENTRY_FLAG_ZERO;
-    xcp_to_be_u64_p(&l2Entry);
-
-    for (size_t i = 0; i < clusterCount; ++i)
-      if (xcp_vdi_stream_co_write(stream, &l2Entry, sizeof l2Entry) < 0)
-        return -1;
+// Called before the write of allocated clusters: hint the next ones until the window is filled.
+static int prefetcher_advance (Prefetcher *prefetcher, uint64_t cluster, uint64_t count) {
+  const uint32_t clusterBits = ((QCow2StreamData *)prefetcher->stream->streamData)->layout.header.clusterBits;
 
-    return 0;
+  // The first written clusters can be after the start (see xcp_vdi_stream_seek).
+  if (prefetcher->nextCluster < cluster) {
+    prefetcher->nextCluster = cluster;
+    prefetcher->hintedBytes = prefetcher->writtenBytes;
   }
-
-  // Write Allocated L2 table entry.
-  const uint64_t clusterSize = image->clusterSize;
-  for (size_t i = 0; i < clusterCount; ++i) {
-    const uint64_t l2Entry = xcp_to_be_u64(*dataOffset | QCOW2_L2_ENTRY_FLAG_COPIED);
-    if (xcp_vdi_stream_co_write(stream, &l2Entry, sizeof l2Entry) < 0)
+  prefetcher->writtenBytes += count << clusterBits;
+  prefetcher_update_window(prefetcher);
+
+  const uint64_t target = prefetcher->writtenBytes + prefetcher->window;
+  const uint64_t step = XCP_MAX(prefetcher->window >> clusterBits, (uint64_t)1);
+  while (prefetcher->hintedBytes < target && prefetcher->nextCluster < prefetcher->endCluster) {
+    const uint64_t endCluster = XCP_MIN(prefetcher->nextCluster + step, prefetcher->endCluster);
+    if (classify_cluster_range(
+      prefetcher->stream, prefetcher->nextCluster, endCluster, output_clusters_cb_prefetch, prefetcher
+    ) < 0)
       return -1;
-    *dataOffset += clusterSize;
+    prefetcher->nextCluster = endCluster;
   }
+  file_hint_flush(&prefetcher->willNeed);
 
   return 0;
 }
 
-static int clusters_cb_write_l2_tables (
-  uint64_t sector,
-  uint64_t nAvailableBytes,
-  uint32_t typeMask,
+// Called after a write of image data: the range is dropped once its chunk is consumed. Before, the read
+// can still be queued (I/O engine) or the data can be mapped (vectored mode).
+static void prefetcher_release (Prefetcher *prefetcher, int fd, uint64_t offset, uint64_t size) {
+  xcp_vdi_stream_co_release_file(prefetcher->stream, fd, offset, size);
+}
+
+// -----------------------------------------------------------------------------
+
+typedef struct {
+  XcpVdiStream *stream;
+  Prefetcher *prefetcher; // NULL if the prefetch is disabled.
+} DataWriteState;
+
+// Compressed clusters of the parents of the base, the other ones are decompressed by the pool.
+static int write_compressed_range (
+  XcpVdiStream *stream, const QCow2Image *image, const QCow2CompressedRange *compressed, size_t nBytes
+) {
+  unsigned char *buf = malloc(nBytes);
+  if (!buf) {
+    xcp_vdi_stream_set_error_string(stream, "Failed to allocate decompression buffer (%s)", strerror(errno));
+    return -1;
+  }
+
+  int ret = qcow2_image_read_compressed(image, compressed, buf, nBytes, &stream->errorString);
+  if (!ret)
+    ret = xcp_vdi_stream_co_write(stream, buf, nBytes);
+  free(buf);
+  return ret;
+}
+
+static int map_cb_write_data (
   const QCow2Image *image,
-  uint64_t clustersOffset,
+  uint64_t offset,
+  size_t nBytes,
+  const QCow2CompressedRange *compressed,
   void *userData,
   char **error
 ) {
-  XCP_UNUSED(clustersOffset);
   XCP_UNUSED(error);
-  XCP_UNUSED(image);
 
-  L2TablesWriteState *state = userData;
-  XcpVdiStream *stream = state->stream;
+  const DataWriteState *state = userData;
+  if (!image)
+    return xcp_vdi_stream_co_write_zeros(state->stream, nBytes);
+  if (compressed)
+    return write_compressed_range(state->stream, image, compressed, nBytes);
+
+  if (xcp_vdi_stream_co_write_file(state->stream, image->fd, offset, nBytes) < 0)
+    return -1;
+  if (state->prefetcher)
+    prefetcher_release(state->prefetcher, image->fd, offset, nBytes);
+  return 0;
+}
 
-  const QCow2Image *rootImage = &((QCow2Chain *)stream->streamData)->image;
-  const uint32_t l1Index = qcow2_image_vaddr_to_l1_index(rootImage, sector << N_BITS_PER_SECTOR);
+static int output_clusters_cb_write_data (
+  uint64_t cluster, uint64_t count, OutputClusterType type, void *userData
+) {
+  if (type != OutputClusterAllocated)
+    return 0;
 
-  assert(state->currentL1Index <= l1Index);
-  if (state->currentL1Index < l1Index) {
-    state->currentL1Index = l1Index;
-    state->currentL1EntryWritten = false;
-    state->accSectorCount = 0;
-    state->accType = ClusterTypeUnallocated;
-  }
+  const DataWriteState *state = userData;
+  XcpVdiStream *stream = state->stream;
+  const QCow2StreamData *data = stream->streamData;
+  const QCow2Chain *chain = &data->chain;
+  const uint32_t clusterBits = data->layout.header.clusterBits;
+
+  // Do not read clusters before the start offset.
+  const uint64_t skipped = XCP_MIN(count, xcp_vdi_stream_get_skip_size(stream) >> clusterBits);
+  xcp_vdi_stream_co_skip(stream, skipped << clusterBits);
+  cluster += skipped;
+  count -= skipped;
+  if (!count)
+    return 0;
 
-  const uint32_t nbSectorsPerCluster = rootImage->nbSectorsPerCluster;
+  if (state->prefetcher && prefetcher_advance(state->prefetcher, cluster, count) < 0)
+    return -1;
 
-  // Write accumulated Unallocated l2 entries at L2 table start if necessary.
-  if (!state->currentL1EntryWritten && (typeMask & (ClusterTypeAllocated | ClusterTypeZero))) {
-    assert(state->accType == ClusterTypeUnallocated);
+  // The whole cluster is copied. If the chain cluster size is smaller, the data of the parent(s) of the base
+  // must be used. We can observe this case with the export of tests/images/10.qcow with base=tests/images/2.qcow:
+  // Cluster data of 1.qcow is merged in bigger clusters of 10.qcow.
+  const uint64_t vaddr = cluster << clusterBits;
+  const uint64_t nBytes = count << clusterBits;
+  const uint64_t nAvailableBytes = XCP_MIN(nBytes, (chain->image.nbSectors << N_BITS_PER_SECTOR) - vaddr);
 
-    if (write_l2_entries(stream, &state->dataOffset, state->accType, state->accSectorCount / nbSectorsPerCluster) < 0)
-      return -1;
+  qcow2_debug_log(
+    "Write from vaddr %#0*" PRIx64 " to offset %#0*" PRIx64 ": %" PRIu64 "B.",
+    HEX_LENGTH(vaddr), vaddr, HEX_LENGTH(vaddr), xcp_vdi_stream_get_current_offset(stream), nBytes
+  );
 
-    state->currentL1EntryWritten = true;
-    state->accSectorCount %= nbSectorsPerCluster;
-  }
+  if (qcow2_extent_map_map(
+    &data->extentMap, vaddr, (size_t)nAvailableBytes, map_cb_write_data, userData, &stream->errorString
+  ) < 0)
+    return -1;
 
-  // Downgrade current acc type if needed.
-  state->accSectorCount += nAvailableBytes >> N_BITS_PER_SECTOR;
-  if (state->accSectorCount && !(
-    ((state->accType & ClusterTypeZero) && (typeMask & (ClusterTypeAllocated | ClusterTypeZero))) ||
-    ((state->accType & ClusterTypeAllocated) && (typeMask & ClusterTypeAllocated)) ||
-    (state->accType & ClusterTypeUnallocated)
-  )) {
-    if (state->accSectorCount < nbSectorsPerCluster)
-      return 0; // Do not downgrade type because previous L2 entry has not been written yet.
+  // Write padding bytes.
+  return xcp_vdi_stream_co_write_zeros(stream, nBytes - nAvailableBytes);
+}
 
-    // Write first previous L2 entry with previous type when necessary.
-    if (write_l2_entries(stream, &state->dataOffset, state->accType, 1) < 0)
-      return -1;
-    state->accSectorCount -= nbSectorsPerCluster;
-  }
+// Write a host cluster (extended L2 entries): each used subcluster is given by the cluster which owns it.
+static int host_cluster_cb_write_data (uint64_t index, const HostCluster *host, void *userData) {
+  XCP_UNUSED(index);
 
-  state->accType = typeMask;
+  const DataWriteState *state = userData;
+  XcpVdiStream *stream = state->stream;
+  const QCow2StreamData *data = stream->streamData;
+  const QCow2Chain *chain = &data->chain;
+  const uint32_t clusterBits = data->layout.header.clusterBits;
+  const uint32_t subclusterBits = clusterBits - QCOW2_SUBCLUSTER_BITS;
 
-  if (!state->currentL1EntryWritten)
+  // Do not read host clusters before the start offset.
+  if (skip_region(stream, 1ULL << clusterBits))
     return 0;
 
-  if (write_l2_entries(stream, &state->dataOffset, state->accType, state->accSectorCount / nbSectorsPerCluster) < 0)
+  if (state->prefetcher && prefetcher_advance(state->prefetcher, host->firstCluster, 1) < 0)
     return -1;
-  state->accSectorCount %= nbSectorsPerCluster;
-  if (!state->accSectorCount)
-    state->accType = ClusterTypeUnallocated;
+
+  // Write the runs of subclusters of the same owner, the free subclusters are zeros.
+  for (uint32_t i = 0; i < QCOW2_SUBCLUSTER_COUNT; ) {
+    const uint32_t used = host->usedMask & (1u << i);
+    uint32_t n = 1;
+    while (
+      i + n < QCOW2_SUBCLUSTER_COUNT && !(host->usedMask & (1u << (i + n))) == !used &&
+      (!used || host->owners[i + n] == host->owners[i])
+    )
+      ++n;
+
+    const uint64_t nBytes = (uint64_t)n << subclusterBits;
+    if (!used) {
+      if (xcp_vdi_stream_co_write_zeros(stream, nBytes) < 0)
+        return -1;
+    } else {
+      const uint64_t vaddr = (host->owners[i] << clusterBits) + ((uint64_t)i << subclusterBits);
+      const uint64_t nAvailableBytes = XCP_MIN(nBytes, (chain->image.nbSectors << N_BITS_PER_SECTOR) - vaddr);
+      if (
+        qcow2_extent_map_map(
+          &data->extentMap, vaddr, (size_t)nAvailableBytes, map_cb_write_data, userData, &stream->errorString
+        ) < 0 ||
+        xcp_vdi_stream_co_write_zeros(stream, nBytes - nAvailableBytes) < 0
+      )
+        return -1;
+    }
+
+    i += n;
+  }
 
   return 0;
 }
@@ -237,121 +1809,322 @@ static int clusters_cb_write_l2_tables (
 // -----------------------------------------------------------------------------
 
 typedef struct {
-  XcpVdiStream *stream;
+  DataWriteState dataState; // Used by the clusters copied as they are.
+  CompressionPipeline pipeline;
 
-  size_t accSectorCount;
-  bool accWritten;
-} ClustersDataWriteState;
+  uint64_t nextIndex;  // Index of the next allocated cluster.
+  uint64_t nextOffset; // Offset of the data of the next allocated cluster, before alignment.
+} PipelinedDataWriteState;
 
-static int write_clusters_data (XcpVdiStream *stream, uint64_t sector, uint64_t nBytes) {
-  QCow2Chain *chain = stream->streamData;
+static int write_pipelined_cluster (PipelinedDataWriteState *state, const CompressionSlot *slot, uint64_t cluster) {
+  XcpVdiStream *stream = state->dataState.stream;
+  const StreamLayout *layout = &((QCow2StreamData *)stream->streamData)->layout;
 
-  uint64_t vaddr = sector << N_BITS_PER_SECTOR;
-  if (!qcow2_image_offset_to_cluster_padding(&chain->image, vaddr)) {
-    qcow2_debug_log(
-      "Write from vaddr %#0*" PRIx64 " to offset %#0*" PRIx64 ": %" PRIu64 "B.",
-      HEX_LENGTH(vaddr), vaddr, HEX_LENGTH(vaddr),
-      xcp_vdi_stream_get_current_offset(stream), nBytes
+  // Alignment of the clusters stored uncompressed.
+  if (xcp_vdi_stream_co_write_zeros(stream, slot->offset - xcp_vdi_stream_get_current_offset(stream)) < 0)
+    return -1;
+  if (!slot->hasJob)
+    return output_clusters_cb_write_data(cluster, 1, OutputClusterAllocated, &state->dataState);
+
+  // The offsets of the next clusters depend on this size.
+  const uint32_t size = layout->compressedSizes ? layout->compressedSizes[slot->index] : layout->clusterSize;
+  if (slot->job.size != size) {
+    xcp_vdi_stream_set_error_string(
+      stream, "Compressed size of cluster %" PRIu64 " changed (%zu != %" PRIu32 ")", cluster, slot->job.size, size
     );
+    return -1;
+  }
+
+  return xcp_vdi_stream_co_write(stream, slot->job.output, size);
+}
+
+static int compression_slot_cb_write (CompressionSlot *slot, void *userData) {
+  return write_pipelined_cluster(userData, slot, slot->job.cluster);
+}
+
+// Push a cluster given by a job. Without pending slots, the clusters before the start offset
+// are not read (see xcp_vdi_stream_seek).
+static int push_pipelined_job (PipelinedDataWriteState *state, const CompressionSlot *slot, uint64_t cluster) {
+  XcpVdiStream *stream = state->dataState.stream;
+  if (!state->pipeline.count) {
+    const uint64_t offset = xcp_vdi_stream_get_current_offset(stream);
+    if (state->nextOffset <= offset + xcp_vdi_stream_get_skip_size(stream)) {
+      xcp_vdi_stream_co_skip(stream, state->nextOffset - offset);
+      return 0;
+    }
   }
 
-  while (nBytes) {
-    const size_t bufSize = xcp_vdi_stream_get_buf_size(stream);
-    const size_t nBytesToRead = XCP_MIN(nBytes, XCP_VDI_STREAM_CHUNK_SIZE - bufSize);
-    char *dest = (char *)xcp_vdi_stream_get_buf(stream) + bufSize;
+  return compression_pipeline_push(&state->pipeline, slot->index, cluster, slot->offset, true);
+}
+
+static int output_clusters_cb_write_compressed_data (
+  uint64_t cluster, uint64_t count, OutputClusterType type, void *userData
+) {
+  if (type != OutputClusterAllocated)
+    return 0;
 
-    const ssize_t ret = qcow2_image_read(&chain->image, vaddr, nBytesToRead, dest, &stream->errorString);
+  PipelinedDataWriteState *state = userData;
+  XcpVdiStream *stream = state->dataState.stream;
+  const StreamLayout *layout = &((QCow2StreamData *)stream->streamData)->layout;
+  const uint32_t clusterBits = layout->header.clusterBits;
+
+  for (; count; ++cluster, --count) {
+    const uint64_t index = state->nextIndex++;
+    const uint32_t size = layout->compressedSizes[index];
+
+    CompressionSlot slot = { .index = index, .offset = state->nextOffset, .hasJob = size != 0 };
+    if (!size)
+      slot.offset = align_on_cluster(slot.offset, clusterBits);
+    state->nextOffset = slot.offset + (size ? size : 1ULL << clusterBits);
+
+    // Without pending slots, the clusters stored uncompressed are written directly.
+    int ret;
+    if (size)
+      ret = push_pipelined_job(state, &slot, cluster);
+    else if (!state->pipeline.count)
+      ret = write_pipelined_cluster(state, &slot, cluster);
+    else
+      ret = compression_pipeline_push(&state->pipeline, index, cluster, slot.offset, false);
     if (ret < 0)
       return -1;
-
-    assert(bufSize + (size_t)ret <= XCP_VDI_STREAM_CHUNK_SIZE);
-    xcp_vdi_stream_increase_size(stream, (size_t)ret);
-
-    vaddr += (size_t)ret;
-    nBytes -= (size_t)ret;
   }
 
   return 0;
 }
 
-static int clusters_cb_write_data (
-  uint64_t sector,
-  uint64_t nAvailableBytes,
-  uint32_t typeMask,
-  const QCow2Image *image,
-  uint64_t clustersOffset,
-  void *userData,
-  char **error
+// Without compression: the clusters which contain compressed clusters of the chain are decompressed by the pool.
+static int output_clusters_cb_write_decompressed_data (
+  uint64_t cluster, uint64_t count, OutputClusterType type, void *userData
 ) {
-  XCP_UNUSED(clustersOffset);
-  XCP_UNUSED(error);
-  XCP_UNUSED(image);
+  if (type != OutputClusterAllocated)
+    return 0;
 
-  ClustersDataWriteState *state = userData;
-  XcpVdiStream *stream = state->stream;
+  PipelinedDataWriteState *state = userData;
+  XcpVdiStream *stream = state->dataState.stream;
+  const QCow2StreamData *data = stream->streamData;
+  const uint32_t clusterBits = data->layout.header.clusterBits;
 
-  const uint64_t sectorCount = nAvailableBytes >> N_BITS_PER_SECTOR;
-  const uint32_t nbSectorsPerCluster = ((QCow2Chain *)stream->streamData)->image.nbSectorsPerCluster;
-
-  if (typeMask & ClusterTypeAllocated && !(typeMask & ClusterTypeZero)) {
-    // Write accumulated sectors.
-    if (!state->accWritten) {
-      assert(sector >= state->accSectorCount);
-      // Do not use xcp_vdi_stream_co_write_zeros here, we must use write_clusters_data because if the current
-      // cluster size is greater than a parent cluster size, we need to copy data of the parent(s) base image in
-      // this specific condition. We can observe this case with the export of tests/images/10.qcow with
-      // base=tests/images/2.qcow: Cluster data of 1.qcow is merged in bigger clusters of 10.qcow.
-      if (
-        state->accSectorCount &&
-        write_clusters_data(stream, sector - state->accSectorCount, state->accSectorCount << N_BITS_PER_SECTOR) < 0
-      )
-        return -1;
-      state->accWritten = true;
+  while (count) {
+    // 1. Clusters copied as they are, written at once without pending slots.
+    const uint64_t vaddr = cluster << clusterBits;
+    const uint64_t compressedVaddr = qcow2_extent_map_find_compressed(
+      &data->extentMap, vaddr, vaddr + (count << clusterBits)
+    );
+    const uint64_t rawCount = XCP_MIN(count, (compressedVaddr - vaddr) >> clusterBits);
+    if (rawCount) {
+      if (!state->pipeline.count) {
+        if (output_clusters_cb_write_data(cluster, rawCount, OutputClusterAllocated, &state->dataState) < 0)
+          return -1;
+      } else {
+        for (uint64_t i = 0; i < rawCount; ++i)
+          if (compression_pipeline_push(
+            &state->pipeline, state->nextIndex + i, cluster + i, state->nextOffset + (i << clusterBits), false
+          ) < 0)
+            return -1;
+      }
+      state->nextIndex += rawCount;
+      state->nextOffset += rawCount << clusterBits;
+      cluster += rawCount;
+      count -= rawCount;
+      if (!count)
+        break;
     }
 
-    // Write data.
-    if (write_clusters_data(stream, sector, nAvailableBytes) < 0)
+    // 2. Cluster with compressed data.
+    const CompressionSlot slot = { .index = state->nextIndex++, .offset = state->nextOffset, .hasJob = true };
+    state->nextOffset += 1ULL << clusterBits;
+    if (push_pipelined_job(state, &slot, cluster) < 0)
       return -1;
+    ++cluster;
+    --count;
+  }
 
-    state->accSectorCount = (state->accSectorCount + sectorCount) % nbSectorsPerCluster;
-    if (!state->accSectorCount)
-      state->accWritten = false;
-  } else if (state->accWritten) {
-    assert(state->accSectorCount);
-    if (state->accSectorCount + sectorCount >= nbSectorsPerCluster) {
-      // See the previous note.
-      const uint64_t remaining = nbSectorsPerCluster - state->accSectorCount;
-      if (write_clusters_data(stream, sector, remaining << N_BITS_PER_SECTOR) < 0)
-        return -1;
+  return 0;
+}
 
-      state->accSectorCount = (sectorCount - remaining) % nbSectorsPerCluster;
-      state->accWritten = false;
-    } else {
-      // See the previous note.
-      state->accSectorCount += sectorCount;
-      if (write_clusters_data(stream, sector, sectorCount << N_BITS_PER_SECTOR) < 0)
-        return -1;
-    }
-  } else
-    state->accSectorCount = (state->accSectorCount + sectorCount) % nbSectorsPerCluster;
+static int write_pipelined_data (
+  XcpVdiStream *stream, DataWriteState *dataState, size_t outputSize, OutputClustersCb cb
+) {
+  QCow2StreamData *data = stream->streamData;
+  const StreamLayout *layout = &data->layout;
+  const uint32_t l1Size = layout->header.l1Size;
+
+  PipelinedDataWriteState state = { .dataState = *dataState };
+  if (compression_pipeline_init(
+    &state.pipeline, data->compressionPool, outputSize, COMPRESSION_WRITE_JOBS_PER_WORKER,
+    compression_slot_cb_write, &state, &stream->errorString
+  ) < 0)
+    return -1;
 
-  return 0;
+  int ret = 0;
+  for (uint32_t i = 0; i < l1Size && !ret; ++i) {
+    const L1EntryLayout *entry = &layout->l1Entries[i];
+    const uint64_t endOffset = i + 1 < l1Size ? layout->l1Entries[i + 1].dataOffset : layout->dataOffset + layout->dataSize;
+    if (entry->dataOffset == endOffset)
+      continue;
+
+    // The skip size is exact only if the previous clusters are written.
+    if (xcp_vdi_stream_get_skip_size(stream) && (ret = compression_pipeline_flush(&state.pipeline)) < 0)
+      break;
+    if (skip_region(stream, endOffset - entry->dataOffset))
+      continue;
+
+    state.nextIndex = entry->dataClusterIndex;
+    state.nextOffset = entry->dataOffset;
+    ret = classify_clusters(stream, i, i + 1, cb, &state);
+  }
+
+  if (!ret)
+    ret = compression_pipeline_flush(&state.pipeline);
+  compression_pipeline_destroy(&state.pipeline);
+
+  // Padding of the last cluster.
+  if (!ret)
+    ret = xcp_vdi_stream_co_write_zeros(stream, layout->endOffset - xcp_vdi_stream_get_current_offset(stream));
+  return ret;
+}
+
+static int write_data (XcpVdiStream *stream) {
+  const QCow2StreamData *data = stream->streamData;
+  const StreamLayout *layout = &data->layout;
+  const uint32_t l1Size = layout->header.l1Size;
+
+  // Hints are useless if the page cache is not used.
+  Prefetcher prefetcher;
+  DataWriteState state = { .stream = stream, .prefetcher = NULL };
+  if (stream->prefetch && !stream->directIo) {
+    prefetcher_init(&prefetcher, stream);
+    state.prefetcher = &prefetcher;
+  }
+
+  if (!data->extendedL2 && (layout->compressedSizes || data->extentMap.compressedCount)) {
+    const int ret = layout->compressedSizes
+      ? write_pipelined_data(
+        stream, &state, COMPRESSED_CLUSTER_MAX_SIZE(layout->clusterSize), output_clusters_cb_write_compressed_data
+      )
+      : write_pipelined_data(stream, &state, layout->clusterSize, output_clusters_cb_write_decompressed_data);
+    if (state.prefetcher)
+      prefetcher_finish(state.prefetcher);
+    return ret;
+  }
+
+  // With extended L2 entries, the data clusters are the host clusters of the subclusters.
+  SubclusterPacker packer = {
+    .stream = stream,
+    .hostCb = host_cluster_cb_write_data,
+    .clusterCb = NULL,
+    .userData = &state
+  };
+
+  int ret = 0;
+  for (uint32_t i = 0; i < l1Size && !ret; ++i) {
+    const uint64_t endIndex = i + 1 < l1Size ? layout->l1Entries[i + 1].dataClusterIndex : layout->dataClusterCount;
+    const uint64_t count = endIndex - layout->l1Entries[i].dataClusterIndex;
+    if (!count || skip_region(stream, count << layout->header.clusterBits))
+      continue;
+
+    ret = data->extendedL2
+      ? pack_subclusters(&packer, i)
+      : classify_clusters(stream, i, i + 1, output_clusters_cb_write_data, &state);
+  }
+
+  if (state.prefetcher)
+    prefetcher_finish(state.prefetcher);
+  return ret;
 }
 
 // -----------------------------------------------------------------------------
 
 static int qcow2_stream_open (XcpVdiStream *stream) {
-  return qcow2_chain_open(stream->streamData, stream->filename, stream->base, &stream->errorString);
+  QCow2StreamData *data = stream->streamData;
+  data->layout.l1Entries = NULL;
+  data->layout.compressedSizes = NULL;
+  data->layout.dataRefcounts = NULL;
+  data->extentMap = (QCow2ExtentMap){ 0 };
+  data->dirtyBitmap = (QCow2DirtyBitmap){ 0 };
+  data->zeroClusters = (ZeroClusters){ 0 };
+  data->zeroDetection = stream->zeroDetection;
+  data->compression = stream->compression;
+  data->compressionWorkerCount = stream->compressionWorkerCount;
+  data->compressionPool = NULL;
+  data->extendedL2 = stream->extendedL2;
+  data->hasLayout = false;
+
+  // The clusters of a dirty bitmap are compared with the previous export, not with a base.
+  if (stream->dirtyBitmap && stream->base) {
+    xcp_vdi_stream_set_error_string(stream, "A dirty bitmap cannot be used with a base");
+    return -1;
+  }
+
+  const int flags = stream->directIo ? O_DIRECT : 0;
+  if (qcow2_chain_open(
+    &data->chain, stream->filename, stream->base, flags, stream->cacheSize, stream->shareImages, &stream->errorString
+  ) < 0)
+    return -1;
+
+  // Indexed images are skipped by the preload.
+  char **error = &stream->errorString;
+  if (
+    (stream->indexDir && qcow2_chain_load_indexes(&data->chain, stream->indexDir, error) < 0) ||
+    (stream->metadataPreload && qcow2_chain_preload_l2_tables(&data->chain, stream->ioQueueDepth, error) < 0) ||
+    (stream->dirtyBitmap && qcow2_dirty_bitmap_load(&data->dirtyBitmap, &data->chain.image, stream->dirtyBitmap, error) < 0)
+  ) {
+    qcow2_chain_close(&data->chain, NULL);
+    return -1;
+  }
+
+  // The generated clusters do not depend on the clusters of the chain, but the L1 table of small clusters
+  // can exceed the maximum size. The compression type is a field of the v3 header, the extended L2 entries
+  // are a v3 feature.
+  const QCow2Header *header = &data->chain.image.header;
+  data->clusterBits = stream->clusterSize ? (uint32_t)__builtin_ctz(stream->clusterSize) : header->clusterBits;
+  const uint32_t l2Bits = get_l2_bits(data, data->clusterBits);
+
+  const char *unsupported = NULL;
+  if (data->clusterBits < QCOW2_MIN_CLUSTER_BITS || data->clusterBits > QCOW2_MAX_CLUSTER_BITS)
+    unsupported = "The cluster size must be between 512B and 2MiB";
+  else if (XCP_DIV_ROUND_UP(header->size, 1ULL << (data->clusterBits + l2Bits)) > QCOW2_MAX_L1_SIZE)
+    unsupported = "The cluster size is too small for the virtual size of the image";
+  else if (data->compression == XCP_VDI_STREAM_COMPRESSION_ZSTD && header->version < 3)
+    unsupported = "zstd compression requires a QCOW2 v3 image";
+  else if (data->extendedL2 && (header->version < 3 || data->clusterBits < QCOW2_MIN_EXTENDED_L2_CLUSTER_BITS))
+    unsupported = "Extended L2 entries require a QCOW2 v3 image with clusters of at least 16KiB";
+  else if (data->extendedL2 && data->compression != XCP_VDI_STREAM_COMPRESSION_NONE)
+    unsupported = "Extended L2 entries cannot be used with compression";
+
+  if (unsupported) {
+    xcp_vdi_stream_set_error_string(stream, "%s", unsupported);
+    qcow2_dirty_bitmap_destroy(&data->dirtyBitmap);
+    qcow2_chain_close(&data->chain, NULL);
+    return -1;
+  }
+
+  pthread_mutex_init(&data->layoutMutex, NULL);
+  return 0;
 }
 
 static int qcow2_stream_close (XcpVdiStream *stream) {
-  return qcow2_chain_close(stream->streamData, &stream->errorString);
+  QCow2StreamData *data = stream->streamData;
+  pthread_mutex_destroy(&data->layoutMutex);
+  compression_pool_destroy(data->compressionPool);
+  data->compressionPool = NULL;
+  free(data->layout.l1Entries);
+  data->layout.l1Entries = NULL;
+  free(data->layout.compressedSizes);
+  data->layout.compressedSizes = NULL;
+  free(data->layout.dataRefcounts);
+  data->layout.dataRefcounts = NULL;
+  qcow2_extent_map_destroy(&data->extentMap);
+  qcow2_dirty_bitmap_destroy(&data->dirtyBitmap);
+  zero_clusters_destroy(&data->zeroClusters);
+
+  return qcow2_chain_close(&data->chain, &stream->errorString);
 }
 
 // -----------------------------------------------------------------------------
 
 static void qcow2_stream_dump_info (const XcpVdiStream *stream, int fd) {
-  const QCow2Image *image = &((QCow2Chain *)stream->streamData)->image;
+  const QCow2Image *image = &((QCow2StreamData *)stream->streamData)->chain.image;
   const QCow2Header *header = &image->header;
 
   dprintf(fd, "QCOW Image Header\n");
@@ -375,7 +2148,8 @@ static void qcow2_stream_dump_info (const XcpVdiStream *stream, int fd) {
 // -----------------------------------------------------------------------------
 
 static int qcow2_stream_init_header (XcpVdiStream *stream, QCow2Header *header) {
-  const QCow2Image *image = &((QCow2Chain *)stream->streamData)->image;
+  const QCow2StreamData *data = stream->streamData;
+  const QCow2Image *image = &data->chain.image;
   const QCow2Header *headerSrc = &image->header;
 
   memset(header, 0, sizeof *header);
@@ -383,21 +2157,31 @@ static int qcow2_stream_init_header (XcpVdiStream *stream, QCow2Header *header)
   header->magic = headerSrc->magic;
   header->version = headerSrc->version;
 
+  // A data cluster can be shared by many compressed clusters or by the subclusters of many clusters:
+  // at least 16-bit refcounts.
   header->refcountOrder = headerSrc->refcountOrder;
+  if (data->compression != XCP_VDI_STREAM_COMPRESSION_NONE || data->extendedL2)
+    header->refcountOrder = XCP_MAX(header->refcountOrder, 4u);
 
   header->headerLength = sizeof *header; // TODO: Copy data before/after header length???
 
-  header->clusterBits = headerSrc->clusterBits;
+  // The default compression type (deflate) does not need the field.
+  if (data->compression == XCP_VDI_STREAM_COMPRESSION_ZSTD) {
+    header->incompatibleFeatures |= QCOW2_INCOMPATIBLE_FEATURE_COMPRESSION_TYPE;
+    header->headerLength += QCOW2_COMPRESSION_TYPE_FIELD_LENGTH;
+  }
+
+  if (data->extendedL2)
+    header->incompatibleFeatures |= QCOW2_INCOMPATIBLE_FEATURE_EXTENDED_L2;
+
+  header->clusterBits = data->clusterBits;
   header->size = headerSrc->size;
 
   // Use the minimum l1Size.
-  header->l1Size = qcow2_image_l1_entry_count_from_size(image, header->size);
+  const uint32_t shift = header->clusterBits + get_l2_bits(data, header->clusterBits);
+  header->l1Size = (uint32_t)XCP_DIV_ROUND_UP(header->size, 1ULL << shift);
 
-  const uint64_t clusterSize = 1u << header->clusterBits;
-  header->l1TableOffset = clusterSize * 2;
-
-  header->refcountTableOffset = clusterSize;
-  header->refcountTableClusters = 1;
+  // The offsets of the tables are given by the layout (see compute_refcount_layout).
 
   const char *base = stream->base;
   if (base) {
@@ -407,8 +2191,14 @@ static int qcow2_stream_init_header (XcpVdiStream *stream, QCow2Header *header)
       return -1;
     }
 
+    // The header and the backing filename are stored in the first cluster.
     const uint64_t backingFileOffset = header->headerLength + QCOW2_END_OF_HEADER_EXTENSION_LENGTH;
-    assert(backingFileOffset && backingFileOffset + backingFileSize <= clusterSize);
+    if (backingFileOffset + backingFileSize > (1ULL << header->clusterBits)) {
+      xcp_vdi_stream_set_error_string(
+        stream, "Backing filename too long for clusters of %" PRIu32 "B", 1u << header->clusterBits
+      );
+      return -1;
+    }
 
     header->backingFileOffset = backingFileOffset;
     header->backingFileSize = backingFileSize;
@@ -418,150 +2208,93 @@ static int qcow2_stream_init_header (XcpVdiStream *stream, QCow2Header *header)
 }
 
 ssize_t qcow2_stream_read (XcpVdiStream *stream) {
-  const QCow2Chain *chain = stream->streamData;
-  const QCow2Image *image = &chain->image;
-
-  qcow2_debug_log("Starting stream of `%s` (base=`%s`).", image->filename, stream->base);
-
-  // 1. Write header.
-  QCow2Header header;
-  if (qcow2_stream_init_header(stream, &header) < 0)
+  if (compute_layout(stream) < 0)
     return -1;
 
-  qcow2_debug_log("Cluster bits: %" PRIu32 ".", header.clusterBits);
-  qcow2_debug_log("L1 size: %" PRIu32 ".", header.l1Size);
-  qcow2_debug_log("L1 table offset: %#" PRIx64 ".", header.l1TableOffset);
-  {
-    QCow2Header copy = header;
-    qcow2_header_to_be(&copy);
-    if (xcp_vdi_stream_co_write(stream, &copy, sizeof copy) < 0)
-      return -1;
-  }
+  const QCow2StreamData *data = stream->streamData;
+  const StreamLayout *layout = &data->layout;
+  const QCow2Header *header = &layout->header;
 
-  // TODO: Write extensions in the future + other data after header.
+  qcow2_debug_log(
+    "Starting stream of `%s` (base=`%s`) at offset %#" PRIx64 ".",
+    data->chain.image.filename, stream->base, xcp_vdi_stream_get_skip_size(stream)
+  );
 
-  // 2. Write backing filename.
-  if (stream->base) {
-    if (
-      xcp_vdi_stream_co_write_zeros(stream, header.backingFileOffset - header.headerLength) < 0 ||
-      xcp_vdi_stream_co_write(stream, stream->base, header.backingFileSize) < 0
-    )
-      return -1;
-  } else if (xcp_vdi_stream_co_write_zeros(stream, QCOW2_END_OF_HEADER_EXTENSION_LENGTH) < 0)
+  // 1. Write header.
+  if (!skip_region(stream, layout->clusterSize) && write_header(stream) < 0)
     return -1;
+  assert(xcp_vdi_stream_get_current_offset(stream) == layout->clusterSize);
 
-  // Write bytes padding.
-  {
-    const size_t offset = header.headerLength + QCOW2_END_OF_HEADER_EXTENSION_LENGTH + header.backingFileSize;
-    if (xcp_vdi_stream_co_write_zeros(stream, image->clusterSize - offset) < 0)
-      return -1;
-  }
-  assert(xcp_vdi_stream_get_current_offset(stream) == image->clusterSize);
+  // 2. Write refcount table.
+  if (
+    !skip_region(stream, layout->refcountBlocksOffset - header->refcountTableOffset) &&
+    write_refcount_table(stream) < 0
+  )
+    return -1;
+  assert(xcp_vdi_stream_get_current_offset(stream) == layout->refcountBlocksOffset);
 
-  // 3. Write refcount table.
-  if (xcp_vdi_stream_co_write_zeros(stream, header.refcountTableClusters << header.clusterBits) < 0)
+  // 3. Write refcount blocks.
+  if (write_refcount_blocks(stream) < 0)
     return -1;
-  assert(xcp_vdi_stream_get_current_offset(stream) == image->clusterSize << 1);
+  assert(xcp_vdi_stream_get_current_offset(stream) == header->l1TableOffset);
 
-  // 4. Write L1 tables.
-  const uint64_t l2TablesOffset =
-    header.l1TableOffset + (qcow2_cluster_count_from_l1_size(header.l1Size, header.clusterBits) << header.clusterBits);
-  uint64_t dataOffset;
-  qcow2_debug_log("L2 tables offset: %#" PRIx64 ".", l2TablesOffset);
-  {
-    L1TableWriteState state = {
-      .stream = stream,
-      .currentL2TableOffset = l2TablesOffset,
-      .currentL1Index = 0
-    };
-    if (qcow2_chain_foreach_clusters(chain, clusters_cb_write_l1_table, &state, &stream->errorString) < 0)
-      return -1;
+  // 4. Write L1 table.
+  if (!skip_region(stream, layout->l2TablesOffset - header->l1TableOffset) && write_l1_table(stream) < 0)
+    return -1;
+  assert(xcp_vdi_stream_get_current_offset(stream) == layout->l2TablesOffset);
 
-    const uint64_t l1Entry = xcp_to_be_u64(QCOW2_L1_ENTRY_FLAG_COPIED);
-    for (; state.currentL1Index < header.l1Size; ++state.currentL1Index)
-      if (xcp_vdi_stream_co_write(stream, &l1Entry, sizeof l1Entry) < 0)
-        return -1;
+  // 5. Write L2 tables.
+  if (write_l2_tables(stream) < 0)
+    return -1;
+  assert(xcp_vdi_stream_get_current_offset(stream) == layout->dataOffset);
 
-    // Data offset is just after the contiguous L2 tables.
-    dataOffset = state.currentL2TableOffset;
+  // 6. Write data.
+  if (write_data(stream) < 0)
+    return -1;
+  assert(xcp_vdi_stream_get_current_offset(stream) == layout->endOffset);
 
-    if (xcp_vdi_stream_co_write_zeros(stream, l2TablesOffset - (header.l1TableOffset + header.l1Size * sizeof(uint64_t))) < 0)
-      return -1;
-  }
-  assert(xcp_vdi_stream_get_current_offset(stream) == l2TablesOffset);
+  // Flush remaining bytes.
+  return xcp_vdi_stream_co_flush(stream);
+}
 
-  // 5. Write L2 tables.
-  const uint64_t l2EntryCount = XCP_DIV_ROUND_UP(header.size, image->clusterSize);
-  const uint64_t l2TableCount = XCP_DIV_ROUND_UP(l2EntryCount, image->l2Size);
-  uint64_t endOffset;
-  qcow2_debug_log("L2 entry count: %" PRIu64 ".", l2EntryCount);
-  qcow2_debug_log("L2 table count: %" PRIu64 ".", l2TableCount);
-  qcow2_debug_log("Data offset: %#" PRIx64 ".", dataOffset);
-  {
-    L2TablesWriteState state = {
-      .stream = stream,
-      .dataOffset = dataOffset,
-      .accSectorCount = 0,
-      .accType = ClusterTypeUnallocated,
-      .currentL1Index = 0,
-      .currentL1EntryWritten = false
-    };
-    if (qcow2_chain_foreach_clusters(chain, clusters_cb_write_l2_tables, &state, &stream->errorString) < 0)
-      return -1;
-    endOffset = state.dataOffset;
+static int qcow2_stream_get_size (XcpVdiStream *stream, XcpVdiStreamSize *size) {
+  if (compute_layout(stream) < 0)
+    return -1;
 
-    // Little trick to write last entry.
-    // It exists a particular case: Do not write acc sectors if L1 entry had not been written.
-    if (state.accSectorCount && state.currentL1EntryWritten) {
-      assert(image->nbSectorsPerCluster > state.accSectorCount);
-      clusters_cb_write_l2_tables(
-        0, (image->nbSectorsPerCluster - state.accSectorCount) << N_BITS_PER_SECTOR,
-        ClusterTypeUnallocated, image, 0, &state, &stream->errorString
-      );
-      assert(!state.accSectorCount);
-    }
+  const StreamLayout *layout = &((QCow2StreamData *)stream->streamData)->layout;
+  const uint32_t clusterBits = layout->header.clusterBits;
 
-    // Write unused l2 tables.
-    if (state.currentL1EntryWritten) {
-      const uint64_t l2Entry = xcp_to_be_u64(QCOW2_L2_ENTRY_FLAG_COPIED);
-      for (uint64_t i = (l2TableCount << image->l2Bits) - l2EntryCount; i; --i)
-        if (xcp_vdi_stream_co_write(stream, &l2Entry, sizeof l2Entry) < 0)
-          return -1;
-    }
-  }
-  assert(xcp_vdi_stream_get_current_offset(stream) == dataOffset);
+  size->size = layout->endOffset;
+  size->metadataSize = layout->dataOffset;
+  size->dataSize = layout->dataSize;
+  size->zeroSize = layout->zeroClusterCount << clusterBits;
 
-  // 6. Write data.
-  {
-    ClustersDataWriteState state = {
-      .stream = stream,
-      .accSectorCount = 0,
-      .accWritten = false
-    };
-    if (qcow2_chain_foreach_clusters(chain, clusters_cb_write_data, &state, &stream->errorString) < 0)
-      return -1;
+  return 0;
+}
 
-    // Write padding bytes.
-    if (state.accSectorCount)
-      if (xcp_vdi_stream_co_write_zeros(stream, (image->nbSectorsPerCluster - state.accSectorCount) << N_BITS_PER_SECTOR) < 0)
-        return -1;
-  }
-  XCP_UNUSED(endOffset); // Avoid warning when compiled in release mode.
-  assert(xcp_vdi_stream_get_current_offset(stream) == endOffset);
+static void qcow2_stream_get_cache_stats (XcpVdiStream *stream, XcpVdiStreamCacheStats *stats) {
+  // With shared images, these are the counters of the cache shared by the streams.
+  QCow2L2Cache *cache = ((QCow2StreamData *)stream->streamData)->chain.image.l2Cache;
 
-  // Flush remaining bytes.
-  return xcp_vdi_stream_co_flush(stream);
+  pthread_rwlock_rdlock(&cache->lock);
+  stats->hits = __atomic_load_n(&cache->hits, __ATOMIC_RELAXED);
+  stats->misses = cache->misses;
+  stats->evictions = cache->evictions;
+  stats->memoryUsage = cache->memoryUsage;
+  pthread_rwlock_unlock(&cache->lock);
 }
 
 // =============================================================================
 
 static XcpVdiDriver driver = {
   .name = "qcow2",
-  .streamDataSize = sizeof(QCow2Chain),
+  .streamDataSize = sizeof(QCow2StreamData),
 
   .open = qcow2_stream_open,
   .close = qcow2_stream_close,
   .dumpInfo = qcow2_stream_dump_info,
-  .read = qcow2_stream_read
+  .read = qcow2_stream_read,
+  .getSize = qcow2_stream_get_size,
+  .getCacheStats = qcow2_stream_get_cache_stats
 };
 xcp_vdi_driver_register(driver);
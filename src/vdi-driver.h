@@ -20,9 +20,9 @@
 
 #include <sys/types.h>
 
-// =============================================================================
+#include "xcp-ng/vdi-stream.h"
 
-typedef struct XcpVdiStream XcpVdiStream;
+// =============================================================================
 
 typedef struct XcpVdiDriver {
   const char *name;
@@ -32,6 +32,8 @@ typedef struct XcpVdiDriver {
   int (*close)(XcpVdiStream *stream);
   void (*dumpInfo)(const XcpVdiStream *stream, int fd);
   ssize_t (*read)(XcpVdiStream *stream);
+  int (*getSize)(XcpVdiStream *stream, XcpVdiStreamSize *size);
+  void (*getCacheStats)(XcpVdiStream *stream, XcpVdiStreamCacheStats *stats);
 } XcpVdiDriver;
 
 // -----------------------------------------------------------------------------
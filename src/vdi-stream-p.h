@@ -43,6 +43,28 @@ struct XcpVdiStream {
   char *filename;
   char *base;
 
+  size_t readAheadSize; // Memory limit of the read-ahead ring, 0 if disabled.
+  uint64_t startOffset; // First offset to stream, see xcp_vdi_stream_seek.
+  bool nonBlocking;     // See xcp_vdi_stream_set_non_blocking.
+  int eventFd;          // Signaled when a chunk is ready in non-blocking mode, -1 if not created.
+
+  bool directIo; // See xcp_vdi_stream_set_direct_io.
+  bool prefetch; // See xcp_vdi_stream_set_prefetch.
+  char *indexDir; // See xcp_vdi_stream_set_index_dir.
+  size_t cacheSize; // See xcp_vdi_stream_set_cache_size.
+  bool metadataPreload; // See xcp_vdi_stream_set_metadata_preload.
+  char *dirtyBitmap; // See xcp_vdi_stream_set_dirty_bitmap.
+  bool shareImages; // See xcp_vdi_stream_set_image_sharing.
+  bool zeroDetection; // See xcp_vdi_stream_set_zero_detection.
+  XcpVdiStreamCompression compression; // See xcp_vdi_stream_set_compression.
+  unsigned compressionWorkerCount;
+  bool extendedL2; // See xcp_vdi_stream_set_extended_l2.
+  uint32_t clusterSize; // See xcp_vdi_stream_set_cluster_size.
+
+  XcpVdiStreamIoEngine ioEngine; // See xcp_vdi_stream_set_io_engine.
+  unsigned ioQueueDepth;
+  unsigned ioFlags;
+
   // Internal opaque stream buf. It can't be used directly in streams.
   // xcp_vdi_stream_co_* functions must be called to update its state.
   XcpStreamBuf *streamBuf;
@@ -52,17 +74,29 @@ struct XcpVdiStream {
 
 #define xcp_vdi_stream_set_error_string(STREAM, FMT, ...) set_error(&(STREAM)->errorString, FMT, ##__VA_ARGS__)
 
+// Like xcp_vdi_stream_pread but the error is given in a new string, the stream error string is not changed.
+ssize_t xcp_vdi_stream_pread_range (XcpVdiStream *stream, void *buf, size_t count, uint64_t offset, char **error);
+
 int xcp_vdi_stream_co_write (XcpVdiStream *stream, const void *buf, size_t count);
 int xcp_vdi_stream_co_write_zeros (XcpVdiStream *stream, size_t count);
 
-int xcp_vdi_stream_co_flush (XcpVdiStream *stream);
+// Write N bytes of a file at the given offset.
+// Data are read in the stream buffer or directly mapped in vectored mode.
+int xcp_vdi_stream_co_write_file (XcpVdiStream *stream, int fd, uint64_t offset, size_t count);
 
-void *xcp_vdi_stream_get_buf (XcpVdiStream *stream);
+// Drop N bytes of a file from the page cache once the current chunk is given to the consumer and released
+// (the queued reads are done and the mappings are removed).
+void xcp_vdi_stream_co_release_file (XcpVdiStream *stream, int fd, uint64_t offset, uint64_t count);
 
-size_t xcp_vdi_stream_get_buf_size (const XcpVdiStream *stream);
+int xcp_vdi_stream_co_flush (XcpVdiStream *stream);
 
-int xcp_vdi_stream_increase_size (XcpVdiStream *stream, size_t count);
+// Advance the current offset without producing bytes. Streams can use it to jump
+// over regions before the start offset, count must be lower or equal to the skip size.
+void xcp_vdi_stream_co_skip (XcpVdiStream *stream, uint64_t count);
 
 uint64_t xcp_vdi_stream_get_current_offset (const XcpVdiStream *stream);
 
+// Remaining bytes to skip before the start offset. Written bytes are dropped until it reaches 0.
+uint64_t xcp_vdi_stream_get_skip_size (const XcpVdiStream *stream);
+
 #endif // ifndef _XCP_NG_VDI_STREAM_P_H_
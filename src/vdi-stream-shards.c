@@ -0,0 +1,198 @@
+/*
+ * xcp-ng-vdi-stream
+ * Copyright (C) 2019  Vates SAS - ronan.abhamon@vates.fr
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "global.h"
+#include "vdi-stream-p.h"
+
+// =============================================================================
+
+// Default shard size: 16MiB.
+#define XCP_VDI_STREAM_DEFAULT_SHARD_SIZE (XCP_VDI_STREAM_CHUNK_SIZE << 3)
+
+// -----------------------------------------------------------------------------
+
+typedef struct {
+  XcpVdiStream *stream;
+
+  uint64_t startOffset;
+  uint64_t endOffset;
+  size_t shardSize;
+  uint64_t shardCount;
+
+  bool ordered;
+  XcpVdiStreamShardCb cb;
+  void *userData;
+
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+  pthread_mutex_t cbMutex; // Serialize the callback calls.
+
+  uint64_t nextShard;    // Next shard to produce.
+  uint64_t nextDelivery; // Next shard to give in ordered mode.
+  bool failed;           // Stop all workers.
+  char *error;           // First error, given to the stream once the workers are joined.
+} ShardExport;
+
+// Must be called with the lock. The error is owned by the export, only the first one is kept.
+static void shard_export_fail (ShardExport *export, char *error) {
+  if (!export->error)
+    export->error = error;
+  else
+    free(error);
+
+  export->failed = true;
+  pthread_cond_broadcast(&export->cond);
+}
+
+static void *shard_worker (void *userData) {
+  ShardExport *export = userData;
+  char *error = NULL;
+
+  void *buf = malloc(export->shardSize);
+
+  pthread_mutex_lock(&export->mutex);
+  if (!buf) {
+    set_error(&error, "Failed to allocate shard buffer (%s)", strerror(errno));
+    shard_export_fail(export, error);
+  }
+
+  while (!export->failed && export->nextShard < export->shardCount) {
+    const uint64_t index = export->nextShard++;
+    pthread_mutex_unlock(&export->mutex);
+
+    // 1. Produce the shard.
+    const uint64_t offset = export->startOffset + index * export->shardSize;
+    const size_t count = (size_t)XCP_MIN(export->endOffset - offset, (uint64_t)export->shardSize);
+    error = NULL;
+    const ssize_t ret = xcp_vdi_stream_pread_range(export->stream, buf, count, offset, &error);
+
+    pthread_mutex_lock(&export->mutex);
+    if (ret < 0 || (size_t)ret != count) {
+      if (ret >= 0)
+        set_error(&error, "Truncated shard at offset %#" PRIx64, offset);
+      shard_export_fail(export, error);
+      break;
+    }
+
+    // 2. Wait for the previous shards.
+    while (export->ordered && !export->failed && export->nextDelivery != index)
+      pthread_cond_wait(&export->cond, &export->mutex);
+    if (export->failed)
+      break;
+    pthread_mutex_unlock(&export->mutex);
+
+    // 3. Deliver it.
+    pthread_mutex_lock(&export->cbMutex);
+    const int cbRet = (*export->cb)(buf, count, offset, export->userData);
+    pthread_mutex_unlock(&export->cbMutex);
+
+    pthread_mutex_lock(&export->mutex);
+    if (cbRet < 0) {
+      error = NULL;
+      set_error(&error, "Shard callback failed at offset %#" PRIx64, offset);
+      shard_export_fail(export, error);
+      break;
+    }
+
+    ++export->nextDelivery;
+    pthread_cond_broadcast(&export->cond);
+  }
+  pthread_mutex_unlock(&export->mutex);
+
+  free(buf);
+  return NULL;
+}
+
+// -----------------------------------------------------------------------------
+
+int xcp_vdi_stream_export_shards (
+  XcpVdiStream *stream,
+  unsigned workerCount,
+  size_t shardSize,
+  bool ordered,
+  XcpVdiStreamShardCb cb,
+  void *userData
+) {
+  if (!workerCount) {
+    xcp_vdi_stream_set_error_string(stream, "At least one worker is required");
+    return -1;
+  }
+
+  XcpVdiStreamSize size;
+  if (xcp_vdi_stream_get_size(stream, &size) < 0)
+    return -1;
+
+  ShardExport export = {
+    .stream = stream,
+    .startOffset = XCP_MIN(stream->startOffset, size.size),
+    .endOffset = size.size,
+    .shardSize = shardSize ? shardSize : XCP_VDI_STREAM_DEFAULT_SHARD_SIZE,
+    .ordered = ordered,
+    .cb = cb,
+    .userData = userData,
+    .nextShard = 0,
+    .nextDelivery = 0,
+    .failed = false,
+    .error = NULL
+  };
+  export.shardCount = XCP_DIV_ROUND_UP(export.endOffset - export.startOffset, (uint64_t)export.shardSize);
+  workerCount = (unsigned)XCP_MIN((uint64_t)workerCount, XCP_MAX(export.shardCount, (uint64_t)1));
+
+  pthread_t *workers = malloc(workerCount * sizeof *workers);
+  if (!workers) {
+    xcp_vdi_stream_set_error_string(stream, "Failed to allocate workers (%s)", strerror(errno));
+    return -1;
+  }
+
+  pthread_mutex_init(&export.mutex, NULL);
+  pthread_cond_init(&export.cond, NULL);
+  pthread_mutex_init(&export.cbMutex, NULL);
+
+  unsigned i;
+  for (i = 0; i < workerCount; ++i) {
+    const int ret = pthread_create(&workers[i], NULL, shard_worker, &export);
+    if (ret) {
+      char *error = NULL;
+      set_error(&error, "Failed to create shard worker (%s)", strerror(ret));
+      pthread_mutex_lock(&export.mutex);
+      shard_export_fail(&export, error);
+      pthread_mutex_unlock(&export.mutex);
+      break;
+    }
+  }
+  while (i)
+    pthread_join(workers[--i], NULL);
+
+  // No worker is running: the error can be given to the stream.
+  if (export.failed) {
+    free(stream->errorString);
+    stream->errorString = export.error;
+  }
+
+  pthread_mutex_destroy(&export.cbMutex);
+  pthread_cond_destroy(&export.cond);
+  pthread_mutex_destroy(&export.mutex);
+  free(workers);
+
+  return export.failed ? -1 : 0;
+}
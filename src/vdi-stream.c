@@ -15,33 +15,591 @@
  * along with this program.  If not, see <https://www.gnu.org/licenses/>.
  */
 
+#define _GNU_SOURCE
 #include <assert.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <linux/fs.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/ioctl.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/queue.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #include <xcp-ng/generic/coroutine.h>
+#include <xcp-ng/generic/file.h>
+#include <xcp-ng/generic/global.h>
+#include <xcp-ng/generic/io.h>
 
+#include "compression.h"
 #include "global.h"
+#include "io-engine.h"
 #include "vdi-driver.h"
 #include "vdi-stream-p.h"
 
 // =============================================================================
 
+// Max number of parts in a vectored chunk (IOV_MAX on Linux).
+#define XCP_VDI_STREAM_IOV_MAX 1024
+
+// Max number of workers shared by the streams in non-blocking mode.
+#define XCP_VDI_STREAM_ASYNC_MAX_WORKERS 16
+
+// Alignment required to try a clone of file ranges (common block size of XFS/btrfs).
+#define XCP_VDI_STREAM_CLONE_ALIGNMENT 4096u
+
+// Read-only mapping of zeros used to describe padding in vectored mode.
+static void *ZeroArea;
+static pthread_once_t ZeroAreaOnce = PTHREAD_ONCE_INIT;
+
+static void zero_area_init (void) {
+  void *addr = mmap(NULL, XCP_VDI_STREAM_CHUNK_SIZE, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  ZeroArea = addr == MAP_FAILED ? NULL : addr;
+}
+
+// -----------------------------------------------------------------------------
+
+typedef struct {
+  void *addr;
+  size_t size;
+} XcpStreamMapping;
+
+// Size of a mapped image, see map_file.
+typedef struct {
+  int fd;
+  uint64_t size;
+} XcpStreamFileSize;
+
+// Image range to drop from the page cache, see xcp_vdi_stream_co_release_file.
+typedef struct {
+  int fd;
+  uint64_t offset;
+  uint64_t size;
+} XcpStreamRelease;
+
+typedef struct {
+  void *buf;       // Chunk buffer. In vectored mode, it contains only generated metadata.
+  size_t bufSize;  // Used bytes of buf.
+  size_t size;     // Stream byte count of the chunk. Must be lower than capacity.
+  size_t capacity; // XCP_VDI_STREAM_CHUNK_SIZE or the size of a range (see xcp_vdi_stream_pread).
+
+  // Vectored mode only.
+  struct iovec *iov;          // Parts of the chunk: buf, zero area or mapped image data.
+  int iovCount;
+  XcpStreamMapping *mappings; // Image regions referenced by iov.
+  int mappingCount;
+
+  // Released once the consumer is done with the chunk: the data can still be read or mapped before.
+  XcpStreamRelease *releases;
+  size_t releaseCount;
+  size_t releaseCapacity;
+} XcpStreamChunk;
+
+// Ring of chunks filled by a producer thread (read-ahead mode).
+typedef struct {
+  pthread_t thread;
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+
+  XcpStreamChunk *slots;
+  size_t slotCount;
+
+  size_t head;       // Index of the next slot to give to the consumer.
+  size_t readyCount; // Number of filled slots not yet released by the consumer.
+  bool held;         // The consumer is using the head slot.
+
+  ssize_t ret;       // Returned value of the driver read function.
+  bool done;         // The producer is terminated.
+  bool stop;         // Request the producer to stop.
+} XcpStreamRing;
+
+typedef struct XcpStreamAsync XcpStreamAsync;
+
 struct XcpStreamBuf {
-  void *buf;     // Stream buffer.
-  size_t size;   // Current buffer byte count. Must be lower than XCP_VDI_STREAM_CHUNK_SIZE.
+  XcpStreamChunk *chunk; // Current chunk to fill.
+  XcpStreamChunk uniqueChunk; // Used by the coroutine.
   ssize_t coRet; // Returned value to the user.
 
   uint64_t offset; // Current offset position (i.e. quantity of total data written).
+  uint64_t skip;   // Bytes to drop before the start offset.
+
+  bool vectored; // Chunks are described by iov (see xcp_vdi_stream_readv).
+  XcpStreamFileSize *fileSizes; // Vectored mode only: sizes of the mapped images, checked before each mapping.
+  size_t fileSizeCount;
+
+  // Range mode only (see xcp_vdi_stream_pread).
+  bool ranged;        // The chunk is the range to produce, the stream is stopped when it is full.
+  bool rangeComplete;
+
+  // Direct mode only (see xcp_vdi_stream_write_to_fd).
+  int outputFd;         // Chunks are written in this file.
+  bool direct;
+  bool cloneDisabled;   // FICLONERANGE is not supported by the output.
+  bool copyDisabled;    // copy_file_range is not supported by the output.
 
   XcpCoroutine *coroutine; // Coroutine to stream buffer.
+  XcpStreamRing *ring;     // Used instead of the coroutine in read-ahead mode.
+  XcpStreamAsync *async;   // Used in non-blocking mode.
+
+  IoEngine *ioEngine; // Queue of image reads, NULL if blocking reads are used.
+};
+
+// -----------------------------------------------------------------------------
+
+static void chunk_reset (XcpStreamChunk *chunk) {
+  for (int i = 0; i < chunk->mappingCount; ++i)
+    munmap(chunk->mappings[i].addr, chunk->mappings[i].size);
+
+  for (size_t i = 0; i < chunk->releaseCount; ++i) {
+    const XcpStreamRelease *release = &chunk->releases[i];
+    posix_fadvise(release->fd, (off_t)release->offset, (off_t)release->size, POSIX_FADV_DONTNEED);
+  }
+  chunk->releaseCount = 0;
+
+  chunk->bufSize = 0;
+  chunk->size = 0;
+  chunk->iovCount = 0;
+  chunk->mappingCount = 0;
+}
+
+static void chunk_uninit (XcpStreamChunk *chunk) {
+  chunk_reset(chunk);
+
+  free(chunk->buf);
+  free(chunk->iov);
+  free(chunk->mappings);
+  free(chunk->releases);
+}
+
+static int chunk_init (XcpVdiStream *stream, XcpStreamChunk *chunk, bool vectored) {
+  if (!(chunk->buf = aligned_block_alloc(XCP_VDI_STREAM_CHUNK_SIZE))) {
+    xcp_vdi_stream_set_error_string(stream, "Failed to allocate chunk buffer (%s)", strerror(errno));
+    return -1;
+  }
+  chunk->capacity = XCP_VDI_STREAM_CHUNK_SIZE;
+
+  if (vectored && (
+    !(chunk->iov = malloc(XCP_VDI_STREAM_IOV_MAX * sizeof *chunk->iov)) ||
+    !(chunk->mappings = malloc(XCP_VDI_STREAM_IOV_MAX * sizeof *chunk->mappings))
+  )) {
+    xcp_vdi_stream_set_error_string(stream, "Failed to allocate chunk iov (%s)", strerror(errno));
+    chunk_uninit(chunk);
+    return -1;
+  }
+
+  return 0;
+}
+
+// Add a part at the end of a vectored chunk. Merge it with the previous part if possible.
+static void chunk_append_iov (XcpStreamChunk *chunk, const void *base, size_t len) {
+  if (chunk->iovCount) {
+    struct iovec *last = &chunk->iov[chunk->iovCount - 1];
+    if ((const char *)last->iov_base + last->iov_len == base) {
+      last->iov_len += len;
+      return;
+    }
+  }
+
+  assert(chunk->iovCount < XCP_VDI_STREAM_IOV_MAX);
+  chunk->iov[chunk->iovCount++] = (struct iovec){ .iov_base = (void *)base, .iov_len = len };
+}
+
+// -----------------------------------------------------------------------------
+
+static void ring_destroy (XcpStreamRing *ring) {
+  for (size_t i = 0; i < ring->slotCount; ++i)
+    chunk_uninit(&ring->slots[i]);
+  free(ring->slots);
+
+  pthread_cond_destroy(&ring->cond);
+  pthread_mutex_destroy(&ring->mutex);
+  free(ring);
+}
+
+static void *ring_producer (void *userData) {
+  XcpVdiStream *stream = userData;
+  XcpStreamRing *ring = stream->streamBuf->ring;
+
+  const ssize_t ret = (*stream->driver->read)(stream);
+
+  pthread_mutex_lock(&ring->mutex);
+  ring->ret = ret;
+  ring->done = true;
+  pthread_cond_broadcast(&ring->cond);
+  pthread_mutex_unlock(&ring->mutex);
+
+  return NULL;
+}
+
+static XcpStreamRing *ring_create (XcpVdiStream *stream) {
+  XcpStreamRing *ring = calloc(1, sizeof *ring);
+  if (!ring) {
+    xcp_vdi_stream_set_error_string(stream, "Failed to create XcpStreamRing (%s)", strerror(errno));
+    return NULL;
+  }
+
+  // At least two slots: one for the consumer and one for the producer.
+  const size_t slotCount = XCP_MAX(stream->readAheadSize / XCP_VDI_STREAM_CHUNK_SIZE, (size_t)2);
+  if (!(ring->slots = calloc(slotCount, sizeof *ring->slots))) {
+    xcp_vdi_stream_set_error_string(stream, "Failed to create slots of XcpStreamRing (%s)", strerror(errno));
+    free(ring);
+    return NULL;
+  }
+
+  pthread_mutex_init(&ring->mutex, NULL);
+  pthread_cond_init(&ring->cond, NULL);
+
+  for (; ring->slotCount < slotCount; ++ring->slotCount)
+    if (chunk_init(stream, &ring->slots[ring->slotCount], stream->streamBuf->vectored) < 0) {
+      ring_destroy(ring);
+      return NULL;
+    }
+
+  return ring;
+}
+
+static int ring_start (XcpVdiStream *stream) {
+  XcpStreamBuf *streamBuf = stream->streamBuf;
+  XcpStreamRing *ring = streamBuf->ring;
+
+  streamBuf->chunk = &ring->slots[0];
+
+  const int ret = pthread_create(&ring->thread, NULL, ring_producer, stream);
+  if (ret) {
+    xcp_vdi_stream_set_error_string(stream, "Failed to create producer thread (%s)", strerror(ret));
+    return -1;
+  }
+  return 0;
+}
+
+static void ring_stop (XcpStreamRing *ring) {
+  pthread_mutex_lock(&ring->mutex);
+  ring->stop = true;
+  pthread_cond_broadcast(&ring->cond);
+  pthread_mutex_unlock(&ring->mutex);
+
+  pthread_join(ring->thread, NULL);
+}
+
+// Called by the producer: publish the current slot and wait for a free one.
+static int ring_push (XcpVdiStream *stream) {
+  XcpStreamBuf *streamBuf = stream->streamBuf;
+  XcpStreamRing *ring = streamBuf->ring;
+
+  pthread_mutex_lock(&ring->mutex);
+
+  const size_t tail = (ring->head + ring->readyCount) % ring->slotCount;
+  ++ring->readyCount;
+  pthread_cond_broadcast(&ring->cond);
+
+  while (!ring->stop && ring->readyCount == ring->slotCount)
+    pthread_cond_wait(&ring->cond, &ring->mutex);
+
+  const bool stop = ring->stop;
+  streamBuf->chunk = &ring->slots[(tail + 1) % ring->slotCount];
+
+  pthread_mutex_unlock(&ring->mutex);
+
+  if (stop)
+    return -1;
+
+  chunk_reset(streamBuf->chunk);
+  return 0;
+}
+
+// Called by the consumer: release the previous slot and wait for the next one.
+static ssize_t ring_pop (XcpStreamRing *ring, const XcpStreamChunk **chunk) {
+  pthread_mutex_lock(&ring->mutex);
+
+  if (ring->held) {
+    ring->held = false;
+    ring->head = (ring->head + 1) % ring->slotCount;
+    --ring->readyCount;
+    pthread_cond_broadcast(&ring->cond);
+  }
+
+  while (!ring->readyCount && !ring->done)
+    pthread_cond_wait(&ring->cond, &ring->mutex);
+
+  ssize_t ret;
+  if (ring->readyCount) {
+    ring->held = true;
+    *chunk = &ring->slots[ring->head];
+    ret = (ssize_t)(*chunk)->size;
+  } else
+    ret = ring->ret;
+
+  pthread_mutex_unlock(&ring->mutex);
+  return ret;
+}
+
+// -----------------------------------------------------------------------------
+
+// Slot of a non-blocking stream. It is filled by a worker of the shared pool.
+typedef struct XcpStreamAsyncSlot {
+  TAILQ_ENTRY(XcpStreamAsyncSlot) entry; // In the pool queue.
+
+  XcpStreamAsync *async;
+  XcpStreamChunk chunk;
+  uint64_t offset;
+  ssize_t ret;
+  char *error; // Given to the stream by the consumer, the workers do not write the stream error string.
+
+  enum {
+    AsyncSlotFree,
+    AsyncSlotQueued,
+    AsyncSlotRunning,
+    AsyncSlotDone
+  } state;
+} XcpStreamAsyncSlot;
+
+struct XcpStreamAsync {
+  XcpVdiStream *stream;
+
+  XcpStreamAsyncSlot *slots;
+  size_t slotCount;
+
+  size_t head;         // Index of the next slot to give to the consumer.
+  bool held;           // The consumer is using the head slot.
+  uint64_t nextOffset; // Offset of the next slot to queue.
+  bool eof;            // Do not queue new slots.
+
+  size_t pendingCount; // Queued and running slots.
+  pthread_cond_t cond; // Signaled when a slot is done.
+};
+
+// Workers shared by all streams in non-blocking mode. All async data are protected by the pool mutex.
+static struct {
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+  TAILQ_HEAD(, XcpStreamAsyncSlot) queue;
+  pthread_once_t once;
+  int error;
+} AsyncPool = {
+  .mutex = PTHREAD_MUTEX_INITIALIZER,
+  .cond = PTHREAD_COND_INITIALIZER,
+  .queue = TAILQ_HEAD_INITIALIZER(AsyncPool.queue),
+  .once = PTHREAD_ONCE_INIT
 };
 
+static void *async_pool_worker (void *userData) {
+  XCP_UNUSED(userData);
+
+  pthread_mutex_lock(&AsyncPool.mutex);
+  for (;;) {
+    XcpStreamAsyncSlot *slot;
+    while (!(slot = TAILQ_FIRST(&AsyncPool.queue)))
+      pthread_cond_wait(&AsyncPool.cond, &AsyncPool.mutex);
+
+    TAILQ_REMOVE(&AsyncPool.queue, slot, entry);
+    slot->state = AsyncSlotRunning;
+    pthread_mutex_unlock(&AsyncPool.mutex);
+
+    XcpVdiStream *stream = slot->async->stream;
+    char *error = NULL;
+    const ssize_t ret = xcp_vdi_stream_pread_range(
+      stream, slot->chunk.buf, slot->chunk.capacity, slot->offset, &error
+    );
+
+    pthread_mutex_lock(&AsyncPool.mutex);
+    free(slot->error);
+    slot->error = error;
+    slot->ret = ret;
+    slot->chunk.size = ret > 0 ? (size_t)ret : 0;
+    slot->state = AsyncSlotDone;
+
+    // Notify the consumer after the state change, otherwise the event can be consumed too early.
+    eventfd_write(stream->eventFd, 1);
+
+    --slot->async->pendingCount;
+    pthread_cond_broadcast(&slot->async->cond);
+  }
+
+  return NULL;
+}
+
+static void async_pool_init (void) {
+  const long cpuCount = sysconf(_SC_NPROCESSORS_ONLN);
+  const long workerCount = XCP_MIN(XCP_MAX(cpuCount, 2L), (long)XCP_VDI_STREAM_ASYNC_MAX_WORKERS);
+
+  pthread_attr_t attr;
+  pthread_attr_init(&attr);
+  pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+  for (long i = 0; i < workerCount; ++i) {
+    pthread_t thread;
+    const int ret = pthread_create(&thread, &attr, async_pool_worker, NULL);
+    if (ret) {
+      if (!i)
+        AsyncPool.error = ret;
+      break;
+    }
+  }
+
+  pthread_attr_destroy(&attr);
+}
+
+// Must be called with the pool lock.
+static void async_queue_slots (XcpStreamAsync *async) {
+  for (size_t i = 0; i < async->slotCount && !async->eof; ++i) {
+    XcpStreamAsyncSlot *slot = &async->slots[(async->head + i) % async->slotCount];
+    if (slot->state != AsyncSlotFree)
+      continue;
+
+    slot->offset = async->nextOffset;
+    async->nextOffset += slot->chunk.capacity;
+    slot->state = AsyncSlotQueued;
+    ++async->pendingCount;
+    TAILQ_INSERT_TAIL(&AsyncPool.queue, slot, entry);
+  }
+  pthread_cond_broadcast(&AsyncPool.cond);
+}
+
+static void async_destroy (XcpStreamAsync *async) {
+  for (size_t i = 0; i < async->slotCount; ++i) {
+    chunk_uninit(&async->slots[i].chunk);
+    free(async->slots[i].error);
+  }
+  free(async->slots);
+
+  pthread_cond_destroy(&async->cond);
+  free(async);
+}
+
+static XcpStreamAsync *async_create (XcpVdiStream *stream) {
+  pthread_once(&AsyncPool.once, async_pool_init);
+  if (AsyncPool.error) {
+    xcp_vdi_stream_set_error_string(stream, "Failed to create async workers (%s)", strerror(AsyncPool.error));
+    return NULL;
+  }
+
+  XcpStreamAsync *async = calloc(1, sizeof *async);
+  if (!async) {
+    xcp_vdi_stream_set_error_string(stream, "Failed to create XcpStreamAsync (%s)", strerror(errno));
+    return NULL;
+  }
+
+  // Like the read-ahead ring, at least two slots: one for the consumer and one in progress.
+  const size_t slotCount = XCP_MAX(stream->readAheadSize / XCP_VDI_STREAM_CHUNK_SIZE, (size_t)2);
+  if (!(async->slots = calloc(slotCount, sizeof *async->slots))) {
+    xcp_vdi_stream_set_error_string(stream, "Failed to create slots of XcpStreamAsync (%s)", strerror(errno));
+    free(async);
+    return NULL;
+  }
+
+  async->stream = stream;
+  async->nextOffset = stream->startOffset;
+  pthread_cond_init(&async->cond, NULL);
+
+  for (; async->slotCount < slotCount; ++async->slotCount) {
+    XcpStreamAsyncSlot *slot = &async->slots[async->slotCount];
+    slot->async = async;
+    if (chunk_init(stream, &slot->chunk, false) < 0) {
+      async_destroy(async);
+      return NULL;
+    }
+  }
+
+  return async;
+}
+
+// Cancel the queued slots and wait for the running ones.
+static void async_stop (XcpStreamAsync *async) {
+  pthread_mutex_lock(&AsyncPool.mutex);
+  for (size_t i = 0; i < async->slotCount; ++i) {
+    XcpStreamAsyncSlot *slot = &async->slots[i];
+    if (slot->state == AsyncSlotQueued) {
+      TAILQ_REMOVE(&AsyncPool.queue, slot, entry);
+      slot->state = AsyncSlotFree;
+      --async->pendingCount;
+    }
+  }
+  while (async->pendingCount)
+    pthread_cond_wait(&async->cond, &AsyncPool.mutex);
+  pthread_mutex_unlock(&AsyncPool.mutex);
+}
+
+static ssize_t async_pop (XcpStreamAsync *async, const XcpStreamChunk **chunk) {
+  pthread_mutex_lock(&AsyncPool.mutex);
+
+  // 1. Release the previous slot and queue the free ones.
+  if (async->held) {
+    async->held = false;
+    async->slots[async->head].state = AsyncSlotFree;
+    async->head = (async->head + 1) % async->slotCount;
+  }
+  async_queue_slots(async);
+
+  // 2. Consume the pending events: the state of the head slot is checked after.
+  eventfd_t value;
+  eventfd_read(async->stream->eventFd, &value);
+
+  // 3. Give the head slot if it is done. Errors and EOF are kept.
+  ssize_t ret = XCP_VDI_STREAM_WOULD_BLOCK;
+  XcpStreamAsyncSlot *slot = &async->slots[async->head];
+  if (slot->state == AsyncSlotDone) {
+    ret = slot->ret;
+    if (ret < 0) {
+      free(async->stream->errorString);
+      async->stream->errorString = slot->error;
+      slot->error = NULL;
+    } else if (ret > 0) {
+      async->held = true;
+      *chunk = &slot->chunk;
+    }
+    if (ret < (ssize_t)slot->chunk.capacity)
+      async->eof = true;
+  } else if (async->eof && slot->state == AsyncSlotFree)
+    ret = 0; // The last chunk was partial, nothing has been queued after.
+
+  pthread_mutex_unlock(&AsyncPool.mutex);
+  return ret;
+}
+
 // -----------------------------------------------------------------------------
 
+static void stop_stream_buf (XcpVdiStream *stream) {
+  // Exit coroutine properly.
+  // If the last coRet value is positive (i.e. data exists), we force it to -1.
+  // After that the coroutine is resumed to kill itself.
+  XcpStreamBuf *streamBuf = stream->streamBuf;
+  if (streamBuf && streamBuf->ring)
+    ring_stop(streamBuf->ring);
+  else if (streamBuf && streamBuf->async)
+    async_stop(streamBuf->async);
+  else if (streamBuf && streamBuf->coRet > 0) {
+    streamBuf->coRet = -1;
+    xcp_coroutine_resume(streamBuf->coroutine);
+  }
+}
+
+static void free_stream_buf (XcpVdiStream *stream) {
+  if (stream->streamBuf) {
+    // Reads in flight use the chunk buffers.
+    io_engine_destroy(stream->streamBuf->ioEngine);
+
+    if (stream->streamBuf->ring)
+      ring_destroy(stream->streamBuf->ring);
+    else if (stream->streamBuf->async)
+      async_destroy(stream->streamBuf->async);
+    else
+      chunk_uninit(&stream->streamBuf->uniqueChunk);
+    free(stream->streamBuf->fileSizes);
+    free(stream->streamBuf);
+    stream->streamBuf = NULL;
+  }
+}
+
 static void reset_stream_data (XcpVdiStream *stream) {
   stream->driver = NULL;
+  stream->startOffset = 0;
 
   free(stream->streamData);
   stream->streamData = NULL;
@@ -52,22 +610,25 @@ static void reset_stream_data (XcpVdiStream *stream) {
   free(stream->base);
   stream->base = NULL;
 
-  if (stream->streamBuf) {
-    free(stream->streamBuf->buf);
-    free(stream->streamBuf);
-    stream->streamBuf = NULL;
-  }
+  free_stream_buf(stream);
 }
 
 // -----------------------------------------------------------------------------
 
 XcpVdiStream *xcp_vdi_stream_new () {
-  return calloc(sizeof(XcpVdiStream), 1);
+  XcpVdiStream *stream = calloc(sizeof(XcpVdiStream), 1);
+  if (stream)
+    stream->eventFd = -1;
+  return stream;
 }
 
 void xcp_vdi_stream_destroy (XcpVdiStream *stream) {
   if (stream) {
     xcp_vdi_stream_close(stream);
+    if (stream->eventFd >= 0)
+      xcp_fd_close(stream->eventFd);
+    free(stream->indexDir);
+    free(stream->dirtyBitmap);
     free(stream->errorString);
     free(stream);
   }
@@ -105,14 +666,7 @@ int xcp_vdi_stream_open (XcpVdiStream *stream, const char *format, const char *f
 int xcp_vdi_stream_close (XcpVdiStream *stream) {
   int ret = 0;
   if (stream->driver) {
-    // Exit coroutine properly.
-    // If the last coRet value is positive (i.e. data exists), we force it to -1.
-    // After that the coroutine is resumed to kill itself.
-    XcpStreamBuf *streamBuf = stream->streamBuf;
-    if (streamBuf && streamBuf->coRet > 0) {
-      streamBuf->coRet = -1;
-      xcp_coroutine_resume(streamBuf->coroutine);
-    }
+    stop_stream_buf(stream);
 
     // Close and reset data.
     ret = (*stream->driver->close)(stream);
@@ -134,140 +688,842 @@ void xcp_vdi_stream_dump_info (const XcpVdiStream *stream, int fd) {
     (*stream->driver->dumpInfo)(stream, fd);
 }
 
-static void xcp_vdi_stream_co_read_wrapper (void *userData) {
-  XcpVdiStream *stream = (XcpVdiStream *)userData;
-  stream->streamBuf->coRet = (*stream->driver->read)(stream);
+int xcp_vdi_stream_get_size (XcpVdiStream *stream, XcpVdiStreamSize *size) {
+  if (!stream->driver) {
+    xcp_vdi_stream_set_error_string(stream, "Driver not loaded");
+    return -1;
+  }
+  return (*stream->driver->getSize)(stream, size);
 }
 
-ssize_t xcp_vdi_stream_read (XcpVdiStream *stream, const void **buf) {
-  // 1. Create buf and coroutine if necessary.
-  if (!stream->streamBuf) {
-    if (!stream->driver) {
-      xcp_vdi_stream_set_error_string(stream, "Driver not loaded");
-      return -1;
-    }
-
-    if (!(stream->streamBuf = calloc(1, sizeof *stream->streamBuf))) {
-      xcp_vdi_stream_set_error_string(stream, "Failed to create XcpStreamBuf (%s)", strerror(errno));
-      return -1;
-    }
-
-    XcpStreamBuf *streamBuf = stream->streamBuf;
-    if (!(streamBuf->buf = aligned_block_alloc(XCP_VDI_STREAM_CHUNK_SIZE)))
-      xcp_vdi_stream_set_error_string(stream, "Failed to allocate buffer of XcpStreamBuf (%s)", strerror(errno));
-    else if (!(streamBuf->coroutine = xcp_coroutine_create(xcp_vdi_stream_co_read_wrapper, stream)))
-      xcp_vdi_stream_set_error_string(stream, "Failed to create stream coroutine (%s)", strerror(errno));
-    else
-      goto resume;
-
-    free(streamBuf->buf);
-    free(streamBuf);
-    stream->streamBuf = NULL;
+int xcp_vdi_stream_get_cache_stats (XcpVdiStream *stream, XcpVdiStreamCacheStats *stats) {
+  if (!stream->driver) {
+    xcp_vdi_stream_set_error_string(stream, "Driver not loaded");
     return -1;
-  } else {
-    // Do not continue if the last coRet is an error or EOF.
-    const ssize_t coRet = stream->streamBuf->coRet;
-    if (coRet <= 0)
-      return coRet;
   }
 
-resume:
-  {
-    XcpStreamBuf *streamBuf = stream->streamBuf;
-    xcp_coroutine_resume(streamBuf->coroutine);
-    *buf = streamBuf->buf;
-    return streamBuf->coRet;
-  }
+  memset(stats, 0, sizeof *stats);
+  if (stream->driver->getCacheStats)
+    (*stream->driver->getCacheStats)(stream, stats);
+  return 0;
 }
 
-// -----------------------------------------------------------------------------
-
-int xcp_vdi_stream_co_write (XcpVdiStream *stream, const void *buf, size_t count) {
-  XcpStreamBuf *streamBuf = stream->streamBuf;
-  assert(streamBuf->size <= XCP_VDI_STREAM_CHUNK_SIZE);
+int xcp_vdi_stream_set_direct_io (XcpVdiStream *stream, bool enable) {
+  if (stream->driver) {
+    xcp_vdi_stream_set_error_string(stream, "Direct I/O must be set before the stream opening");
+    return -1;
+  }
 
-  while (count) {
-    const size_t nBytes = XCP_MIN(XCP_VDI_STREAM_CHUNK_SIZE - streamBuf->size, count);
-    memcpy((char *)streamBuf->buf + streamBuf->size, buf, count);
-    streamBuf->size += nBytes;
-    streamBuf->offset += nBytes;
+  stream->directIo = enable;
+  return 0;
+}
 
-    if (streamBuf->size == XCP_VDI_STREAM_CHUNK_SIZE) {
-      const int ret = xcp_vdi_stream_co_flush(stream);
-      if (ret < 0)
-        return ret;
-    }
+int xcp_vdi_stream_set_index_dir (XcpVdiStream *stream, const char *dir) {
+  if (stream->driver) {
+    xcp_vdi_stream_set_error_string(stream, "Index dir must be set before the stream opening");
+    return -1;
+  }
 
-    count -= nBytes;
+  char *copy = NULL;
+  if (dir && !(copy = strdup(dir))) {
+    xcp_vdi_stream_set_error_string(stream, "Unable to copy index dir (%s)", strerror(errno));
+    return -1;
   }
 
+  free(stream->indexDir);
+  stream->indexDir = copy;
   return 0;
 }
 
-int xcp_vdi_stream_co_write_zeros (XcpVdiStream *stream, size_t count) {
-  XcpStreamBuf *streamBuf = stream->streamBuf;
-  assert(streamBuf->size <= XCP_VDI_STREAM_CHUNK_SIZE);
-
-  while (count) {
-    const size_t nBytes = XCP_MIN(XCP_VDI_STREAM_CHUNK_SIZE - streamBuf->size, count);
-    memset((char *)streamBuf->buf + streamBuf->size, 0, nBytes);
-    streamBuf->size += nBytes;
-    streamBuf->offset += nBytes;
+int xcp_vdi_stream_set_cache_size (XcpVdiStream *stream, size_t memoryLimit) {
+  if (stream->driver) {
+    xcp_vdi_stream_set_error_string(stream, "Cache size must be set before the stream opening");
+    return -1;
+  }
 
-    if (streamBuf->size == XCP_VDI_STREAM_CHUNK_SIZE) {
-      const int ret = xcp_vdi_stream_co_flush(stream);
-      if (ret < 0)
-        return ret;
-    }
+  stream->cacheSize = memoryLimit;
+  return 0;
+}
 
-    count -= nBytes;
+int xcp_vdi_stream_set_metadata_preload (XcpVdiStream *stream, bool enable) {
+  if (stream->driver) {
+    xcp_vdi_stream_set_error_string(stream, "Metadata preload must be set before the stream opening");
+    return -1;
   }
 
+  stream->metadataPreload = enable;
   return 0;
 }
 
-int xcp_vdi_stream_co_flush (XcpVdiStream *stream) {
-  XcpStreamBuf *streamBuf = stream->streamBuf;
-  if (!streamBuf->size)
-    return 0;
+int xcp_vdi_stream_set_image_sharing (XcpVdiStream *stream, bool enable) {
+  if (stream->driver) {
+    xcp_vdi_stream_set_error_string(stream, "Image sharing must be set before the stream opening");
+    return -1;
+  }
 
-  streamBuf->coRet = (ssize_t)streamBuf->size;
-  xcp_coroutine_yield();
+  stream->shareImages = enable;
+  return 0;
+}
 
-  // The coRet can be set to -1 on coroutine destruction.
-  if (streamBuf->coRet < 0)
+int xcp_vdi_stream_set_dirty_bitmap (XcpVdiStream *stream, const char *name) {
+  if (stream->driver) {
+    xcp_vdi_stream_set_error_string(stream, "Dirty bitmap must be set before the stream opening");
     return -1;
+  }
 
-  streamBuf->size = 0;
-  streamBuf->coRet = 0;
+  char *copy = NULL;
+  if (name && !(copy = strdup(name))) {
+    xcp_vdi_stream_set_error_string(stream, "Unable to copy dirty bitmap name (%s)", strerror(errno));
+    return -1;
+  }
 
+  free(stream->dirtyBitmap);
+  stream->dirtyBitmap = copy;
   return 0;
 }
 
-void *xcp_vdi_stream_get_buf (XcpVdiStream *stream) {
-  return stream->streamBuf->buf;
-}
+int xcp_vdi_stream_set_zero_detection (XcpVdiStream *stream, bool enable) {
+  if (stream->driver) {
+    xcp_vdi_stream_set_error_string(stream, "Zero detection must be set before the stream opening");
+    return -1;
+  }
 
-size_t xcp_vdi_stream_get_buf_size (const XcpVdiStream *stream) {
-  return stream->streamBuf->size;
+  stream->zeroDetection = enable;
+  return 0;
 }
 
-int xcp_vdi_stream_increase_size (XcpVdiStream *stream, size_t count) {
-  if (!count)
-    return 0;
+int xcp_vdi_stream_set_compression (XcpVdiStream *stream, XcpVdiStreamCompression compression, unsigned workerCount) {
+  if (stream->driver) {
+    xcp_vdi_stream_set_error_string(stream, "Compression must be set before the stream opening");
+    return -1;
+  }
+
+  if (!compression_is_supported(compression)) {
+    xcp_vdi_stream_set_error_string(stream, "Unsupported compression %d", (int)compression);
+    return -1;
+  }
+
+  stream->compression = compression;
+  stream->compressionWorkerCount = workerCount;
+  return 0;
+}
+
+int xcp_vdi_stream_set_extended_l2 (XcpVdiStream *stream, bool enable) {
+  if (stream->driver) {
+    xcp_vdi_stream_set_error_string(stream, "Extended L2 entries must be set before the stream opening");
+    return -1;
+  }
+
+  stream->extendedL2 = enable;
+  return 0;
+}
+
+int xcp_vdi_stream_set_cluster_size (XcpVdiStream *stream, uint32_t clusterSize) {
+  if (stream->driver) {
+    xcp_vdi_stream_set_error_string(stream, "Cluster size must be set before the stream opening");
+    return -1;
+  }
+
+  // The range is checked by the driver of the format.
+  if (clusterSize & (clusterSize - 1)) {
+    xcp_vdi_stream_set_error_string(stream, "Cluster size %" PRIu32 " is not a power of two", clusterSize);
+    return -1;
+  }
+
+  stream->clusterSize = clusterSize;
+  return 0;
+}
+
+int xcp_vdi_stream_set_read_ahead (XcpVdiStream *stream, size_t memoryLimit) {
+  if (stream->streamBuf) {
+    xcp_vdi_stream_set_error_string(stream, "Read-ahead cannot be changed during stream");
+    return -1;
+  }
+
+  stream->readAheadSize = memoryLimit;
+  return 0;
+}
+
+int xcp_vdi_stream_set_prefetch (XcpVdiStream *stream, bool enable) {
+  if (stream->streamBuf) {
+    xcp_vdi_stream_set_error_string(stream, "Prefetch cannot be changed during stream");
+    return -1;
+  }
+
+  stream->prefetch = enable;
+  return 0;
+}
+
+int xcp_vdi_stream_set_non_blocking (XcpVdiStream *stream, bool enable) {
+  if (stream->streamBuf) {
+    xcp_vdi_stream_set_error_string(stream, "Non-blocking mode cannot be changed during stream");
+    return -1;
+  }
+
+  stream->nonBlocking = enable;
+  return 0;
+}
+
+int xcp_vdi_stream_get_event_fd (XcpVdiStream *stream) {
+  if (stream->eventFd < 0 && (stream->eventFd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK)) < 0)
+    xcp_vdi_stream_set_error_string(stream, "Failed to create event fd (%s)", strerror(errno));
+  return stream->eventFd;
+}
+
+int xcp_vdi_stream_set_io_engine (
+  XcpVdiStream *stream, XcpVdiStreamIoEngine engine, unsigned queueDepth, unsigned flags
+) {
+  if (stream->streamBuf) {
+    xcp_vdi_stream_set_error_string(stream, "I/O engine cannot be changed during stream");
+    return -1;
+  }
+  if (engine != XCP_VDI_STREAM_IO_ENGINE_PREAD && engine != XCP_VDI_STREAM_IO_ENGINE_IO_URING) {
+    xcp_vdi_stream_set_error_string(stream, "Unknown I/O engine: %d", (int)engine);
+    return -1;
+  }
+
+  stream->ioEngine = engine;
+  stream->ioQueueDepth = queueDepth;
+  stream->ioFlags = flags;
+  return 0;
+}
+
+// Create the engine of the stream buf once its chunks exist.
+// It's not fatal if the engine is not supported by the system: blocking reads are used.
+static void init_io_engine (XcpVdiStream *stream, XcpStreamChunk *chunks, size_t chunkCount) {
+  XcpStreamBuf *streamBuf = stream->streamBuf;
+  if (stream->ioEngine == XCP_VDI_STREAM_IO_ENGINE_PREAD || streamBuf->vectored)
+    return;
+
+  char *error = NULL;
+  if (!(streamBuf->ioEngine = io_engine_create(stream->ioEngine, stream->ioQueueDepth, stream->ioFlags, &error))) {
+    debug_log("[vdi-stream] Using blocking reads: %s.", error);
+    free(error);
+    return;
+  }
+
+  if (stream->ioFlags & XCP_VDI_STREAM_IO_FIXED_BUFFERS) {
+    struct iovec *buffers = malloc(chunkCount * sizeof *buffers);
+    if (!buffers)
+      return;
+
+    for (size_t i = 0; i < chunkCount; ++i)
+      buffers[i] = (struct iovec){ .iov_base = chunks[i].buf, .iov_len = chunks[i].capacity };
+    // Not fatal: the buffers are used without registration on failure.
+    io_engine_register_buffers(streamBuf->ioEngine, buffers, (unsigned)chunkCount);
+    free(buffers);
+  }
+}
+
+static void xcp_vdi_stream_co_read_wrapper (void *userData) {
+  XcpVdiStream *stream = (XcpVdiStream *)userData;
+  stream->streamBuf->coRet = (*stream->driver->read)(stream);
+}
+
+static int create_stream_buf (XcpVdiStream *stream, bool vectored) {
+  if (!stream->driver) {
+    xcp_vdi_stream_set_error_string(stream, "Driver not loaded");
+    return -1;
+  }
+
+  if (stream->nonBlocking) {
+    if (vectored) {
+      xcp_vdi_stream_set_error_string(stream, "Vectored reads are not supported in non-blocking mode");
+      return -1;
+    }
+    if (xcp_vdi_stream_get_event_fd(stream) < 0)
+      return -1;
+  }
+
+  if (vectored) {
+    pthread_once(&ZeroAreaOnce, zero_area_init);
+    if (!ZeroArea) {
+      xcp_vdi_stream_set_error_string(stream, "Failed to map zero area");
+      return -1;
+    }
+  }
+
+  if (!(stream->streamBuf = calloc(1, sizeof *stream->streamBuf))) {
+    xcp_vdi_stream_set_error_string(stream, "Failed to create XcpStreamBuf (%s)", strerror(errno));
+    return -1;
+  }
+
+  XcpStreamBuf *streamBuf = stream->streamBuf;
+  streamBuf->skip = stream->startOffset;
+  streamBuf->vectored = vectored;
+  if (stream->nonBlocking) {
+    if ((streamBuf->async = async_create(stream)))
+      return 0;
+  } else if (stream->readAheadSize) {
+    if ((streamBuf->ring = ring_create(stream))) {
+      init_io_engine(stream, streamBuf->ring->slots, streamBuf->ring->slotCount);
+      if (ring_start(stream) == 0)
+        return 0;
+      io_engine_destroy(streamBuf->ioEngine);
+      ring_destroy(streamBuf->ring);
+    }
+  } else if (chunk_init(stream, &streamBuf->uniqueChunk, vectored) == 0) {
+    streamBuf->chunk = &streamBuf->uniqueChunk;
+    init_io_engine(stream, streamBuf->chunk, 1);
+    if ((streamBuf->coroutine = xcp_coroutine_create(xcp_vdi_stream_co_read_wrapper, stream)))
+      return 0;
+
+    xcp_vdi_stream_set_error_string(stream, "Failed to create stream coroutine (%s)", strerror(errno));
+    io_engine_destroy(streamBuf->ioEngine);
+    chunk_uninit(&streamBuf->uniqueChunk);
+  }
+
+  free(streamBuf);
+  stream->streamBuf = NULL;
+  return -1;
+}
+
+static ssize_t read_chunk (XcpVdiStream *stream, bool vectored, const XcpStreamChunk **chunk) {
+  // 1. Create buf and coroutine (or producer thread) if necessary.
+  if (!stream->streamBuf) {
+    if (create_stream_buf(stream, vectored) < 0)
+      return -1;
+  } else if (stream->streamBuf->vectored != vectored) {
+    xcp_vdi_stream_set_error_string(stream, "Cannot mix vectored and non-vectored reads");
+    return -1;
+  } else if (!stream->streamBuf->ring && !stream->streamBuf->async) {
+    // Do not continue if the last coRet is an error or EOF.
+    const ssize_t coRet = stream->streamBuf->coRet;
+    if (coRet <= 0)
+      return coRet;
+  }
+
+  XcpStreamBuf *streamBuf = stream->streamBuf;
+
+  // 2. Read-ahead mode: Just take the next ready slot.
+  if (streamBuf->ring)
+    return ring_pop(streamBuf->ring, chunk);
+
+  // 3. Non-blocking mode: Take the next slot if it is filled.
+  if (streamBuf->async)
+    return async_pop(streamBuf->async, chunk);
+
+  // 4. Otherwise fill the chunk now.
+  xcp_coroutine_resume(streamBuf->coroutine);
+  *chunk = streamBuf->chunk;
+  return streamBuf->coRet;
+}
+
+ssize_t xcp_vdi_stream_read (XcpVdiStream *stream, const void **buf) {
+  const XcpStreamChunk *chunk;
+  const ssize_t ret = read_chunk(stream, false, &chunk);
+  if (ret > 0)
+    *buf = chunk->buf;
+  return ret;
+}
+
+ssize_t xcp_vdi_stream_readv (XcpVdiStream *stream, const struct iovec **iov, int *iovcnt) {
+  const XcpStreamChunk *chunk;
+  const ssize_t ret = read_chunk(stream, true, &chunk);
+  if (ret > 0) {
+    *iov = chunk->iov;
+    *iovcnt = chunk->iovCount;
+  }
+  return ret;
+}
+
+int xcp_vdi_stream_write_to_fd (XcpVdiStream *stream, int fd) {
+  if (stream->streamBuf) {
+    xcp_vdi_stream_set_error_string(stream, "Stream already started");
+    return -1;
+  }
+  if (!stream->driver) {
+    xcp_vdi_stream_set_error_string(stream, "Driver not loaded");
+    return -1;
+  }
+
+  if (!(stream->streamBuf = calloc(1, sizeof *stream->streamBuf))) {
+    xcp_vdi_stream_set_error_string(stream, "Failed to create XcpStreamBuf (%s)", strerror(errno));
+    return -1;
+  }
+
+  XcpStreamBuf *streamBuf = stream->streamBuf;
+  if (chunk_init(stream, &streamBuf->uniqueChunk, false) < 0) {
+    free(streamBuf);
+    stream->streamBuf = NULL;
+    return -1;
+  }
+  streamBuf->chunk = &streamBuf->uniqueChunk;
+  streamBuf->skip = stream->startOffset;
+  streamBuf->outputFd = fd;
+  streamBuf->direct = true;
+
+  // No coroutine in this mode: The chunks are flushed directly in the output.
+  // The last returned value is kept, so next reads return EOF or the error.
+  streamBuf->coRet = (*stream->driver->read)(stream);
+  return (int)streamBuf->coRet;
+}
+
+ssize_t xcp_vdi_stream_pread_range (XcpVdiStream *stream, void *buf, size_t count, uint64_t offset, char **error) {
+  if (!stream->driver) {
+    set_error(error, "Driver not loaded");
+    return -1;
+  }
+  if (!count)
+    return 0;
+
+  // Each call uses its own stream buf and error string, the stream is not modified: its error string
+  // can be written at the same time by a sequential read.
+  // The range is produced directly in the user buffer.
+  XcpStreamBuf streamBuf;
+  memset(&streamBuf, 0, sizeof streamBuf);
+  streamBuf.chunk = &streamBuf.uniqueChunk;
+  streamBuf.chunk->buf = buf;
+  streamBuf.chunk->capacity = count;
+  streamBuf.skip = offset;
+  streamBuf.ranged = true;
+
+  XcpVdiStream view = {
+    .driver = stream->driver,
+    .streamData = stream->streamData,
+    .errorString = NULL,
+    .filename = stream->filename,
+    .base = stream->base,
+    .streamBuf = &streamBuf
+  };
+
+  const ssize_t ret = (*stream->driver->read)(&view);
+  if (ret < 0 && !streamBuf.rangeComplete) {
+    if (error) {
+      free(*error);
+      *error = view.errorString;
+    } else
+      free(view.errorString);
+    return -1;
+  }
+
+  free(view.errorString);
+  return (ssize_t)streamBuf.chunk->size;
+}
+
+ssize_t xcp_vdi_stream_pread (
+  XcpVdiStream *stream, void *buf, size_t count, uint64_t offset, char *error, size_t errorSize
+) {
+  char *errorString = NULL;
+  const ssize_t ret = xcp_vdi_stream_pread_range(stream, buf, count, offset, &errorString);
+  if (ret < 0 && error && errorSize)
+    snprintf(error, errorSize, "%s", errorString ? errorString : "Unknown error");
+  free(errorString);
+  return ret;
+}
+
+int xcp_vdi_stream_seek (XcpVdiStream *stream, uint64_t offset) {
+  if (!stream->driver) {
+    xcp_vdi_stream_set_error_string(stream, "Driver not loaded");
+    return -1;
+  }
+
+  // Stop the current stream. The next read creates a new one which starts at the given offset.
+  stop_stream_buf(stream);
+  free_stream_buf(stream);
+  stream->startOffset = offset;
+
+  return 0;
+}
+
+// -----------------------------------------------------------------------------
+
+static int write_all (XcpVdiStream *stream, int fd, const void *buf, size_t count) {
+  while (count) {
+    const ssize_t ret = write(fd, buf, count);
+    if (ret < 0) {
+      if (errno == EINTR)
+        continue;
+      xcp_vdi_stream_set_error_string(stream, "Failed to write %zuB in output (%s)", count, strerror(errno));
+      return -1;
+    }
+
+    buf = (const char *)buf + ret;
+    count -= (size_t)ret;
+  }
+
+  return 0;
+}
+
+// Try to share the file range with the output (reflink). Returns 1 on success, 0 if not possible.
+static int clone_file_range (XcpVdiStream *stream, int fd, uint64_t offset, size_t count) {
+  XcpStreamBuf *streamBuf = stream->streamBuf;
+  if (streamBuf->cloneDisabled)
+    return 0;
+
+  const off_t outputOffset = lseek(streamBuf->outputFd, 0, SEEK_CUR);
+  if (outputOffset < 0) {
+    streamBuf->cloneDisabled = true; // Not seekable (pipe, socket...).
+    return 0;
+  }
+
+  const uint64_t mask = XCP_VDI_STREAM_CLONE_ALIGNMENT - 1;
+  if ((offset | (uint64_t)outputOffset | count) & mask)
+    return 0;
+
+  struct file_clone_range range = {
+    .src_fd = fd,
+    .src_offset = offset,
+    .src_length = count,
+    .dest_offset = (uint64_t)outputOffset
+  };
+  if (ioctl(streamBuf->outputFd, FICLONERANGE, &range) < 0) {
+    // EINVAL can be returned for a specific range (e.g. block size greater than the alignment).
+    if (errno != EINVAL)
+      streamBuf->cloneDisabled = true;
+    return 0;
+  }
+
+  if (lseek(streamBuf->outputFd, (off_t)count, SEEK_CUR) < 0) {
+    xcp_vdi_stream_set_error_string(stream, "Failed to seek in output (%s)", strerror(errno));
+    return -1;
+  }
+  return 1;
+}
+
+// Copy the file range in the kernel. Returns 1 on success, 0 if not supported.
+static int copy_file_range_to_output (XcpVdiStream *stream, int fd, uint64_t offset, size_t count) {
+  XcpStreamBuf *streamBuf = stream->streamBuf;
+  if (streamBuf->copyDisabled)
+    return 0;
+
+  loff_t srcOffset = (loff_t)offset;
+  bool copied = false;
+  while (count) {
+    const ssize_t ret = copy_file_range(fd, &srcOffset, streamBuf->outputFd, NULL, count, 0);
+    if (ret < 0) {
+      if (errno == EINTR)
+        continue;
+
+      // Fallback only if nothing has been copied, otherwise the output position is unknown.
+      if (!copied && (errno == ENOSYS || errno == EXDEV || errno == EOPNOTSUPP || errno == EINVAL)) {
+        streamBuf->copyDisabled = true;
+        return 0;
+      }
+      xcp_vdi_stream_set_error_string(
+        stream, "Failed to copy %zuB at offset %#" PRIx64 " (%s)", count, (uint64_t)srcOffset, strerror(errno)
+      );
+      return -1;
+    }
+    if (ret == 0) {
+      xcp_vdi_stream_set_error_string(stream, "Truncated copy at offset %#" PRIx64, (uint64_t)srcOffset);
+      return -1;
+    }
+
+    copied = true;
+    count -= (size_t)ret;
+  }
+
+  return 1;
+}
 
+static int write_file_to_output (XcpVdiStream *stream, int fd, uint64_t offset, size_t count) {
   XcpStreamBuf *streamBuf = stream->streamBuf;
-  const size_t newSize = streamBuf->size + count;
-  assert(newSize <= XCP_VDI_STREAM_CHUNK_SIZE);
 
-  streamBuf->size = newSize;
+  // 1. Write pending metadata before data.
+  if (xcp_vdi_stream_co_flush(stream) < 0)
+    return -1;
+
+  // 2. Use the fastest available method.
+  int ret = clone_file_range(stream, fd, offset, count);
+  if (!ret)
+    ret = copy_file_range_to_output(stream, fd, offset, count);
+  if (ret < 0)
+    return -1;
+
+  if (ret) {
+    streamBuf->offset += count;
+    return 0;
+  }
+
+  // 3. Fallback: Read/write using the chunk buffer.
+  XcpStreamChunk *chunk = streamBuf->chunk;
+  while (count) {
+    const size_t nBytes = XCP_MIN((size_t)XCP_VDI_STREAM_CHUNK_SIZE, count);
+    if (
+      io_engine_pread(fd, chunk->buf, nBytes, offset, &stream->errorString) < 0 ||
+      write_all(stream, streamBuf->outputFd, chunk->buf, nBytes) < 0
+    )
+      return -1;
+
+    streamBuf->offset += nBytes;
+    offset += nBytes;
+    count -= nBytes;
+  }
+
+  return 0;
+}
+
+// -----------------------------------------------------------------------------
+
+// Drop the first bytes of a write if the start offset is not reached. Returns the dropped byte count.
+static size_t drop_skipped_bytes (XcpStreamBuf *streamBuf, size_t count) {
+  const size_t nBytes = (size_t)XCP_MIN(streamBuf->skip, (uint64_t)count);
+  streamBuf->skip -= nBytes;
+  streamBuf->offset += nBytes;
+  return nBytes;
+}
+
+// Account N written bytes in the current chunk and flush it if necessary.
+static int chunk_commit (XcpVdiStream *stream, size_t count) {
+  XcpStreamBuf *streamBuf = stream->streamBuf;
+  XcpStreamChunk *chunk = streamBuf->chunk;
+
+  chunk->size += count;
   streamBuf->offset += count;
+  assert(chunk->size <= chunk->capacity);
 
-  if (newSize == XCP_VDI_STREAM_CHUNK_SIZE)
+  // Adjacent mappings are merged in one iov: the mapping count can be greater than the iov count.
+  if (chunk->size == chunk->capacity || (streamBuf->vectored && (
+    chunk->iovCount == XCP_VDI_STREAM_IOV_MAX || chunk->mappingCount == XCP_VDI_STREAM_IOV_MAX
+  )))
     return xcp_vdi_stream_co_flush(stream);
   return 0;
 }
 
+int xcp_vdi_stream_co_write (XcpVdiStream *stream, const void *buf, size_t count) {
+  XcpStreamBuf *streamBuf = stream->streamBuf;
+
+  const size_t skipped = drop_skipped_bytes(streamBuf, count);
+  buf = (const char *)buf + skipped;
+  count -= skipped;
+
+  while (count) {
+    XcpStreamChunk *chunk = streamBuf->chunk;
+    const size_t nBytes = XCP_MIN(chunk->capacity - chunk->size, count);
+
+    char *dest = (char *)chunk->buf + chunk->bufSize;
+    memcpy(dest, buf, nBytes);
+    chunk->bufSize += nBytes;
+    if (streamBuf->vectored)
+      chunk_append_iov(chunk, dest, nBytes);
+
+    if (chunk_commit(stream, nBytes) < 0)
+      return -1;
+
+    buf = (const char *)buf + nBytes;
+    count -= nBytes;
+  }
+
+  return 0;
+}
+
+int xcp_vdi_stream_co_write_zeros (XcpVdiStream *stream, size_t count) {
+  XcpStreamBuf *streamBuf = stream->streamBuf;
+
+  count -= drop_skipped_bytes(streamBuf, count);
+
+  while (count) {
+    XcpStreamChunk *chunk = streamBuf->chunk;
+    const size_t nBytes = XCP_MIN(chunk->capacity - chunk->size, count);
+
+    if (!streamBuf->vectored) {
+      memset((char *)chunk->buf + chunk->bufSize, 0, nBytes);
+      chunk->bufSize += nBytes;
+    } else if (chunk->iovCount && chunk->iov[chunk->iovCount - 1].iov_base == ZeroArea)
+      chunk->iov[chunk->iovCount - 1].iov_len += nBytes; // Chunk size <= zero area size.
+    else
+      chunk_append_iov(chunk, ZeroArea, nBytes);
+
+    if (chunk_commit(stream, nBytes) < 0)
+      return -1;
+
+    count -= nBytes;
+  }
+
+  return 0;
+}
+
+// Give the size of an image: the images of a stream are not resized, so fstat is called once per image
+// (again only if the range seems truncated).
+static int get_file_size (XcpVdiStream *stream, int fd, uint64_t end, uint64_t *size) {
+  XcpStreamBuf *streamBuf = stream->streamBuf;
+
+  XcpStreamFileSize *fileSize = NULL;
+  for (size_t i = 0; i < streamBuf->fileSizeCount && !fileSize; ++i)
+    if (streamBuf->fileSizes[i].fd == fd)
+      fileSize = &streamBuf->fileSizes[i];
+
+  if (fileSize && end <= fileSize->size) {
+    *size = fileSize->size;
+    return 0;
+  }
+
+  struct stat st;
+  if (fstat(fd, &st) < 0) {
+    xcp_vdi_stream_set_error_string(stream, "Unable to stat file to map (%s)", strerror(errno));
+    return -1;
+  }
+
+  if (!fileSize) {
+    XcpStreamFileSize *fileSizes = realloc(
+      streamBuf->fileSizes, (streamBuf->fileSizeCount + 1) * sizeof *fileSizes
+    );
+    if (!fileSizes) {
+      xcp_vdi_stream_set_error_string(stream, "Failed to allocate file sizes (%s)", strerror(errno));
+      return -1;
+    }
+    streamBuf->fileSizes = fileSizes;
+    fileSize = &fileSizes[streamBuf->fileSizeCount++];
+    fileSize->fd = fd;
+  }
+
+  *size = fileSize->size = (uint64_t)st.st_size;
+  return 0;
+}
+
+static int map_file (XcpVdiStream *stream, int fd, uint64_t offset, size_t count) {
+  XcpStreamChunk *chunk = stream->streamBuf->chunk;
+  assert(chunk->mappingCount < XCP_VDI_STREAM_IOV_MAX);
+
+  // Accessing a mapping beyond the end of file raises a SIGBUS, so check the file size first.
+  uint64_t fileSize;
+  if (get_file_size(stream, fd, offset + count, &fileSize) < 0)
+    return -1;
+  if (offset + count > fileSize) {
+    xcp_vdi_stream_set_error_string(
+      stream, "Truncated file (size=%" PRIu64 "), cannot map %zuB at offset %#" PRIx64, fileSize, count, offset
+    );
+    return -1;
+  }
+
+  const uint64_t pageMask = (uint64_t)getpagesize() - 1;
+  const size_t delta = (size_t)(offset & pageMask);
+  const size_t size = count + delta;
+
+  void *addr = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, (off_t)(offset - delta));
+  if (addr == MAP_FAILED) {
+    xcp_vdi_stream_set_error_string(
+      stream, "Unable to map %zuB at offset %#" PRIx64 " (%s)", count, offset, strerror(errno)
+    );
+    return -1;
+  }
+
+  chunk->mappings[chunk->mappingCount++] = (XcpStreamMapping){ .addr = addr, .size = size };
+  chunk_append_iov(chunk, (char *)addr + delta, count);
+  return 0;
+}
+
+static int read_file (XcpVdiStream *stream, int fd, uint64_t offset, size_t count) {
+  XcpStreamBuf *streamBuf = stream->streamBuf;
+  XcpStreamChunk *chunk = streamBuf->chunk;
+
+  // With an engine, the read is only queued: it is completed before the chunk flush.
+  void *dest = (char *)chunk->buf + chunk->bufSize;
+  const int ret = streamBuf->ioEngine
+    ? io_engine_read(streamBuf->ioEngine, fd, dest, count, offset, &stream->errorString)
+    : io_engine_pread(fd, dest, count, offset, &stream->errorString);
+  if (ret < 0)
+    return -1;
+
+  chunk->bufSize += count;
+  return 0;
+}
+
+int xcp_vdi_stream_co_write_file (XcpVdiStream *stream, int fd, uint64_t offset, size_t count) {
+  XcpStreamBuf *streamBuf = stream->streamBuf;
+
+  const size_t skipped = drop_skipped_bytes(streamBuf, count);
+  offset += skipped;
+  count -= skipped;
+  if (!count)
+    return 0;
+
+  if (streamBuf->direct)
+    return write_file_to_output(stream, fd, offset, count);
+
+  while (count) {
+    const size_t nBytes = XCP_MIN(streamBuf->chunk->capacity - streamBuf->chunk->size, count);
+
+    const int ret = streamBuf->vectored
+      ? map_file(stream, fd, offset, nBytes)
+      : read_file(stream, fd, offset, nBytes);
+    if (ret < 0 || chunk_commit(stream, nBytes) < 0)
+      return -1;
+
+    offset += nBytes;
+    count -= nBytes;
+  }
+
+  return 0;
+}
+
+void xcp_vdi_stream_co_release_file (XcpVdiStream *stream, int fd, uint64_t offset, uint64_t count) {
+  XcpStreamChunk *chunk = stream->streamBuf->chunk;
+
+  if (chunk->releaseCount) {
+    XcpStreamRelease *last = &chunk->releases[chunk->releaseCount - 1];
+    if (last->fd == fd && last->offset + last->size == offset) {
+      last->size += count;
+      return;
+    }
+  }
+
+  if (chunk->releaseCount == chunk->releaseCapacity) {
+    const size_t capacity = XCP_MAX(chunk->releaseCapacity * 2, (size_t)16);
+    XcpStreamRelease *releases = realloc(chunk->releases, capacity * sizeof *releases);
+    if (!releases) {
+      // Only a hint: the pages are released now.
+      posix_fadvise(fd, (off_t)offset, (off_t)count, POSIX_FADV_DONTNEED);
+      return;
+    }
+    chunk->releases = releases;
+    chunk->releaseCapacity = capacity;
+  }
+
+  chunk->releases[chunk->releaseCount++] = (XcpStreamRelease){ .fd = fd, .offset = offset, .size = count };
+}
+
+int xcp_vdi_stream_co_flush (XcpVdiStream *stream) {
+  XcpStreamBuf *streamBuf = stream->streamBuf;
+  if (!streamBuf->chunk->size)
+    return 0;
+
+  // The queued reads of the chunk must be done before giving it.
+  if (streamBuf->ioEngine && io_engine_wait(streamBuf->ioEngine, &stream->errorString) < 0)
+    return -1;
+
+  if (streamBuf->ring)
+    return ring_push(stream);
+
+  // The range is complete (or the end of the stream is reached): stop the stream.
+  if (streamBuf->ranged) {
+    streamBuf->rangeComplete = true;
+    return -1;
+  }
+
+  if (streamBuf->direct) {
+    XcpStreamChunk *chunk = streamBuf->chunk;
+    const int ret = write_all(stream, streamBuf->outputFd, chunk->buf, chunk->bufSize);
+    chunk_reset(chunk);
+    return ret;
+  }
+
+  streamBuf->coRet = (ssize_t)streamBuf->chunk->size;
+  xcp_coroutine_yield();
+
+  // The coRet can be set to -1 on coroutine destruction.
+  if (streamBuf->coRet < 0)
+    return -1;
+
+  chunk_reset(streamBuf->chunk);
+  streamBuf->coRet = 0;
+
+  return 0;
+}
+
+void xcp_vdi_stream_co_skip (XcpVdiStream *stream, uint64_t count) {
+  XcpStreamBuf *streamBuf = stream->streamBuf;
+  assert(count <= streamBuf->skip);
+
+  streamBuf->skip -= count;
+  streamBuf->offset += count;
+}
+
 uint64_t xcp_vdi_stream_get_current_offset (const XcpVdiStream *stream) {
   return stream->streamBuf->offset;
 }
+
+uint64_t xcp_vdi_stream_get_skip_size (const XcpVdiStream *stream) {
+  return stream->streamBuf->skip;
+}
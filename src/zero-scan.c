@@ -0,0 +1,114 @@
+/*
+ * xcp-ng-vdi-stream
+ * Copyright (C) 2019  Vates SAS - ronan.abhamon@vates.fr
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+#include "simd.h"
+#include "zero-scan.h"
+
+#if defined(__x86_64__) && defined(__GNUC__)
+  #define ZERO_SCAN_X86 1
+  #include <immintrin.h>
+#endif
+
+// =============================================================================
+
+static bool is_zero_scalar (const void *buf, size_t count) {
+  const unsigned char *p = buf;
+
+  uint64_t acc = 0;
+  size_t i = 0;
+  for (; i + 8 <= count; i += 8) {
+    uint64_t word;
+    memcpy(&word, p + i, sizeof word);
+    acc |= word;
+
+    // Most of the non-zero buffers are detected in the first bytes.
+    if ((i & 255) == 248 && acc)
+      return false;
+  }
+  for (; i < count; ++i)
+    acc |= p[i];
+
+  return !acc;
+}
+
+// -----------------------------------------------------------------------------
+
+#ifdef ZERO_SCAN_X86
+
+__attribute__((target("avx2"))) static bool is_zero_avx2 (const void *buf, size_t count) {
+  const unsigned char *p = buf;
+
+  size_t i = 0;
+  for (; i + 128 <= count; i += 128) {
+    const __m256i acc = _mm256_or_si256(
+      _mm256_or_si256(
+        _mm256_loadu_si256((const __m256i *)(p + i)), _mm256_loadu_si256((const __m256i *)(p + i + 32))
+      ),
+      _mm256_or_si256(
+        _mm256_loadu_si256((const __m256i *)(p + i + 64)), _mm256_loadu_si256((const __m256i *)(p + i + 96))
+      )
+    );
+    if (!_mm256_testz_si256(acc, acc))
+      return false;
+  }
+
+  return is_zero_scalar(p + i, count - i);
+}
+
+static bool is_zero_sse2 (const void *buf, size_t count) {
+  const unsigned char *p = buf;
+  const __m128i zero = _mm_setzero_si128();
+
+  size_t i = 0;
+  for (; i + 64 <= count; i += 64) {
+    const __m128i acc = _mm_or_si128(
+      _mm_or_si128(_mm_loadu_si128((const __m128i *)(p + i)), _mm_loadu_si128((const __m128i *)(p + i + 16))),
+      _mm_or_si128(_mm_loadu_si128((const __m128i *)(p + i + 32)), _mm_loadu_si128((const __m128i *)(p + i + 48)))
+    );
+    if (_mm_movemask_epi8(_mm_cmpeq_epi8(acc, zero)) != 0xFFFF)
+      return false;
+  }
+
+  return is_zero_scalar(p + i, count - i);
+}
+
+#endif // ifdef ZERO_SCAN_X86
+
+// =============================================================================
+
+#ifdef ZERO_SCAN_X86
+  // SSE2 is always available on x86-64.
+  static bool (*IsZero)(const void *, size_t) = is_zero_sse2;
+
+  // A kernel can be forced with ZERO_SCAN_KERNEL_ENV to test all of them.
+  static void __attribute__((constructor)) zero_scan_select_kernel () {
+    const SimdLevel level = simd_get_level(ZERO_SCAN_KERNEL_ENV);
+    if (level >= SimdLevelAvx2)
+      IsZero = is_zero_avx2;
+    else if (level == SimdLevelScalar)
+      IsZero = is_zero_scalar;
+  }
+#else
+  static bool (*IsZero)(const void *, size_t) = is_zero_scalar;
+#endif // ifdef ZERO_SCAN_X86
+
+bool zero_scan_is_zero (const void *buf, size_t count) {
+  return (*IsZero)(buf, count);
+}
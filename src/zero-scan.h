@@ -0,0 +1,35 @@
+/*
+ * xcp-ng-vdi-stream
+ * Copyright (C) 2019  Vates SAS - ronan.abhamon@vates.fr
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef _XCP_NG_VDI_STREAM_ZERO_SCAN_H_
+#define _XCP_NG_VDI_STREAM_ZERO_SCAN_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+
+// =============================================================================
+// Detection of zero buffers. On x86-64, an AVX2 kernel is selected at runtime if it is supported,
+// SSE2 is used otherwise.
+// =============================================================================
+
+// Environment variable to force a kernel: scalar, sse2 or avx2 (default, the best supported one).
+#define ZERO_SCAN_KERNEL_ENV "XCP_VDI_STREAM_ZERO_SCAN_KERNEL"
+
+// Returns true if the N bytes of the buffer are zeros.
+bool zero_scan_is_zero (const void *buf, size_t count);
+
+#endif // ifndef _XCP_NG_VDI_STREAM_ZERO_SCAN_H_
@@ -16,17 +16,244 @@
  */
 
 #include <errno.h>
+#include <inttypes.h>
+#include <poll.h>
+#include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
 
 #include "xcp-ng/vdi-stream.h"
 
 // =============================================================================
 
+static void print_usage (const char *program) {
+  fprintf(stderr, "Usage: %s [-o] [-a] [-i <index-dir>] [-c <cache-size>] [-m] [-g] [-b <bitmap>] [-z] [-x deflate|zstd] [-w <compression-workers>] [-e] [-k <cluster-size>] [-r <read-ahead-size>] [-u <queue-depth>] [-s <resume-offset>] [-n | -v | -d | -p <range-size> | -j <workers>] <output> <format> <vdi> [base]\n", program);
+}
+
+static void print_stream_error (const XcpVdiStream *stream) {
+  fprintf(stderr, "Error during stream: `%s`.\n", xcp_vdi_stream_get_error_string(stream));
+}
+
+// Wait the next chunk like an event loop.
+static ssize_t read_non_blocking (XcpVdiStream *stream, const void **buf) {
+  for (;;) {
+    const ssize_t ret = xcp_vdi_stream_read(stream, buf);
+    if (ret != XCP_VDI_STREAM_WOULD_BLOCK) {
+      if (ret < 0)
+        print_stream_error(stream);
+      return ret;
+    }
+
+    struct pollfd pfd = { .fd = xcp_vdi_stream_get_event_fd(stream), .events = POLLIN };
+    if (poll(&pfd, 1, -1) < 0 && errno != EINTR) {
+      fprintf(stderr, "Unable to wait the next chunk because: `%s`.\n", strerror(errno));
+      return -1;
+    }
+  }
+}
+
+// Write the next chunk in the output. Returns -1 if the stream or the write fails (the error is printed).
+static ssize_t read_stream (XcpVdiStream *stream, bool vectored, bool nonBlocking, FILE *output) {
+  if (!vectored) {
+    const void *buf;
+    const ssize_t ret = nonBlocking ? read_non_blocking(stream, &buf) : xcp_vdi_stream_read(stream, &buf);
+    if (ret < 0 && !nonBlocking)
+      print_stream_error(stream);
+    if (ret > 0 && fwrite(buf, (size_t)ret, 1, output) != 1) {
+      fprintf(stderr, "Failed to write stream to file.\n");
+      return -1;
+    }
+    return ret;
+  }
+
+  const struct iovec *iov;
+  int iovcnt;
+  const ssize_t ret = xcp_vdi_stream_readv(stream, &iov, &iovcnt);
+  if (ret < 0)
+    print_stream_error(stream);
+  for (int i = 0; ret > 0 && i < iovcnt; ++i)
+    if (fwrite(iov[i].iov_base, iov[i].iov_len, 1, output) != 1) {
+      fprintf(stderr, "Failed to write stream to file.\n");
+      return -1;
+    }
+  return ret;
+}
+
+// The written stream must have the predicted size.
+static int check_size (XcpVdiStream *stream, FILE *output) {
+  XcpVdiStreamSize size;
+  if (xcp_vdi_stream_get_size(stream, &size) < 0) {
+    fprintf(stderr, "Unable to get stream size because: `%s`.\n", xcp_vdi_stream_get_error_string(stream));
+    return -1;
+  }
+
+  if (fflush(output) == EOF) {
+    fprintf(stderr, "Failed to write stream to file.\n");
+    return -1;
+  }
+
+  struct stat st;
+  if (fstat(fileno(output), &st) < 0 || (uint64_t)st.st_size != size.size) {
+    fprintf(
+      stderr, "Unexpected stream size (expected=%" PRIu64 ", current=%lld).\n", size.size, (long long)st.st_size
+    );
+    return -1;
+  }
+
+  return 0;
+}
+
+// Read the stream by ranges, from the last one to the first one.
+static int pread_stream (XcpVdiStream *stream, size_t rangeSize, uint64_t startOffset, FILE *output) {
+  XcpVdiStreamSize size;
+  if (xcp_vdi_stream_get_size(stream, &size) < 0) {
+    fprintf(stderr, "Unable to get stream size because: `%s`.\n", xcp_vdi_stream_get_error_string(stream));
+    return -1;
+  }
+
+  void *buf = malloc(rangeSize);
+  if (!buf) {
+    fprintf(stderr, "Unable to alloc range buffer.\n");
+    return -1;
+  }
+
+  char error[1024];
+  int ret = 0;
+  for (uint64_t end = size.size; end > startOffset && !ret; ) {
+    const size_t count = end - startOffset < rangeSize ? (size_t)(end - startOffset) : rangeSize;
+    const uint64_t offset = end - count;
+
+    const ssize_t readRet = xcp_vdi_stream_pread(stream, buf, count, offset, error, sizeof error);
+    if (readRet < 0) {
+      fprintf(stderr, "Error during stream: `%s`.\n", error);
+      ret = -1;
+    } else if ((size_t)readRet != count) {
+      fprintf(stderr, "Truncated range at offset %" PRIu64 ".\n", offset);
+      ret = -1;
+    } else if (pwrite(fileno(output), buf, count, (off_t)offset) != (ssize_t)count) {
+      fprintf(stderr, "Failed to write stream to file.\n");
+      ret = -1;
+    }
+
+    end = offset;
+  }
+
+  free(buf);
+  return ret;
+}
+
+static int write_shard (const void *buf, size_t count, uint64_t offset, void *userData) {
+  FILE *output = userData;
+  return pwrite(fileno(output), buf, count, (off_t)offset) == (ssize_t)count ? 0 : -1;
+}
+
 int main (int argc, char *argv[]) {
+  const char *program = *argv;
+  size_t readAheadSize = 0;
+  long queueDepth = -1;
+  bool directIo = false;
+  bool prefetch = false;
+  const char *indexDir = NULL;
+  long long cacheSize = -1;
+  bool metadataPreload = false;
+  bool shareImages = false;
+  const char *dirtyBitmap = NULL;
+  bool zeroDetection = false;
+  XcpVdiStreamCompression compression = XCP_VDI_STREAM_COMPRESSION_NONE;
+  unsigned compressionWorkerCount = 0;
+  bool extendedL2 = false;
+  unsigned long clusterSize = 0;
+  long long resumeOffset = -1;
+  size_t rangeSize = 0;
+  unsigned workerCount = 0;
+  bool nonBlocking = false;
+  bool vectored = false;
+  bool direct = false;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "oai:c:mgb:zx:w:ek:r:u:s:nvdp:j:")) != -1) {
+    switch (opt) {
+      case 'o':
+        directIo = true;
+        break;
+      case 'a':
+        prefetch = true;
+        break;
+      case 'i':
+        indexDir = optarg;
+        break;
+      case 'c':
+        cacheSize = strtoll(optarg, NULL, 10);
+        break;
+      case 'm':
+        metadataPreload = true;
+        break;
+      case 'g':
+        shareImages = true;
+        break;
+      case 'b':
+        dirtyBitmap = optarg;
+        break;
+      case 'z':
+        zeroDetection = true;
+        break;
+      case 'x':
+        if (!strcmp(optarg, "deflate"))
+          compression = XCP_VDI_STREAM_COMPRESSION_DEFLATE;
+        else if (!strcmp(optarg, "zstd"))
+          compression = XCP_VDI_STREAM_COMPRESSION_ZSTD;
+        else {
+          print_usage(program);
+          return EXIT_FAILURE;
+        }
+        break;
+      case 'w':
+        compressionWorkerCount = (unsigned)strtoul(optarg, NULL, 10);
+        break;
+      case 'e':
+        extendedL2 = true;
+        break;
+      case 'k':
+        clusterSize = strtoul(optarg, NULL, 10);
+        break;
+      case 'r':
+        readAheadSize = strtoul(optarg, NULL, 10);
+        break;
+      case 'u':
+        queueDepth = strtol(optarg, NULL, 10);
+        break;
+      case 's':
+        resumeOffset = strtoll(optarg, NULL, 10);
+        break;
+      case 'n':
+        nonBlocking = true;
+        break;
+      case 'v':
+        vectored = true;
+        break;
+      case 'd':
+        direct = true;
+        break;
+      case 'p':
+        rangeSize = strtoul(optarg, NULL, 10);
+        break;
+      case 'j':
+        workerCount = (unsigned)strtoul(optarg, NULL, 10);
+        break;
+      default:
+        print_usage(program);
+        return EXIT_FAILURE;
+    }
+  }
+  argc -= optind - 1;
+  argv += optind - 1;
+
   if (argc < 4) {
-    fprintf(stderr, "Usage: %s <output> <format> <vdi> [base]\n", *argv);
+    print_usage(program);
     return EXIT_FAILURE;
   }
 
@@ -38,32 +265,168 @@ int main (int argc, char *argv[]) {
     goto fail;
   }
 
+  if (xcp_vdi_stream_set_direct_io(stream, directIo) < 0) {
+    fprintf(stderr, "Unable to set direct I/O because: `%s`.\n", xcp_vdi_stream_get_error_string(stream));
+    goto fail;
+  }
+
+  if (xcp_vdi_stream_set_index_dir(stream, indexDir) < 0) {
+    fprintf(stderr, "Unable to set index dir because: `%s`.\n", xcp_vdi_stream_get_error_string(stream));
+    goto fail;
+  }
+
+  if (cacheSize >= 0 && xcp_vdi_stream_set_cache_size(stream, (size_t)cacheSize) < 0) {
+    fprintf(stderr, "Unable to set cache size because: `%s`.\n", xcp_vdi_stream_get_error_string(stream));
+    goto fail;
+  }
+
+  if (xcp_vdi_stream_set_metadata_preload(stream, metadataPreload) < 0) {
+    fprintf(stderr, "Unable to set metadata preload because: `%s`.\n", xcp_vdi_stream_get_error_string(stream));
+    goto fail;
+  }
+
+  if (xcp_vdi_stream_set_image_sharing(stream, shareImages) < 0) {
+    fprintf(stderr, "Unable to set image sharing because: `%s`.\n", xcp_vdi_stream_get_error_string(stream));
+    goto fail;
+  }
+
+  if (xcp_vdi_stream_set_dirty_bitmap(stream, dirtyBitmap) < 0) {
+    fprintf(stderr, "Unable to set dirty bitmap because: `%s`.\n", xcp_vdi_stream_get_error_string(stream));
+    goto fail;
+  }
+
+  if (xcp_vdi_stream_set_zero_detection(stream, zeroDetection) < 0) {
+    fprintf(stderr, "Unable to set zero detection because: `%s`.\n", xcp_vdi_stream_get_error_string(stream));
+    goto fail;
+  }
+
+  if (xcp_vdi_stream_set_compression(stream, compression, compressionWorkerCount) < 0) {
+    fprintf(stderr, "Unable to set compression because: `%s`.\n", xcp_vdi_stream_get_error_string(stream));
+    goto fail;
+  }
+
+  if (xcp_vdi_stream_set_extended_l2(stream, extendedL2) < 0) {
+    fprintf(stderr, "Unable to set extended L2 entries because: `%s`.\n", xcp_vdi_stream_get_error_string(stream));
+    goto fail;
+  }
+
+  if (xcp_vdi_stream_set_cluster_size(stream, (uint32_t)clusterSize) < 0) {
+    fprintf(stderr, "Unable to set cluster size because: `%s`.\n", xcp_vdi_stream_get_error_string(stream));
+    goto fail;
+  }
+
+  if (xcp_vdi_stream_set_prefetch(stream, prefetch) < 0) {
+    fprintf(stderr, "Unable to set prefetch because: `%s`.\n", xcp_vdi_stream_get_error_string(stream));
+    goto fail;
+  }
+
+  if (xcp_vdi_stream_set_read_ahead(stream, readAheadSize) < 0) {
+    fprintf(stderr, "Unable to set read-ahead because: `%s`.\n", xcp_vdi_stream_get_error_string(stream));
+    goto fail;
+  }
+
+  // Use io_uring with all its options to read the images.
+  if (queueDepth >= 0 && xcp_vdi_stream_set_io_engine(
+    stream,
+    XCP_VDI_STREAM_IO_ENGINE_IO_URING,
+    (unsigned)queueDepth,
+    XCP_VDI_STREAM_IO_FIXED_FILES | XCP_VDI_STREAM_IO_FIXED_BUFFERS
+  ) < 0) {
+    fprintf(stderr, "Unable to set I/O engine because: `%s`.\n", xcp_vdi_stream_get_error_string(stream));
+    goto fail;
+  }
+
+  if (xcp_vdi_stream_set_non_blocking(stream, nonBlocking) < 0) {
+    fprintf(stderr, "Unable to set non-blocking mode because: `%s`.\n", xcp_vdi_stream_get_error_string(stream));
+    goto fail;
+  }
+
   if (xcp_vdi_stream_open(stream, argv[2], argv[3], argc >= 5 ? argv[4] : NULL) < 0) {
     fprintf(stderr, "Unable to open stream because: `%s`.\n", xcp_vdi_stream_get_error_string(stream));
     goto fail;
   }
 
-  if (!(output = fopen(argv[1], "wb"))) {
+  if (!(output = fopen(argv[1], resumeOffset < 0 ? "wb" : "r+b"))) {
     fprintf(stderr, "Unable to open `%s` because: `%s`.\n", argv[1], strerror(errno));
     goto fail;
   }
 
-  for (;;) {
-    const void *buf;
-    const ssize_t ret = xcp_vdi_stream_read(stream, &buf);
-    if (ret < 0) {
+  // Resume an interrupted export: keep the bytes before the offset and stream the next ones.
+  // The file must contain these bytes and the offset must be in the stream.
+  if (resumeOffset >= 0) {
+    struct stat st;
+    XcpVdiStreamSize size;
+    if (fstat(fileno(output), &st) < 0) {
+      fprintf(stderr, "Unable to resume `%s` because: `%s`.\n", argv[1], strerror(errno));
+      goto fail;
+    }
+    if (xcp_vdi_stream_get_size(stream, &size) < 0) {
+      fprintf(stderr, "Unable to get stream size because: `%s`.\n", xcp_vdi_stream_get_error_string(stream));
+      goto fail;
+    }
+    if ((uint64_t)resumeOffset > (uint64_t)st.st_size || (uint64_t)resumeOffset > size.size) {
+      fprintf(
+        stderr, "Unable to resume `%s` at offset %lld (file size=%lld, stream size=%" PRIu64 ").\n",
+        argv[1], resumeOffset, (long long)st.st_size, size.size
+      );
+      goto fail;
+    }
+    if (
+      ftruncate(fileno(output), (off_t)resumeOffset) < 0 ||
+      fseeko(output, (off_t)resumeOffset, SEEK_SET) < 0
+    ) {
+      fprintf(stderr, "Unable to resume `%s` because: `%s`.\n", argv[1], strerror(errno));
+      goto fail;
+    }
+    if (xcp_vdi_stream_seek(stream, (uint64_t)resumeOffset) < 0) {
+      fprintf(stderr, "Unable to seek stream because: `%s`.\n", xcp_vdi_stream_get_error_string(stream));
+      goto fail;
+    }
+  }
+
+  // Shards are written out of order, the range size is used as shard size.
+  if (workerCount) {
+    if (xcp_vdi_stream_export_shards(stream, workerCount, rangeSize, false, write_shard, output) < 0) {
       fprintf(stderr, "Error during stream: `%s`.\n", xcp_vdi_stream_get_error_string(stream));
       goto fail;
     }
-    if (ret == 0)
-      break; // Terminated. \o/
+    goto done;
+  }
 
-    if (fwrite(buf, (size_t)ret, 1, output) != 1) {
-      fprintf(stderr, "Failed to write stream to file.\n");
+  if (rangeSize) {
+    if (pread_stream(stream, rangeSize, resumeOffset < 0 ? 0 : (uint64_t)resumeOffset, output) < 0)
+      goto fail;
+    goto done;
+  }
+
+  if (direct) {
+    if (xcp_vdi_stream_write_to_fd(stream, fileno(output)) < 0) {
+      fprintf(stderr, "Error during stream: `%s`.\n", xcp_vdi_stream_get_error_string(stream));
       goto fail;
     }
+    goto done;
   }
 
+  for (;;) {
+    const ssize_t ret = read_stream(stream, vectored, nonBlocking, output);
+    if (ret < 0)
+      goto fail;
+    if (ret == 0)
+      break; // Terminated. \o/
+  }
+
+done:
+  if (check_size(stream, output) < 0)
+    goto fail;
+
+  // Show the cache efficiency if its size is given.
+  XcpVdiStreamCacheStats stats;
+  if (cacheSize >= 0 && xcp_vdi_stream_get_cache_stats(stream, &stats) == 0)
+    fprintf(
+      stderr, "Cache: %" PRIu64 " hits, %" PRIu64 " misses, %" PRIu64 " evictions, %zu bytes.\n",
+      stats.hits, stats.misses, stats.evictions, stats.memoryUsage
+    );
+
   goto success;
 
 fail: